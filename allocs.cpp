@@ -0,0 +1,148 @@
+#include "allocs.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include <unistd.h>
+
+namespace allocs {
+
+// plain integers, so that counting on one thread costs nothing on another
+static thread_local uint64_t threadCount = 0, threadBytes = 0, threadFrees = 0;
+static std::atomic<uint64_t> count(0), bytes(0), frees(0);
+static std::atomic<bool> forbidden(false);
+
+uint64_t getThreadCount() { return threadCount; }
+uint64_t getThreadBytes() { return threadBytes; }
+uint64_t getThreadFrees() { return threadFrees; }
+
+uint64_t getCount() { return count.load(std::memory_order_relaxed); }
+uint64_t getBytes() { return bytes.load(std::memory_order_relaxed); }
+uint64_t getFrees() { return frees.load(std::memory_order_relaxed); }
+
+// what the frame did, and abort; nothing here may allocate
+static void fail(const char* message)
+{
+    ssize_t written = write(2, message, std::strlen(message));
+    (void) written;
+    std::abort();
+}
+
+void record(size_t size)
+{
+    if (forbidden.load(std::memory_order_relaxed)) {
+        char message[128];
+        std::snprintf(message, sizeof(message),
+                "allocation of %zu bytes in a frame that must not allocate\n", size);
+        fail(message);
+    }
+    threadCount++;
+    threadBytes += size;
+    count.fetch_add(1, std::memory_order_relaxed);
+    bytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+void recordFree()
+{
+    if (forbidden.load(std::memory_order_relaxed))
+        fail("free in a frame that must not allocate\n");
+    threadFrees++;
+    frees.fetch_add(1, std::memory_order_relaxed);
+}
+
+void forbid(bool forbid)
+{
+    forbidden.store(forbid, std::memory_order_relaxed);
+}
+
+bool isForbidden()
+{
+    return forbidden.load(std::memory_order_relaxed);
+}
+
+static void* allocate(size_t size)
+{
+    record(size);
+    for (;;) {
+        if (void* memory = std::malloc(size ? size : 1))
+            return memory;
+        std::new_handler handler = std::get_new_handler();
+        if (!handler)
+            throw std::bad_alloc();
+        handler();
+    }
+}
+
+// deleting null frees nothing
+static void release(void* memory)
+{
+    if (!memory)
+        return;
+    recordFree();
+    std::free(memory);
+}
+
+} // namespace allocs
+
+void* operator new(size_t size)
+{
+    return allocs::allocate(size);
+}
+
+void* operator new[](size_t size)
+{
+    return allocs::allocate(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    try {
+        return allocs::allocate(size);
+    } catch (const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+    try {
+        return allocs::allocate(size);
+    } catch (const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void operator delete(void* memory) noexcept
+{
+    allocs::release(memory);
+}
+
+void operator delete[](void* memory) noexcept
+{
+    allocs::release(memory);
+}
+
+void operator delete(void* memory, const std::nothrow_t&) noexcept
+{
+    allocs::release(memory);
+}
+
+void operator delete[](void* memory, const std::nothrow_t&) noexcept
+{
+    allocs::release(memory);
+}
+
+#if __cpp_sized_deallocation
+void operator delete(void* memory, size_t) noexcept
+{
+    allocs::release(memory);
+}
+
+void operator delete[](void* memory, size_t) noexcept
+{
+    allocs::release(memory);
+}
+#endif
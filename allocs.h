@@ -0,0 +1,85 @@
+#ifndef GRAVITY_ALLOCS_H
+#define GRAVITY_ALLOCS_H
+
+// Counts of heap allocations, to hold the frame loop to allocating nothing
+// once it has warmed up: allocator locks and page faults show up in the
+// slowest frames, not the average.
+//
+// allocs.cpp replaces the global operator new and delete, so everything
+// allocated and freed through them, including by the standard containers,
+// is counted; the replacement is linked in by calling any of these
+// functions. Memory that bypasses new, like the mappings of numaAllocate
+// and Arena, counts through record() and recordFree(). malloc and free
+// calls from C libraries are not seen.
+
+#include <cstddef>
+#include <cstdint>
+
+namespace allocs {
+
+// allocations, and the bytes they asked for, by the calling thread so far
+uint64_t getThreadCount();
+uint64_t getThreadBytes();
+
+// frees by the calling thread so far; a free takes the allocator's locks
+// as much as an allocation does
+uint64_t getThreadFrees();
+
+// by every thread
+uint64_t getCount();
+uint64_t getBytes();
+uint64_t getFrees();
+
+// count an allocation made some other way than new, and its free
+void record(size_t bytes);
+void recordFree();
+
+// while forbidden, any allocation or free on any thread prints what it was
+// and aborts, so a debugger or core dump shows where it came from
+void forbid(bool forbidden);
+bool isForbidden();
+
+// forbid allocations and frees for the rest of the enclosing block, if check is set
+class Forbid {
+public:
+    explicit Forbid(bool check) : check(check)
+    {
+        if (check)
+            forbid(true);
+    }
+
+    ~Forbid()
+    {
+        if (check)
+            forbid(false);
+    }
+
+    Forbid(const Forbid&) = delete;
+    Forbid& operator=(const Forbid&) = delete;
+
+private:
+    bool check;
+};
+
+// allow them again for the rest of the enclosing block, if allow is set,
+// for diagnostics such as a stall trace that are worth their allocations
+class Allow {
+public:
+    explicit Allow(bool allow = true) : was(isForbidden())
+    {
+        if (allow)
+            forbid(false);
+    }
+
+    ~Allow() { forbid(was); }
+
+    Allow(const Allow&) = delete;
+    Allow& operator=(const Allow&) = delete;
+
+private:
+    bool was;
+};
+
+} // namespace allocs
+
+#endif
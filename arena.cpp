@@ -0,0 +1,143 @@
+#include "arena.h"
+#include "allocs.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <new>
+
+#include <sys/mman.h>
+
+static const size_t hugePage = 2 << 20;
+
+static size_t roundUp(size_t bytes)
+{
+    return (std::max<size_t>(bytes, 1) + hugePage - 1) / hugePage * hugePage;
+}
+
+void* mapHugePages(size_t bytes, PageKind* kind)
+{
+    bytes = roundUp(bytes);
+    PageKind got = SMALL_PAGES;
+    void* memory = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    // fails straight away when too few are reserved, which is usual
+    memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (memory != MAP_FAILED)
+        got = EXPLICIT_HUGE_PAGES;
+#endif
+    if (memory == MAP_FAILED) {
+        // map a huge page more than needed and trim both ends, so that the
+        // kernel can back every 2 MB of it with one page
+        size_t padded = bytes + hugePage;
+        char* mapped = static_cast<char*>(mmap(nullptr, padded, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (mapped == MAP_FAILED)
+            return nullptr;
+        char* aligned = reinterpret_cast<char*>(
+                (uintptr_t(mapped) + hugePage - 1) / hugePage * hugePage);
+        if (aligned > mapped)
+            munmap(mapped, aligned - mapped);
+        if (aligned + bytes < mapped + padded)
+            munmap(aligned + bytes, mapped + padded - (aligned + bytes));
+        memory = aligned;
+#ifdef MADV_HUGEPAGE
+        if (madvise(memory, bytes, MADV_HUGEPAGE) == 0)
+            got = TRANSPARENT_HUGE_PAGES;
+#endif
+    }
+    // counted once it is known to have been made
+    allocs::record(bytes);
+    if (kind)
+        *kind = got;
+    return memory;
+}
+
+void unmapHugePages(void* memory, size_t bytes)
+{
+    if (memory) {
+        munmap(memory, roundUp(bytes));
+        allocs::recordFree();
+    }
+}
+
+const char* pageKindName(PageKind kind)
+{
+    static const char* const names[] = {
+        "small pages", "transparent huge pages", "explicit huge pages"
+    };
+    return names[kind];
+}
+
+Arena::~Arena()
+{
+    for (size_t i = 0; i < blocks.size(); i++)
+        unmapHugePages(blocks[i].memory, blocks[i].bytes);
+}
+
+void* Arena::allocate(size_t bytes, size_t alignment)
+{
+    size_t offset = (used + alignment - 1) / alignment * alignment;
+    if (blocks.empty() || offset + bytes > blocks.back().bytes) {
+        // blocks start on a huge page, so any smaller alignment holds
+        size_t size = std::max(bytes, blocks.empty() ? hugePage : 2 * blocks.back().bytes);
+        Block block;
+        block.bytes = roundUp(size);
+        block.memory = static_cast<char*>(mapHugePages(block.bytes, &block.kind));
+        if (!block.memory)
+            throw std::bad_alloc();
+        blocks.push_back(block);
+        offset = 0;
+    }
+    used = offset + bytes;
+    return blocks.back().memory + offset;
+}
+
+void Arena::reset()
+{
+    used = 0;
+    if (blocks.size() <= 1)
+        return;
+
+    size_t total = getCapacity();
+    for (size_t i = 0; i < blocks.size(); i++)
+        unmapHugePages(blocks[i].memory, blocks[i].bytes);
+    blocks.clear();
+
+    Block block;
+    block.bytes = total;
+    block.memory = static_cast<char*>(mapHugePages(total, &block.kind));
+    // if that fails, the next allocation starts over from nothing
+    if (block.memory)
+        blocks.push_back(block);
+}
+
+void Arena::reserve(size_t bytes)
+{
+    used = 0;
+    size_t total = std::max(roundUp(bytes), getCapacity());
+    if (blocks.size() == 1 && blocks[0].bytes >= total)
+        return;
+    for (size_t i = 0; i < blocks.size(); i++)
+        unmapHugePages(blocks[i].memory, blocks[i].bytes);
+    blocks.clear();
+
+    Block block;
+    block.bytes = total;
+    block.memory = static_cast<char*>(mapHugePages(total, &block.kind));
+    if (block.memory)
+        blocks.push_back(block);
+}
+
+size_t Arena::getCapacity() const
+{
+    size_t total = 0;
+    for (size_t i = 0; i < blocks.size(); i++)
+        total += blocks[i].bytes;
+    return total;
+}
+
+PageKind Arena::getPageKind() const
+{
+    return blocks.empty() ? SMALL_PAGES : blocks[0].kind;
+}
@@ -0,0 +1,70 @@
+#ifndef GRAVITY_ARENA_H
+#define GRAVITY_ARENA_H
+
+#include <cstddef>
+#include <vector>
+
+// Large arrays on 2 MB pages. A pass over 1e8 particles touches 1.6 GB,
+// which is 400000 ordinary pages but only 800 huge ones, so the TLB keeps
+// up instead of missing on every new page.
+
+enum PageKind {
+    SMALL_PAGES,
+    TRANSPARENT_HUGE_PAGES, // ordinary pages the kernel merges when it can
+    EXPLICIT_HUGE_PAGES     // from the pool reserved in /proc/sys/vm/nr_hugepages
+};
+
+// anonymous memory of at least bytes, 2 MB aligned: explicit huge pages if
+// enough are reserved, else ordinary ones marked for transparent huge
+// pages; nullptr on failure. *kind, if given, says which it got.
+void* mapHugePages(size_t bytes, PageKind* kind = nullptr);
+void unmapHugePages(void* memory, size_t bytes);
+
+// "small pages" and so on, for reports
+const char* pageKindName(PageKind kind);
+
+// Bump allocator for scratch that lives for one step, used from one thread.
+// Allocations are carved off huge page blocks and never freed one by one;
+// reset() drops them all at once. After a reset that had to add blocks,
+// the blocks are swapped for one that holds as much, so once a step has
+// run, the same step again maps nothing.
+class Arena {
+public:
+    Arena() : used(0) {}
+    ~Arena();
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    // valid until the next reset; throws std::bad_alloc like new when out
+    // of memory
+    void* allocate(size_t bytes, size_t alignment = 64);
+
+    template <typename T>
+    T* allocate(size_t count)
+    {
+        return static_cast<T*>(allocate(count * sizeof(T), alignof(T) > 64 ? alignof(T) : 64));
+    }
+
+    void reset();
+
+    // reset, with one block of at least bytes, so that steps allocating no
+    // more than that in all map nothing, not even the first time
+    void reserve(size_t bytes);
+
+    // bytes mapped, and the page kind of the first block
+    size_t getCapacity() const;
+    PageKind getPageKind() const;
+
+private:
+    struct Block {
+        char* memory;
+        size_t bytes;
+        PageKind kind;
+    };
+
+    std::vector<Block> blocks; // the last is the one being filled
+    size_t used; // bytes of the last block handed out
+};
+
+#endif
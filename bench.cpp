@@ -0,0 +1,252 @@
+// Microbenchmarks of the CPU engine stages, reporting the median of several
+// runs so that one slow run does not skew the numbers.
+
+#include <algorithm>
+#include <cmath>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "diagnostics.h"
+#include "lifecycle.h"
+#include "numa.h"
+#include "packed.h"
+#include "particles.h"
+#include "primitives.h"
+#include "raster.h"
+#include "simulate.h"
+#include "threadpool.h"
+
+typedef std::chrono::steady_clock Clock;
+
+// median seconds per call of fn
+static double timeMedian(int repeats, const std::function<void()>& fn)
+{
+    std::vector<double> times;
+    for (int i = 0; i < repeats; i++) {
+        Clock::time_point start = Clock::now();
+        fn();
+        times.push_back(std::chrono::duration<double>(Clock::now() - start).count());
+    }
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+static void report(const char* name, int threads, size_t items, const char* unit,
+        double seconds)
+{
+    std::printf("%-16s %4d %10.3f ms %10.1f M%s/s\n",
+            name, threads, seconds * 1e3, items * 1e-6 / seconds, unit);
+}
+
+static void usage(const char* name)
+{
+    std::cerr << "usage: " << name << " [options]\n"
+        "  --particles N      particles per run (default 10000000)\n"
+        "  --capacity N       room the placed particles are allocated for\n"
+        "                     (default twice --particles)\n"
+        "  --threads N        worker threads, 0 for one per core (default 0)\n"
+        "  --pin              keep each thread on one CPU, node by node\n"
+        "  --size WxH         raster size (default 1920x1080)\n"
+        "  --repeat N         runs per benchmark (default 11)\n";
+}
+
+int main(int argc, char** argv)
+{
+    long long numParticles = 10000000;
+    long long capacity = 0;
+    int threads = 0;
+    int width = 1920, height = 1080;
+    int repeats = 11;
+    bool pin = false;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--particles" && i + 1 < argc) {
+            numParticles = std::atoll(argv[++i]);
+        } else if (arg == "--capacity" && i + 1 < argc) {
+            capacity = std::atoll(argv[++i]);
+        } else if (arg == "--threads" && i + 1 < argc) {
+            threads = std::atoi(argv[++i]);
+        } else if (arg == "--pin") {
+            pin = true;
+        } else if (arg == "--size" && i + 1 < argc) {
+            if (std::sscanf(argv[++i], "%dx%d", &width, &height) != 2
+                    || width <= 0 || height <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--repeat" && i + 1 < argc) {
+            repeats = std::atoi(argv[++i]);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (capacity == 0)
+        capacity = 2 * numParticles;
+    if (numParticles < 1 || capacity < numParticles || repeats < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    ThreadPool pool(threads, pin);
+    std::vector<Particle> particles = randomParticles(size_t(numParticles));
+    size_t count = particles.size();
+    const float dt = 1.0f / 60.0f;
+
+    // let the particles fall in a little so the raster sees a realistic,
+    // clustered distribution rather than a uniform one
+    for (int i = 0; i < 30; i++)
+        stepParticles(pool, &particles[0], count, dt, 0.0f, 0.0f);
+
+    std::printf("%-16s %4s %13s %21s\n", "benchmark", "thr", "median", "throughput");
+
+    report("step", 1, count, "particles", timeMedian(repeats, [&] {
+        stepParticles(&particles[0], count, dt, 0.0f, 0.0f);
+    }));
+    report("step", pool.size(), count, "particles", timeMedian(repeats, [&] {
+        stepParticles(pool, &particles[0], count, dt, 0.0f, 0.0f);
+    }));
+
+    // the same particles placed each way: the heap copy above was filled by
+    // this thread alone, so on a machine with several nodes most of it is
+    // remote to most of the pool
+    double local[NUMA_INTERLEAVE + 1];
+    local[NUMA_HEAP] = numaLocalFraction(&particles[0], count * sizeof(Particle), pool);
+    for (int i = NUMA_FIRST_TOUCH; i <= NUMA_INTERLEAVE; i++) {
+        NumaPlacement placement = NumaPlacement(i);
+        ParticleVector placed(particles.begin(), particles.end(),
+                NumaAllocator<Particle>(pool, placement));
+        local[i] = numaLocalFraction(&placed[0], count * sizeof(Particle), pool);
+        std::string name = std::string("step ") + numaPlacementName(placement);
+        report(name.c_str(), pool.size(), count, "particles", timeMedian(repeats, [&] {
+            stepParticles(pool, &placed[0], count, dt, 0.0f, 0.0f);
+        }));
+    }
+
+    // placed for more than are live, as with emitters, and stepped from
+    // the shares of the capacity that placed them; the fraction by the
+    // shares of the live count alone is what splitting by it would see
+    double capacityLocal, liveLocal;
+    {
+        ParticleVector placed(NumaAllocator<Particle>(pool, NUMA_FIRST_TOUCH));
+        placed.reserve(size_t(capacity));
+        placed.assign(particles.begin(), particles.end());
+        capacityLocal = numaLocalFraction(&placed[0], count * sizeof(Particle), pool,
+                placed.capacity() * sizeof(Particle));
+        liveLocal = numaLocalFraction(&placed[0], count * sizeof(Particle), pool);
+        CursorField cursor;
+        report("step capacity", pool.size(), count, "particles", timeMedian(repeats, [&] {
+            stepParticles(pool, cursor, &placed[0], count, placed.capacity(), dt);
+        }));
+    }
+
+    // with the energy, momentum and box added up in the same pass
+    Diagnostics diagnostics;
+    report("step diagnostics", pool.size(), count, "particles", timeMedian(repeats, [&] {
+        diagnostics.clear();
+        stepParticles(pool, CursorField(), &particles[0], count, dt, &diagnostics);
+    }));
+
+    // every kind of force term fused into one loop
+    MixedField mixed = makeMixedField();
+    report("step mixed", pool.size(), count, "particles", timeMedian(repeats, [&] {
+        stepParticles(pool, mixed, &particles[0], count, dt);
+    }));
+
+    // half the bytes per particle, for the unpacking and packing
+    std::vector<PackedParticle> packed = packParticles(&particles[0], count);
+    CursorField cursor;
+    report("step compact", pool.size(), count, "particles", timeMedian(repeats, [&] {
+        stepParticles(pool, cursor, &packed[0], count, dt);
+    }));
+
+    // what the packing costs in precision, over the particles as they are
+    double positionError = 0.0, velocityError = 0.0;
+    for (size_t i = 0; i < count; i++) {
+        Particle p = particles[i], q = unpackParticle(packParticle(p));
+        positionError = std::max(positionError,
+                double(std::max(std::fabs(q.x - p.x), std::fabs(q.y - p.y))));
+        float speed = std::max(std::fabs(p.vx), std::fabs(p.vy));
+        if (speed > 1e-3f)
+            velocityError = std::max(velocityError,
+                    double(std::max(std::fabs(q.vx - p.vx), std::fabs(q.vy - p.vy)) / speed));
+    }
+
+    // the stream compaction behind sinks, with one around the source
+    Lifecycle lifecycle;
+    Sink sink = { 0.0f, 0.0f, 0.1f };
+    lifecycle.addSink(sink);
+    std::vector<Particle> culled(count);
+    size_t live = 0;
+    report("cull", pool.size(), count, "particles", timeMedian(repeats, [&] {
+        live = lifecycle.cull(pool, &particles[0], count, &culled[0]);
+    }));
+
+    // the scans under compaction, and binning the particles by sorting
+    // them by cell, with a 256 x 256 grid's 16-bit keys
+    CpuPrimitives primitives(pool);
+    std::vector<uint32_t> values(count), flags(count), sums(count);
+    for (size_t i = 0; i < count; i++) {
+        values[i] = uint32_t(i * 2654435761u);
+        flags[i] = values[i] % 64 == 0;
+    }
+    report("reduce", pool.size(), count, "values", timeMedian(repeats, [&] {
+        primitives.reduce(&values[0], count);
+    }));
+    report("scan", pool.size(), count, "values", timeMedian(repeats, [&] {
+        primitives.exclusiveScan(&values[0], count, &sums[0]);
+    }));
+    report("segmented scan", pool.size(), count, "values", timeMedian(repeats, [&] {
+        primitives.segmentedScan(&values[0], &flags[0], count, &sums[0]);
+    }));
+    std::vector<uint32_t> keys(count), indices(count);
+    report("sort cells", pool.size(), count, "particles", timeMedian(repeats, [&] {
+        primitives.cellKeys(&particles[0], count, 256, 256, &keys[0], &indices[0]);
+        primitives.sortPairs(&keys[0], &indices[0], count, 16);
+    }));
+
+    SoftRasterizer rasterizer(pool, width, height);
+    report("render", pool.size(), count, "particles", timeMedian(repeats, [&] {
+        rasterizer.render(&particles[0], count);
+    }));
+
+    report("render compact", pool.size(), count, "particles", timeMedian(repeats, [&] {
+        rasterizer.render(&packed[0], count);
+    }));
+
+    std::vector<unsigned char> image(3 * size_t(width) * height);
+    report("tonemap", pool.size(), size_t(width) * height, "pixels", timeMedian(repeats, [&] {
+        rasterizer.tonemap(&image[0]);
+    }));
+
+    // from where the pages are rather than counted accesses, which needs
+    // node counters most virtual machines do not have
+    std::printf("pages on the node of the thread stepping them, of %d node%s:",
+            numaNodeCount(), numaNodeCount() > 1 ? "s" : "");
+    for (int i = NUMA_HEAP; i <= NUMA_INTERLEAVE; i++) {
+        if (local[i] < 0.0)
+            std::printf(" %s unknown", numaPlacementName(NumaPlacement(i)));
+        else
+            std::printf(" %s %.1f%% local %.1f%% remote", numaPlacementName(NumaPlacement(i)),
+                    100.0 * local[i], 100.0 * (1.0 - local[i]));
+        std::printf(i < NUMA_INTERLEAVE ? "," : "\n");
+    }
+    if (capacityLocal < 0.0)
+        std::printf("with room for %lld: unknown\n", capacity);
+    else
+        std::printf("with room for %lld: %.1f%% local, %.1f%% if split by the live count\n",
+                capacity, 100.0 * capacityLocal, 100.0 * liveLocal);
+
+    std::printf("cull kept %zu of %zu particles\n", live, count);
+    std::printf("compact storage error: position %.2g of the box, velocity %.2g of the speed\n",
+            positionError / 2.0, velocityError);
+
+    return 0;
+}
@@ -0,0 +1,319 @@
+#include "context.h"
+#include "image.h"
+
+#include <GLFW/glfw3.h>
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+#ifdef HAVE_EGL
+#define EGL_NO_X11
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+namespace {
+
+bool initGlew()
+{
+    glewExperimental = GL_TRUE;
+    GLenum err = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+    // GLEW probes GLX once the entry points are loaded, which fails on a
+    // surfaceless EGL context; the GL functions themselves are fine
+    if (err == GLEW_ERROR_NO_GLX_DISPLAY)
+        err = GLEW_OK;
+#endif
+    if (err != GLEW_OK) {
+        std::cerr << "failed to initialise GLEW: " << glewGetErrorString(err) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// a hidden window with no framebuffer anyone looks at
+class SharedWindowContext : public SharedContext {
+public:
+    explicit SharedWindowContext(GLFWwindow* window) : window(window) {}
+    ~SharedWindowContext() { glfwDestroyWindow(window); }
+
+    bool makeCurrent() { glfwMakeContextCurrent(window); return true; }
+    void doneCurrent() { glfwMakeContextCurrent(nullptr); }
+
+private:
+    GLFWwindow* window;
+};
+
+class WindowContext : public Context {
+public:
+    explicit WindowContext(GLFWwindow* window) : window(window) {}
+
+    ~WindowContext()
+    {
+        glfwDestroyWindow(window);
+        glfwTerminate();
+    }
+
+    bool shouldClose() { return glfwWindowShouldClose(window); }
+    void swapBuffers() { glfwSwapBuffers(window); }
+    void pollEvents() { glfwPollEvents(); }
+    double getTime() { return glfwGetTime(); }
+    void getCursorPos(double* x, double* y) { glfwGetCursorPos(window, x, y); }
+    void getWindowSize(int* width, int* height) { glfwGetWindowSize(window, width, height); }
+    void getFramebufferSize(int* width, int* height) { glfwGetFramebufferSize(window, width, height); }
+    GLuint getFramebuffer() { return 0; }
+    void setTitle(const char* title) { glfwSetWindowTitle(window, title); }
+
+    std::unique_ptr<SharedContext> createSharedContext()
+    {
+        // the other hints still hold from creating the main window
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+        GLFWwindow* shared = glfwCreateWindow(1, 1, "", nullptr, window);
+        glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+        if (!shared)
+            return nullptr;
+        return std::unique_ptr<SharedContext>(new SharedWindowContext(shared));
+    }
+
+private:
+    GLFWwindow* window;
+};
+
+#ifdef HAVE_EGL
+// same context requirements as the window
+const EGLint contextAttribs[] = {
+    EGL_CONTEXT_MAJOR_VERSION, 3,
+    EGL_CONTEXT_MINOR_VERSION, 2,
+    EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+    EGL_CONTEXT_OPENGL_FORWARD_COMPATIBLE, EGL_TRUE,
+    EGL_NONE
+};
+
+class SharedOffscreenContext : public SharedContext {
+public:
+    SharedOffscreenContext(EGLDisplay display, EGLContext context)
+        : display(display), context(context) {}
+    ~SharedOffscreenContext() { eglDestroyContext(display, context); }
+
+    bool makeCurrent()
+    {
+        // the bound API is per thread
+        return eglBindAPI(EGL_OPENGL_API)
+            && eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context);
+    }
+
+    void doneCurrent()
+    {
+        eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        eglReleaseThread();
+    }
+
+private:
+    EGLDisplay display;
+    EGLContext context;
+};
+
+class OffscreenContext : public Context {
+public:
+    OffscreenContext(EGLDisplay display, EGLConfig config, EGLContext context,
+            int width, int height, int frames)
+        : display(display), config(config), context(context), width(width), height(height),
+          frames(frames), frame(0)
+    {
+        glGenFramebuffers(1, &fbo);
+        glGenRenderbuffers(1, &colorBuffer);
+
+        glBindRenderbuffer(GL_RENDERBUFFER, colorBuffer);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                GL_RENDERBUFFER, colorBuffer);
+
+        // a surfaceless context starts with an empty viewport
+        glViewport(0, 0, width, height);
+    }
+
+    ~OffscreenContext()
+    {
+        glDeleteFramebuffers(1, &fbo);
+        glDeleteRenderbuffers(1, &colorBuffer);
+
+        eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        eglDestroyContext(display, context);
+        eglTerminate(display);
+    }
+
+    bool shouldClose() { return frame >= frames; }
+
+    void swapBuffers()
+    {
+        // nothing to present, but keep the pipeline from queueing up frames
+        glFlush();
+        frame++;
+    }
+
+    void pollEvents() {}
+    double getTime() { return frame / 60.0; }
+
+    void getCursorPos(double* x, double* y)
+    {
+        // no pointer; keep the source in the middle of the frame
+        *x = 0.5 * width;
+        *y = 0.5 * height;
+    }
+
+    void getWindowSize(int* width, int* height) { getFramebufferSize(width, height); }
+
+    void getFramebufferSize(int* width, int* height)
+    {
+        *width = this->width;
+        *height = this->height;
+    }
+
+    GLuint getFramebuffer() { return fbo; }
+    void setTitle(const char*) {}
+
+    std::unique_ptr<SharedContext> createSharedContext()
+    {
+        EGLContext shared = eglCreateContext(display, config, context, contextAttribs);
+        if (shared == EGL_NO_CONTEXT)
+            return nullptr;
+        return std::unique_ptr<SharedContext>(new SharedOffscreenContext(display, shared));
+    }
+
+private:
+    EGLDisplay display;
+    EGLConfig config;
+    EGLContext context;
+    GLuint fbo, colorBuffer;
+    int width, height;
+    int frames, frame;
+};
+
+EGLDisplay getOffscreenDisplay()
+{
+    // prefer Mesa's surfaceless platform, which needs neither X nor a GPU
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay) {
+        EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+                EGL_DEFAULT_DISPLAY, nullptr);
+        if (display != EGL_NO_DISPLAY)
+            return display;
+    }
+    return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+#endif
+
+} // namespace
+
+std::unique_ptr<Context> createWindowContext(int width, int height, const char* title)
+{
+    if (!glfwInit()) {
+        std::cerr << "failed to initialise GLFW" << std::endl;
+        return nullptr;
+    }
+
+    // support at least OpenGL 3.2
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 2);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+
+#ifdef GLFW_SCALE_TO_MONITOR
+    // size the window in logical units on scaled displays; the framebuffer
+    // then gets the full pixel density
+    glfwWindowHint(GLFW_SCALE_TO_MONITOR, GLFW_TRUE);
+#endif
+
+    // create a windowed window
+    GLFWwindow* window = glfwCreateWindow(width, height, title, nullptr, nullptr);
+    if (!window) {
+        std::cerr << "failed to create a window" << std::endl;
+        glfwTerminate();
+        return nullptr;
+    }
+    glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_HIDDEN);
+
+    // activate the OpenGL context
+    glfwMakeContextCurrent(window);
+
+    std::unique_ptr<Context> context(new WindowContext(window));
+    if (!initGlew())
+        return nullptr;
+    return context;
+}
+
+std::unique_ptr<Context> createOffscreenContext(int width, int height, int frames)
+{
+#ifdef HAVE_EGL
+    EGLDisplay display = getOffscreenDisplay();
+    EGLint major, minor;
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor)) {
+        std::cerr << "failed to initialise EGL" << std::endl;
+        return nullptr;
+    }
+
+    if (!eglBindAPI(EGL_OPENGL_API)) {
+        std::cerr << "EGL implementation does not support desktop OpenGL" << std::endl;
+        eglTerminate(display);
+        return nullptr;
+    }
+
+    // we never create an EGL surface, so any OpenGL capable config will do,
+    // and with EGL_KHR_no_config_context none at all
+    const EGLint configAttribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+    EGLConfig config = EGL_NO_CONFIG_KHR;
+    EGLint numConfigs = 0;
+    eglChooseConfig(display, configAttribs, &config, 1, &numConfigs);
+    if (numConfigs == 0)
+        config = EGL_NO_CONFIG_KHR;
+
+    EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttribs);
+    if (context == EGL_NO_CONTEXT) {
+        std::cerr << "failed to create an OpenGL 3.2 core EGL context" << std::endl;
+        eglTerminate(display);
+        return nullptr;
+    }
+
+    // needs EGL_KHR_surfaceless_context
+    if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+        std::cerr << "failed to make the surfaceless EGL context current" << std::endl;
+        eglDestroyContext(display, context);
+        eglTerminate(display);
+        return nullptr;
+    }
+
+    if (!initGlew()) {
+        eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        eglDestroyContext(display, context);
+        eglTerminate(display);
+        return nullptr;
+    }
+
+    return std::unique_ptr<Context>(
+            new OffscreenContext(display, config, context, width, height, frames));
+#else
+    std::cerr << "built without EGL, offscreen rendering is unavailable" << std::endl;
+    return nullptr;
+#endif
+}
+
+bool saveFramebuffer(const char* path, int width, int height)
+{
+    std::vector<unsigned char> pixels(3 * width * height);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, &pixels[0]);
+
+    // OpenGL rows run bottom to top
+    for (int y = 0; y < height / 2; y++)
+        std::swap_ranges(&pixels[3 * width * y], &pixels[3 * width * (y + 1)],
+                &pixels[3 * width * (height - 1 - y)]);
+
+    return writePPM(path, width, height, &pixels[0]);
+}
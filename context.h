@@ -0,0 +1,57 @@
+#ifndef GRAVITY_CONTEXT_H
+#define GRAVITY_CONTEXT_H
+
+#include <GL/glew.h>
+#include <memory>
+
+#include "programcache.h"
+
+// An OpenGL 3.2 core context together with the surface frames end up on.
+// The GLFW backend presents to a window; the offscreen backend renders into
+// a framebuffer object and needs no display at all.
+class Context {
+public:
+    virtual ~Context() {}
+
+    virtual bool shouldClose() = 0;
+    virtual void swapBuffers() = 0;
+    virtual void pollEvents() = 0;
+
+    // seconds since the context was created
+    virtual double getTime() = 0;
+
+    // cursor position in window coordinates, origin at the top left
+    virtual void getCursorPos(double* x, double* y) = 0;
+
+    // window size in the units of the cursor position
+    virtual void getWindowSize(int* width, int* height) = 0;
+
+    // size in pixels of the framebuffer frames are presented from; larger
+    // than the window size on HiDPI displays
+    virtual void getFramebufferSize(int* width, int* height) = 0;
+
+    // name of that framebuffer, 0 for the default framebuffer
+    virtual GLuint getFramebuffer() = 0;
+
+    // window caption, ignored offscreen
+    virtual void setTitle(const char* title) = 0;
+
+    // another context sharing objects with this one, for a worker thread to
+    // make current; nullptr if none could be created. It has to be
+    // destroyed before this one.
+    virtual std::unique_ptr<SharedContext> createSharedContext() = 0;
+};
+
+// resizable window of the given size in screen coordinates; returns nullptr
+// if no window could be created
+std::unique_ptr<Context> createWindowContext(int width, int height, const char* title);
+
+// surfaceless EGL context rendering into a width x height framebuffer object,
+// which stays bound as the draw framebuffer. Closes after the given number of
+// frames and advances time by a fixed 1/60 s per frame, so runs are repeatable.
+std::unique_ptr<Context> createOffscreenContext(int width, int height, int frames);
+
+// write the bound read framebuffer to a binary PPM file
+bool saveFramebuffer(const char* path, int width, int height);
+
+#endif
@@ -0,0 +1,96 @@
+#include "diagnostics.h"
+
+#include <algorithm>
+#include <limits>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+void Diagnostics::clear()
+{
+    count = 0;
+    energy = momentumX = momentumY = 0.0;
+    minX = minY = std::numeric_limits<float>::infinity();
+    maxX = maxY = -std::numeric_limits<float>::infinity();
+}
+
+void Diagnostics::merge(const Diagnostics& other)
+{
+    count += other.count;
+    energy += other.energy;
+    momentumX += other.momentumX;
+    momentumY += other.momentumY;
+    minX = std::min(minX, other.minX);
+    minY = std::min(minY, other.minY);
+    maxX = std::max(maxX, other.maxX);
+    maxY = std::max(maxY, other.maxY);
+}
+
+// A particle is x, y, vx, vy, one register: the sums of the registers and
+// of their squares hold the momentum and twice the energy in their upper
+// lanes, and the running min and max the box in their lower ones. Two sets
+// of accumulators, so that each add need not wait for the last.
+static void addChunk(const Particle* particles, size_t count, Diagnostics* diagnostics)
+{
+    float sum[4], squares[4], low[4], high[4];
+    size_t i = 0;
+#ifdef __SSE__
+    const float inf = std::numeric_limits<float>::infinity();
+    __m128 sum0 = _mm_setzero_ps(), sum1 = sum0, squares0 = sum0, squares1 = sum0;
+    __m128 low0 = _mm_set1_ps(inf), low1 = low0, high0 = _mm_set1_ps(-inf), high1 = high0;
+    for (; i + 2 <= count; i += 2) {
+        __m128 p = _mm_loadu_ps(&particles[i].x);
+        __m128 q = _mm_loadu_ps(&particles[i + 1].x);
+        sum0 = _mm_add_ps(sum0, p);
+        sum1 = _mm_add_ps(sum1, q);
+        squares0 = _mm_add_ps(squares0, _mm_mul_ps(p, p));
+        squares1 = _mm_add_ps(squares1, _mm_mul_ps(q, q));
+        low0 = _mm_min_ps(low0, p);
+        low1 = _mm_min_ps(low1, q);
+        high0 = _mm_max_ps(high0, p);
+        high1 = _mm_max_ps(high1, q);
+    }
+    _mm_storeu_ps(sum, _mm_add_ps(sum0, sum1));
+    _mm_storeu_ps(squares, _mm_add_ps(squares0, squares1));
+    _mm_storeu_ps(low, _mm_min_ps(low0, low1));
+    _mm_storeu_ps(high, _mm_max_ps(high0, high1));
+#else
+    for (int k = 0; k < 4; k++) {
+        sum[k] = squares[k] = 0.0f;
+        low[k] = std::numeric_limits<float>::infinity();
+        high[k] = -std::numeric_limits<float>::infinity();
+    }
+#endif
+    for (; i < count; i++) {
+        const float p[4] = { particles[i].x, particles[i].y, particles[i].vx, particles[i].vy };
+        for (int k = 0; k < 4; k++) {
+            sum[k] += p[k];
+            squares[k] += p[k] * p[k];
+            low[k] = std::min(low[k], p[k]);
+            high[k] = std::max(high[k], p[k]);
+        }
+    }
+
+    diagnostics->count += count;
+    diagnostics->energy += 0.5 * (double(squares[2]) + double(squares[3]));
+    diagnostics->momentumX += sum[2];
+    diagnostics->momentumY += sum[3];
+    diagnostics->minX = std::min(diagnostics->minX, low[0]);
+    diagnostics->minY = std::min(diagnostics->minY, low[1]);
+    diagnostics->maxX = std::max(diagnostics->maxX, high[0]);
+    diagnostics->maxY = std::max(diagnostics->maxY, high[1]);
+}
+
+void addDiagnostics(const Particle* particles, size_t count, Diagnostics* diagnostics)
+{
+    for (size_t begin = 0; begin < count; begin += diagnosticsChunk)
+        addChunk(particles + begin, std::min(diagnosticsChunk, count - begin), diagnostics);
+}
+
+void printDiagnostics(FILE* file, const Diagnostics& d)
+{
+    std::fprintf(file, "energy %.6g momentum %.6g %.6g box %.4f %.4f to %.4f %.4f, %llu particles\n",
+            d.energy, d.momentumX, d.momentumY, d.minX, d.minY, d.maxX, d.maxY,
+            (unsigned long long) d.count);
+}
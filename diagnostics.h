@@ -0,0 +1,34 @@
+#ifndef GRAVITY_DIAGNOSTICS_H
+#define GRAVITY_DIAGNOSTICS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+#include "particles.h"
+
+// What a run is monitored by: the kinetic energy and momentum of the
+// particles, all of unit mass, and the box they lie in. Sums are kept in
+// double; each chunk of diagnosticsChunk particles is first added up in
+// float.
+struct Diagnostics {
+    uint64_t count;
+    double energy; // the sum of |v|^2 / 2
+    double momentumX, momentumY;
+    float minX, minY, maxX, maxY; // min above max with no particles
+
+    Diagnostics() { clear(); }
+
+    void clear();
+    void merge(const Diagnostics& other);
+};
+
+const size_t diagnosticsChunk = 512;
+
+// add particles[0, count) in
+void addDiagnostics(const Particle* particles, size_t count, Diagnostics* diagnostics);
+
+// one line, as gravity and gravity-headless print it
+void printDiagnostics(FILE* file, const Diagnostics& diagnostics);
+
+#endif
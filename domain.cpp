@@ -0,0 +1,170 @@
+#include "domain.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <utility>
+
+// positions sampled per rank to place the edges by
+static const int edgeSamples = 1024;
+
+Domain::Domain(Transport& transport)
+    : transport(transport), total(0), imbalance(1.0f)
+{
+    int size = transport.getSize();
+    std::vector<float> edges;
+    for (int r = 1; r < size; r++)
+        edges.push_back(-1.0f + 2.0f * r / size);
+    setEdges(edges);
+    counts.assign(size, 0);
+
+    // rebalancing may first happen long after the start
+    weighted.reserve(size_t(size) * edgeSamples);
+    cuts.reserve(size - 1);
+}
+
+void Domain::reserve(size_t particles)
+{
+    // any rank may send all of its particles to any one other, and the
+    // counts and samples of rebalancing come back in the same buffers
+    int size = getSize();
+    size_t messageBytes = sizeof(uint64_t) + edgeSamples * sizeof(float);
+    size_t bytes = std::max(particles * sizeof(Particle), messageBytes);
+    out.resize(size);
+    in.resize(size);
+    for (int r = 0; r < size; r++) {
+        if (r == getRank())
+            continue;
+        out[r].reserve(bytes);
+        in[r].reserve(bytes);
+    }
+    in[getRank()].reserve(messageBytes);
+    message.reserve(messageBytes);
+    transport.reserve(messageBytes);
+}
+
+void Domain::setEdges(const std::vector<float>& edges)
+{
+    this->edges = edges;
+    int rank = getRank();
+    low = rank > 0 ? edges[rank - 1] : -std::numeric_limits<float>::infinity();
+    high = rank < getSize() - 1 ? edges[rank] : std::numeric_limits<float>::infinity();
+}
+
+int Domain::owner(float x) const
+{
+    return int(std::upper_bound(edges.begin(), edges.end(), x) - edges.begin());
+}
+
+bool Domain::migrate(ParticleVector& particles)
+{
+    TRACE_SCOPE("migrate");
+    int size = getSize(), rank = getRank();
+    out.resize(size);
+    for (int r = 0; r < size; r++)
+        out[r].clear();
+
+    // keep the particles that stay in order, packing them down over the
+    // ones that leave
+    size_t kept = 0;
+    for (size_t i = 0; i < particles.size(); i++) {
+        const Particle& p = particles[i];
+        if (p.x >= low && p.x < high) {
+            particles[kept++] = p;
+        } else {
+            Transport::Buffer& buffer = out[owner(p.x)];
+            buffer.insert(buffer.end(), (const char*) &p, (const char*) (&p + 1));
+        }
+    }
+    particles.resize(kept);
+
+    if (!transport.exchange(out, in))
+        return false;
+
+    for (int r = 0; r < size; r++) {
+        if (r == rank)
+            continue;
+        size_t arrived = in[r].size() / sizeof(Particle);
+        particles.resize(kept + arrived);
+        if (arrived)
+            std::memcpy(&particles[kept], in[r].data(), arrived * sizeof(Particle));
+        kept += arrived;
+    }
+    return true;
+}
+
+bool Domain::count(const ParticleVector& particles)
+{
+    uint64_t count = particles.size();
+    message.assign((const char*) &count, (const char*) (&count + 1));
+    if (!transport.allGather(message, in))
+        return false;
+    tally();
+    return true;
+}
+
+void Domain::tally()
+{
+    size_t largest = 0;
+    total = 0;
+    for (int r = 0; r < getSize(); r++) {
+        uint64_t count;
+        std::memcpy(&count, in[r].data(), sizeof(count));
+        counts[r] = count;
+        total += count;
+        largest = std::max<size_t>(largest, count);
+    }
+    imbalance = total > 0 ? float(largest * double(getSize()) / total) : 1.0f;
+}
+
+bool Domain::rebalance(ParticleVector& particles, float threshold, bool* moved)
+{
+    TRACE_SCOPE("rebalance");
+    int size = getSize();
+    *moved = false;
+
+    // the count and evenly spaced x positions; each sample stands for
+    // count / samples particles of its rank
+    uint64_t count = particles.size();
+    size_t samples = std::min<size_t>(count, edgeSamples);
+    message.resize(sizeof(count) + samples * sizeof(float));
+    std::memcpy(&message[0], &count, sizeof(count));
+    for (size_t i = 0; i < samples; i++)
+        std::memcpy(&message[sizeof(count) + i * sizeof(float)],
+                &particles[i * count / samples].x, sizeof(float));
+
+    if (!transport.allGather(message, in))
+        return false;
+    tally();
+    if (total == 0 || imbalance <= threshold)
+        return true;
+
+    // every rank has the same samples, so every rank works out the same edges
+    weighted.clear();
+    for (int r = 0; r < size; r++) {
+        count = counts[r];
+        size_t n = (in[r].size() - sizeof(count)) / sizeof(float);
+        for (size_t i = 0; i < n; i++) {
+            float x;
+            std::memcpy(&x, &in[r][sizeof(count) + i * sizeof(float)], sizeof(x));
+            weighted.push_back(std::make_pair(x, double(count) / n));
+        }
+    }
+
+    // cut where the running weight passes each multiple of total / size
+    std::sort(weighted.begin(), weighted.end());
+    cuts.resize(size - 1);
+    double running = 0.0;
+    size_t j = 0;
+    for (int r = 1; r < size; r++) {
+        double target = double(total) * r / size;
+        while (j + 1 < weighted.size() && running + weighted[j].second <= target)
+            running += weighted[j++].second;
+        cuts[r - 1] = weighted[j].first;
+    }
+    setEdges(cuts);
+    *moved = true;
+    return migrate(particles);
+}
@@ -0,0 +1,78 @@
+#ifndef GRAVITY_DOMAIN_H
+#define GRAVITY_DOMAIN_H
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include "particles.h"
+#include "transport.h"
+
+// The particles of a distributed run, split into vertical strips of the box
+// with one rank of a Transport owning each. A rank steps and renders only
+// the particles in its strip, so the count is bounded by the memory of all
+// ranks together rather than one. Every force is an external field, so
+// stepping needs nothing from the other strips; what moves between ranks is
+// particles that crossed into another strip, and the strips themselves when
+// the particles cluster and the counts drift apart.
+//
+// Every call that takes the particles is collective.
+class Domain {
+public:
+    // equal strips across [-1,1], which suits uniformly spread particles
+    explicit Domain(Transport& transport);
+
+    int getRank() const { return transport.getRank(); }
+    int getSize() const { return transport.getSize(); }
+
+    // rank whose strip holds x; the outer strips extend past the box
+    int owner(float x) const;
+
+    // make room to exchange up to particles of them, the most a rank can
+    // come to hold, so that migrating and rebalancing allocate nothing
+    void reserve(size_t particles);
+
+    // hand the particles outside this rank's strip to their owners and
+    // append the ones arriving from the others
+    bool migrate(ParticleVector& particles);
+
+    // count the particles of all ranks
+    bool count(const ParticleVector& particles);
+
+    // count them, and if the largest count is more than threshold times
+    // the mean, move the strip edges so that each holds about as many and
+    // migrate; *moved says whether they moved
+    bool rebalance(ParticleVector& particles, float threshold, bool* moved);
+
+    // as of the last count: particles per rank, their sum, and the largest
+    // count over the mean, before any edges moved
+    const std::vector<size_t>& getCounts() const { return counts; }
+    size_t getTotal() const { return total; }
+    float getImbalance() const { return imbalance; }
+
+    // x of the edge between rank r and r + 1, for r < getSize() - 1
+    const std::vector<float>& getEdges() const { return edges; }
+
+private:
+    Transport& transport;
+    std::vector<float> edges;
+    float low, high; // this rank's strip, [low, high)
+
+    std::vector<size_t> counts;
+    size_t total;
+    float imbalance;
+
+    // kept between steps, so that steps allocate nothing once these have
+    // grown to fit
+    std::vector<Transport::Buffer> out, in;
+    Transport::Buffer message;
+    std::vector<std::pair<float, double>> weighted; // samples and their weights
+    std::vector<float> cuts;
+
+    void setEdges(const std::vector<float>& edges);
+
+    // the counts from the start of each rank's message in in
+    void tally();
+};
+
+#endif
@@ -0,0 +1,350 @@
+#ifndef GRAVITY_FORCES_H
+#define GRAVITY_FORCES_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <string>
+#include <tuple>
+#include <vector>
+
+// Force terms, composed at compile time into a ForceField. Each term
+// describes itself twice, once as C++ for the CPU kernel and once as GLSL
+// for the transform feedback shader, so both backends run the same physics:
+//
+//   accelerate()  add the term's acceleration at a particle to ax, ay
+//   glsl(p)       the same as a GLSL block adding to vec2 accel, reading
+//                 position and velocity, with its parameters as float
+//                 uniforms named p + paramName(i)
+//   numParams, paramName(i), param(i)
+//                 the parameters, uploaded as those uniforms every step
+
+// Pull towards a point with 1/r^2 falloff, r^2 clamped to [0.1, 1] so it
+// stays finite at the point and does not vanish far away. The cursor.
+struct Gravity {
+    float x, y, strength;
+
+    Gravity(float x = 0.0f, float y = 0.0f, float strength = 1.0f)
+        : x(x), y(y), strength(strength) {}
+
+    void accelerate(float px, float py, float, float, float& ax, float& ay) const
+    {
+        float dx = x - px, dy = y - py;
+        float len2 = dx*dx + dy*dy;
+        float r2 = std::min(std::max(len2, 0.1f), 1.0f);
+        // normalize(diff)/r2, with nothing to normalise at the point itself
+        float a = len2 > 0.0f ? strength / (std::sqrt(len2) * r2) : 0.0f;
+        ax += a*dx;
+        ay += a*dy;
+    }
+
+    static std::string glsl(const std::string& p)
+    {
+        return
+            "    {\n"
+            "        vec2 d = vec2(" + p + "x, " + p + "y) - position;\n"
+            "        float len2 = dot(d, d);\n"
+            "        float r2 = clamp(len2, 0.1, 1.0);\n"
+            "        if (len2 > 0.0)\n"
+            "            accel += " + p + "strength*d/(sqrt(len2)*r2);\n"
+            "    }\n";
+    }
+
+    static const int numParams = 3;
+    static std::string paramName(int i)
+    {
+        static const char* names[] = { "x", "y", "strength" };
+        return names[i];
+    }
+    float param(int i) const
+    {
+        const float values[] = { x, y, strength };
+        return values[i];
+    }
+};
+
+// K fixed bodies with Plummer softening: the particles feel the bodies but
+// not each other, so it costs K per particle instead of N.
+template <int K>
+struct PointMasses {
+    float softening;
+    float x[K], y[K], mass[K];
+
+    PointMasses() : softening(0.05f)
+    {
+        for (int k = 0; k < K; k++)
+            x[k] = y[k] = mass[k] = 0.0f;
+    }
+
+    void accelerate(float px, float py, float, float, float& ax, float& ay) const
+    {
+        float soft2 = softening*softening;
+        for (int k = 0; k < K; k++) {
+            float dx = x[k] - px, dy = y[k] - py;
+            float len2 = dx*dx + dy*dy + soft2;
+            float a = mass[k] / (len2 * std::sqrt(len2));
+            ax += a*dx;
+            ay += a*dy;
+        }
+    }
+
+    static std::string glsl(const std::string& p)
+    {
+        // unrolled, one block per body
+        std::string code;
+        for (int k = 0; k < K; k++) {
+            std::string n = std::to_string(k);
+            code +=
+                "    {\n"
+                "        vec2 d = vec2(" + p + "x" + n + ", " + p + "y" + n + ") - position;\n"
+                "        float len2 = dot(d, d) + " + p + "softening*" + p + "softening;\n"
+                "        accel += " + p + "mass" + n + "*d/(len2*sqrt(len2));\n"
+                "    }\n";
+        }
+        return code;
+    }
+
+    static const int numParams = 1 + 3*K;
+    static std::string paramName(int i)
+    {
+        static const char* names[] = { "x", "y", "mass" };
+        return i == 0 ? "softening" : names[(i - 1) % 3] + std::to_string((i - 1) / 3);
+    }
+    float param(int i) const
+    {
+        if (i == 0)
+            return softening;
+        int k = (i - 1) / 3;
+        const float values[] = { x[k], y[k], mass[k] };
+        return values[(i - 1) % 3];
+    }
+};
+
+// Hooke spring from every particle to an anchor, at rest at restLength.
+struct Spring {
+    float x, y, restLength, stiffness;
+
+    Spring(float x = 0.0f, float y = 0.0f, float restLength = 0.5f, float stiffness = 1.0f)
+        : x(x), y(y), restLength(restLength), stiffness(stiffness) {}
+
+    void accelerate(float px, float py, float, float, float& ax, float& ay) const
+    {
+        float dx = x - px, dy = y - py;
+        float len = std::sqrt(dx*dx + dy*dy);
+        float a = len > 0.0f ? stiffness * (len - restLength) / len : 0.0f;
+        ax += a*dx;
+        ay += a*dy;
+    }
+
+    static std::string glsl(const std::string& p)
+    {
+        return
+            "    {\n"
+            "        vec2 d = vec2(" + p + "x, " + p + "y) - position;\n"
+            "        float len = length(d);\n"
+            "        if (len > 0.0)\n"
+            "            accel += " + p + "stiffness*(len - " + p + "restLength)/len*d;\n"
+            "    }\n";
+    }
+
+    static const int numParams = 4;
+    static std::string paramName(int i)
+    {
+        static const char* names[] = { "x", "y", "restLength", "stiffness" };
+        return names[i];
+    }
+    float param(int i) const
+    {
+        const float values[] = { x, y, restLength, stiffness };
+        return values[i];
+    }
+};
+
+// Swirl around a point, counterclockwise for positive strength, falling off
+// as 1/r outside a core of radius core.
+struct Vortex {
+    float x, y, strength, core;
+
+    Vortex(float x = 0.0f, float y = 0.0f, float strength = 1.0f, float core = 0.1f)
+        : x(x), y(y), strength(strength), core(core) {}
+
+    void accelerate(float px, float py, float, float, float& ax, float& ay) const
+    {
+        float dx = px - x, dy = py - y;
+        float a = strength / (dx*dx + dy*dy + core*core);
+        ax -= a*dy;
+        ay += a*dx;
+    }
+
+    static std::string glsl(const std::string& p)
+    {
+        return
+            "    {\n"
+            "        vec2 d = position - vec2(" + p + "x, " + p + "y);\n"
+            "        accel += " + p + "strength/(dot(d, d) + " + p + "core*" + p + "core)"
+                "*vec2(-d.y, d.x);\n"
+            "    }\n";
+    }
+
+    static const int numParams = 4;
+    static std::string paramName(int i)
+    {
+        static const char* names[] = { "x", "y", "strength", "core" };
+        return names[i];
+    }
+    float param(int i) const
+    {
+        const float values[] = { x, y, strength, core };
+        return values[i];
+    }
+};
+
+// Linear drag against the velocity.
+struct Drag {
+    float coefficient;
+
+    Drag(float coefficient = 0.5f) : coefficient(coefficient) {}
+
+    void accelerate(float, float, float vx, float vy, float& ax, float& ay) const
+    {
+        ax -= coefficient*vx;
+        ay -= coefficient*vy;
+    }
+
+    static std::string glsl(const std::string& p)
+    {
+        return "    accel -= " + p + "coefficient*velocity;\n";
+    }
+
+    static const int numParams = 1;
+    static std::string paramName(int) { return "coefficient"; }
+    float param(int) const { return coefficient; }
+};
+
+namespace detail {
+
+// the terms of a tuple from I on, unrolled by recursion
+template <size_t I, size_t N>
+struct ForceTerms {
+    template <typename Tuple>
+    static void accelerate(const Tuple& terms, float x, float y, float vx, float vy,
+            float& ax, float& ay)
+    {
+        std::get<I>(terms).accelerate(x, y, vx, vy, ax, ay);
+        ForceTerms<I + 1, N>::accelerate(terms, x, y, vx, vy, ax, ay);
+    }
+
+    template <typename Tuple>
+    static void describe(std::string& uniforms, std::string& body,
+            std::vector<std::string>& names)
+    {
+        typedef typename std::tuple_element<I, Tuple>::type Term;
+        std::string prefix = "f" + std::to_string(I) + "_";
+        for (int i = 0; i < Term::numParams; i++) {
+            names.push_back(prefix + Term::paramName(i));
+            uniforms += "uniform float " + names.back() + ";\n";
+        }
+        body += Term::glsl(prefix);
+        ForceTerms<I + 1, N>::template describe<Tuple>(uniforms, body, names);
+    }
+
+    template <typename Tuple>
+    static void getParams(const Tuple& terms, float* values)
+    {
+        typedef typename std::tuple_element<I, Tuple>::type Term;
+        for (int i = 0; i < Term::numParams; i++)
+            *values++ = std::get<I>(terms).param(i);
+        ForceTerms<I + 1, N>::getParams(terms, values);
+    }
+};
+
+template <size_t N>
+struct ForceTerms<N, N> {
+    template <typename Tuple>
+    static void accelerate(const Tuple&, float, float, float, float, float&, float&) {}
+    template <typename Tuple>
+    static void describe(std::string&, std::string&, std::vector<std::string>&) {}
+    template <typename Tuple>
+    static void getParams(const Tuple&, float*) {}
+};
+
+template <typename... Terms>
+struct ParamCount {
+    static const int value = 0;
+};
+
+template <typename Head, typename... Tail>
+struct ParamCount<Head, Tail...> {
+    static const int value = Head::numParams + ParamCount<Tail...>::value;
+};
+
+}
+
+// The sum of the given force terms. accelerate() inlines all of them, so a
+// kernel templated on the field is one fused loop with no virtual calls,
+// and glsl() is the matching GLSL function
+//
+//   vec2 force(vec2 position, vec2 velocity)
+//
+// with the parameters of term I as uniforms named f<I>_<param>.
+template <typename... Terms>
+class ForceField {
+public:
+    typedef std::tuple<Terms...> Tuple;
+
+    ForceField() {}
+    ForceField(const Terms&... terms) : terms(terms...) {}
+
+    template <size_t I>
+    typename std::tuple_element<I, Tuple>::type& get() { return std::get<I>(terms); }
+    template <size_t I>
+    const typename std::tuple_element<I, Tuple>::type& get() const { return std::get<I>(terms); }
+
+    void accelerate(float x, float y, float vx, float vy, float& ax, float& ay) const
+    {
+        detail::ForceTerms<0, sizeof...(Terms)>::accelerate(terms, x, y, vx, vy, ax, ay);
+    }
+
+    // uniform declarations and the force() function; names receives the
+    // uniform names in the order of getParams()
+    static std::string glsl(std::vector<std::string>& names)
+    {
+        std::string uniforms, body;
+        names.clear();
+        detail::ForceTerms<0, sizeof...(Terms)>::template describe<Tuple>(uniforms, body, names);
+        return uniforms +
+            "\nvec2 force(vec2 position, vec2 velocity) {\n"
+            "    vec2 accel = vec2(0.0);\n" + body +
+            "    return accel;\n"
+            "}\n";
+    }
+
+    static const int numParams = detail::ParamCount<Terms...>::value;
+
+    // numParams values, to upload as the uniforms
+    void getParams(float* values) const
+    {
+        detail::ForceTerms<0, sizeof...(Terms)>::getParams(terms, values);
+    }
+
+private:
+    Tuple terms;
+};
+
+// the cursor alone, the original demo
+typedef ForceField<Gravity> CursorField;
+
+// the cursor plus every other kind of term; the cursor is term 0 here too,
+// so f0_x and f0_y are the first two parameters of both fields
+typedef ForceField<Gravity, PointMasses<2>, Spring, Vortex, Drag> MixedField;
+
+inline MixedField makeMixedField()
+{
+    PointMasses<2> masses;
+    masses.x[0] = -0.5f; masses.y[0] = 0.0f; masses.mass[0] = 0.02f;
+    masses.x[1] = 0.5f; masses.y[1] = 0.0f; masses.mass[1] = 0.02f;
+    return MixedField(Gravity(0.0f, 0.0f, 0.5f), masses,
+            Spring(0.0f, 0.0f, 0.6f, 0.5f), Vortex(0.0f, 0.0f, 0.3f, 0.2f), Drag(0.2f));
+}
+
+#endif
@@ -0,0 +1,65 @@
+#include "framestats.h"
+#include "allocs.h"
+#include "trace.h"
+
+#include <cstdio>
+#include <iostream>
+
+StallDetector::StallDetector(double thresholdMs, const char* tracePrefix, int maxSnapshots)
+    : threshold(uint64_t(thresholdMs * 1e6)), tracePrefix(tracePrefix ? tracePrefix : ""),
+      maxSnapshots(maxSnapshots), snapshots(0), stalls(0),
+      framesUntilSnapshot(-1), snapshotSince(0)
+{
+    if (!this->tracePrefix.empty() && !trace::isEnabled())
+        trace::start();
+}
+
+bool StallDetector::frame(uint64_t start, uint64_t end)
+{
+    if (framesUntilSnapshot > 0 && --framesUntilSnapshot == 0) {
+        allocs::Allow allow;
+        char path[4096];
+        std::snprintf(path, sizeof(path), "%s%d.json", tracePrefix.c_str(), snapshots);
+        if (trace::writeChromeTrace(path, snapshotSince))
+            std::cerr << "stall trace written to " << path << std::endl;
+        snapshots++;
+        framesUntilSnapshot = -1;
+    }
+
+    if (end - start < threshold)
+        return false;
+
+    stalls++;
+    if (!tracePrefix.empty() && framesUntilSnapshot < 0 && snapshots < maxSnapshots) {
+        // include the lead up, one threshold's worth before the frame began
+        snapshotSince = start > threshold ? start - threshold : 0;
+        framesUntilSnapshot = 2;
+    }
+    return true;
+}
+
+void FrameStats::print(FILE* file) const
+{
+    std::fprintf(file, "frame p50 %.3f p99 %.3f max %.3f ms",
+            frames.percentile(0.5) * 1e-6, frames.percentile(0.99) * 1e-6,
+            frames.max() * 1e-6);
+    if (steps.count())
+        std::fprintf(file, ", step p50 %.3f p99 %.3f ms",
+                steps.percentile(0.5) * 1e-6, steps.percentile(0.99) * 1e-6);
+    std::fprintf(file, ", %d stalls\n", stallDetector.getStalls());
+}
+
+bool FrameStats::writeJson(const char* path) const
+{
+    FILE* file = std::fopen(path, "w");
+    if (!file)
+        return false;
+
+    std::fprintf(file, "{\"frame\":");
+    frames.writeJson(file);
+    std::fprintf(file, ",\"step\":");
+    steps.writeJson(file);
+    std::fprintf(file, ",\"stalls\":%d}\n", stallDetector.getStalls());
+
+    return std::fclose(file) == 0;
+}
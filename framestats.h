@@ -0,0 +1,60 @@
+#ifndef GRAVITY_FRAMESTATS_H
+#define GRAVITY_FRAMESTATS_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#include "histogram.h"
+
+// Flags frames that take longer than a threshold. With a trace file prefix
+// it also dumps the trace from a little before each stall until two frames
+// after it, so the cause and the recovery are both in the snapshot; tracing
+// is started if it is not on already.
+class StallDetector {
+public:
+    StallDetector(double thresholdMs, const char* tracePrefix, int maxSnapshots = 16);
+
+    // start and end in trace::now() nanoseconds; returns true for a stall
+    bool frame(uint64_t start, uint64_t end);
+
+    int getStalls() const { return stalls; }
+
+private:
+    uint64_t threshold;
+    std::string tracePrefix;
+    int maxSnapshots, snapshots;
+    int stalls;
+
+    // snapshot waiting for the frames after the stall
+    int framesUntilSnapshot;
+    uint64_t snapshotSince;
+};
+
+// Frame and simulation step time distributions plus stalls over a run.
+class FrameStats {
+public:
+    FrameStats(double stallMs, const char* stallTracePrefix)
+        : stallDetector(stallMs, stallTracePrefix) {}
+
+    // start and end of a whole frame in trace::now() nanoseconds
+    void frame(uint64_t start, uint64_t end)
+    {
+        frames.record(end - start);
+        stallDetector.frame(start, end);
+    }
+
+    void step(uint64_t nanoseconds) { steps.record(nanoseconds); }
+
+    // one line summary of the percentiles
+    void print(FILE* file) const;
+
+    // {"frame":{..},"step":{..},"stalls":..} with times in milliseconds
+    bool writeJson(const char* path) const;
+
+private:
+    Histogram frames, steps;
+    StallDetector stallDetector;
+};
+
+#endif
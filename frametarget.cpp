@@ -0,0 +1,161 @@
+#include "frametarget.h"
+#include "shader.h"
+#include "trace.h"
+
+#include <iostream>
+
+static const GLchar* resolveVertexSource = R"(
+#version 150
+
+void main() {
+    // one triangle covering the whole viewport
+    vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    gl_Position = vec4(2.0*corner - 1.0, 0.0, 1.0);
+})";
+
+static const GLchar* colorResolveSource = R"(
+#version 150
+
+uniform sampler2D frame;
+uniform int factor;
+
+out vec4 outColor;
+
+void main() {
+    // box filter the factor x factor block of samples under this pixel
+    ivec2 base = ivec2(gl_FragCoord.xy) * factor;
+    vec4 sum = vec4(0.0);
+    for (int y = 0; y < factor; y++)
+        for (int x = 0; x < factor; x++)
+            sum += texelFetch(frame, base + ivec2(x, y), 0);
+    outColor = sum / float(factor*factor);
+})";
+
+static const GLchar* densityResolveSource = R"(
+#version 150
+
+uniform sampler2D frame;
+uniform int factor;
+uniform float meanDensity;
+
+out vec4 outColor;
+
+const float whitePoint = 64.0; // multiple of the mean density shown as white
+
+void main() {
+    // samples hold particles per sample, so the block sum is per pixel
+    ivec2 base = ivec2(gl_FragCoord.xy) * factor;
+    float density = 0.0;
+    for (int y = 0; y < factor; y++)
+        for (int x = 0; x < factor; x++)
+            density += texelFetch(frame, base + ivec2(x, y), 0).r;
+
+    // logarithmic tone map relative to the mean, then a black body ramp
+    float t = clamp(log(1.0 + density/meanDensity) / log(1.0 + whitePoint), 0.0, 1.0);
+    outColor = vec4(smoothstep(0.0, 0.5, t), smoothstep(0.25, 0.75, t),
+            smoothstep(0.5, 1.0, t), 1.0);
+})";
+
+FrameTarget::FrameTarget(Mode mode, int factor)
+    : mode(mode), factor(factor), requested(factor), target(0),
+      width(0), height(0), meanDensity(1.0f),
+      fbo(0), texture(0), vao(0), program(0), uniFactor(-1), uniMeanDensity(-1)
+{
+    if (mode == COLOR && requested <= 1)
+        return;
+
+    glGenFramebuffers(1, &fbo);
+    glGenTextures(1, &texture);
+
+    // the resolve pass has no vertex data, but core profile wants a vao
+    glGenVertexArrays(1, &vao);
+
+    program = createProgram(resolveVertexSource,
+            mode == COLOR ? colorResolveSource : densityResolveSource);
+    uniFactor = glGetUniformLocation(program, "factor");
+    uniMeanDensity = glGetUniformLocation(program, "meanDensity");
+}
+
+FrameTarget::~FrameTarget()
+{
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteTextures(1, &texture);
+    glDeleteVertexArrays(1, &vao);
+    glDeleteProgram(program);
+}
+
+void FrameTarget::resize(int width, int height)
+{
+    this->width = width;
+    this->height = height;
+
+    // stay within what the implementation can allocate
+    GLint maxSize;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+    factor = requested;
+    while (factor > 1 && (width*factor > maxSize || height*factor > maxSize))
+        factor--;
+    if (factor != requested)
+        std::cerr << "supersampling " << width << "x" << height
+            << " reduced to " << factor << "x" << std::endl;
+
+    // float32 so that millions of faint splats still add up exactly enough
+    glBindTexture(GL_TEXTURE_2D, texture);
+    if (mode == COLOR)
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width*factor, height*factor,
+                0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    else
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, width*factor, height*factor,
+                0, GL_RED, GL_FLOAT, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+            GL_TEXTURE_2D, texture, 0);
+}
+
+void FrameTarget::begin(GLuint target, int width, int height)
+{
+    this->target = target;
+
+    if (!program) {
+        glBindFramebuffer(GL_FRAMEBUFFER, target);
+        glViewport(0, 0, width, height);
+        return;
+    }
+
+    if (width != this->width || height != this->height)
+        resize(width, height);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glViewport(0, 0, width*factor, height*factor);
+
+    if (mode == DENSITY) {
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_ONE, GL_ONE);
+    }
+}
+
+void FrameTarget::end()
+{
+    if (!program)
+        return;
+
+    TRACE_SCOPE("resolve");
+
+    if (mode == DENSITY)
+        glDisable(GL_BLEND);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, target);
+    glViewport(0, 0, width, height);
+
+    glUseProgram(program);
+    glUniform1i(uniFactor, factor);
+    glUniform1f(uniMeanDensity, meanDensity);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, texture);
+
+    glBindVertexArray(vao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+}
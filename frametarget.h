@@ -0,0 +1,49 @@
+#ifndef GRAVITY_FRAMETARGET_H
+#define GRAVITY_FRAMETARGET_H
+
+#include <GL/glew.h>
+
+// Where a frame is drawn before it reaches the context's framebuffer.
+//
+// COLOR frames are drawn at factor x factor the target resolution and box
+// filtered down in a resolve pass; a factor of 1 draws straight into the
+// target. DENSITY frames are additively blended into a float buffer of
+// particles per pixel, which the resolve pass averages and tone maps.
+class FrameTarget {
+public:
+    enum Mode { COLOR, DENSITY };
+
+    FrameTarget(Mode mode, int factor);
+    ~FrameTarget();
+
+    FrameTarget(const FrameTarget&) = delete;
+    FrameTarget& operator=(const FrameTarget&) = delete;
+
+    // samples per pixel along each axis, after clamping to the size limits
+    int getFactor() const { return factor; }
+
+    // typical density, in particles per target pixel, to tone map against
+    void setExposure(float meanDensity) { this->meanDensity = meanDensity; }
+
+    // bind the framebuffer to draw the frame into and set the viewport;
+    // the intermediate buffer follows the target size
+    void begin(GLuint target, int width, int height);
+
+    // resolve into the target, which is left bound
+    void end();
+
+private:
+    void resize(int width, int height);
+
+    Mode mode;
+    int factor, requested;
+    GLuint target;
+    int width, height;
+    float meanDensity;
+
+    GLuint fbo, texture;
+    GLuint vao, program;
+    GLint uniFactor, uniMeanDensity;
+};
+
+#endif
@@ -0,0 +1,218 @@
+#include "gpudiagnostics.h"
+
+#include "gpuprimitives.h"
+#include "packed.h"
+#include "trace.h"
+
+namespace {
+
+const size_t tileSize = 1024; // 4 particles a thread
+
+// Each thread adds up four particles, or the PARTIALS of four tiles of the
+// level below, a tree in shared memory adds up the threads, and the
+// workgroup's total goes to the level above. A partial is the momentum and
+// energy as sums, and the box as min x, min y, max x, max y.
+const char* const reduceHeader = R"(
+struct Partial {
+    vec4 sums;
+    vec4 box;
+};
+
+#if defined(PARTIALS)
+layout(std430, binding = 0) buffer In { Partial partialsIn[]; };
+#elif defined(COMPACT)
+layout(std430, binding = 0) buffer Particles { uvec2 particles[]; };
+#else
+layout(std430, binding = 0) buffer Particles { vec4 particles[]; };
+#endif
+layout(std430, binding = 1) buffer Out { Partial partialsOut[]; };
+
+shared vec4 sharedSums[256];
+shared vec4 sharedBox[256];
+)";
+
+const char* const reduceMain = R"(
+vec4 addBox(vec4 a, vec4 b) {
+    return vec4(min(a.xy, b.xy), max(a.zw, b.zw));
+}
+
+void main() {
+    uint group = groupIndex();
+    if (group >= numGroups)
+        return;
+    uint local = gl_LocalInvocationID.x;
+
+    float inf = uintBitsToFloat(0x7f800000u);
+    vec4 sums = vec4(0.0);
+    vec4 box = vec4(inf, inf, -inf, -inf);
+    for (uint k = 0u; k < 4u; k++) {
+        uint i = group*1024u + k*256u + local;
+        if (i >= count)
+            break;
+#if defined(PARTIALS)
+        sums += partialsIn[i].sums;
+        box = addBox(box, partialsIn[i].box);
+#else
+#if defined(COMPACT)
+        vec2 pos = unpackPosition(particles[i].x);
+        vec2 vel = unpackVelocity(particles[i].y);
+#else
+        vec2 pos = particles[i].xy;
+        vec2 vel = particles[i].zw;
+#endif
+        sums += vec4(vel, 0.5*dot(vel, vel), 0.0);
+        box = addBox(box, pos.xyxy);
+#endif
+    }
+
+    sharedSums[local] = sums;
+    sharedBox[local] = box;
+    barrier();
+    for (uint stride = 128u; stride > 0u; stride >>= 1) {
+        if (local < stride) {
+            sharedSums[local] += sharedSums[local + stride];
+            sharedBox[local] = addBox(sharedBox[local], sharedBox[local + stride]);
+        }
+        barrier();
+    }
+    if (local == 0u)
+        partialsOut[group] = Partial(sharedSums[0], sharedBox[0]);
+}
+)";
+
+const size_t partialBytes = 8 * sizeof(float);
+
+} // namespace
+
+GpuDiagnostics::GpuDiagnostics(ProgramCache& cache)
+    : cache(cache), partialsCapacity(0), current(0), dropped(0), fresh(false)
+{
+    for (int k = 0; k < NUM_KERNELS; k++) {
+        variants[k].computeSource = std::string(computeHeader) + reduceHeader + packedGlsl
+            + reduceMain;
+        programs[k] = 0;
+    }
+    variants[PARTICLES_COMPACT].flags.push_back("COMPACT");
+    variants[PARTIALS].flags.push_back("PARTIALS");
+
+    partials[0] = partials[1] = results[0] = results[1] = 0;
+    fences[0] = fences[1] = 0;
+    counts[0] = counts[1] = 0;
+    if (!isSupported())
+        return;
+    for (int k = 0; k < NUM_KERNELS; k++)
+        cache.request(variants[k]);
+
+    glGenBuffers(2, results);
+    for (int i = 0; i < 2; i++) {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, results[i]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, partialBytes, nullptr, GL_STREAM_READ);
+    }
+}
+
+GpuDiagnostics::~GpuDiagnostics()
+{
+    glDeleteBuffers(2, partials);
+    glDeleteBuffers(2, results);
+    for (int i = 0; i < 2; i++)
+        if (fences[i])
+            glDeleteSync(fences[i]);
+}
+
+bool GpuDiagnostics::isSupported()
+{
+    return GpuPrimitives::isSupported();
+}
+
+bool GpuDiagnostics::isValid()
+{
+    if (!isSupported())
+        return false;
+    bool valid = true;
+    for (int k = 0; k < NUM_KERNELS; k++) {
+        if (!programs[k])
+            programs[k] = cache.get(variants[k]);
+        valid = valid && programs[k];
+    }
+    return valid;
+}
+
+void GpuDiagnostics::use(Kernel kernel, size_t count, size_t groups)
+{
+    if (!programs[kernel])
+        programs[kernel] = cache.get(variants[kernel]);
+    glUseProgram(programs[kernel]);
+    glUniform1ui(0, GLuint(count));
+    glUniform1ui(1, GLuint(groups));
+}
+
+void GpuDiagnostics::update(const ParticleSystem& system)
+{
+    if (!isSupported())
+        return;
+    TRACE_SCOPE("gpu diagnostics");
+
+    // the last update's result
+    int previous = current ^ 1;
+    fresh = false;
+    if (fences[previous]) {
+        GLint status;
+        glGetSynciv(fences[previous], GL_SYNC_STATUS, 1, nullptr, &status);
+        if (status == GL_SIGNALED) {
+            latest.clear();
+            if (counts[previous] > 0) {
+                float values[8];
+                glBindBuffer(GL_SHADER_STORAGE_BUFFER, results[previous]);
+                glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(values), values);
+                latest.count = counts[previous];
+                latest.momentumX = values[0];
+                latest.momentumY = values[1];
+                latest.energy = values[2];
+                latest.minX = values[4];
+                latest.minY = values[5];
+                latest.maxX = values[6];
+                latest.maxY = values[7];
+            }
+            fresh = true;
+        } else {
+            dropped++;
+        }
+        glDeleteSync(fences[previous]);
+        fences[previous] = 0;
+    }
+
+    // this one's, level by level, into the results at the top
+    size_t count = system.count();
+    counts[current] = count;
+    size_t tiles = (count + tileSize - 1) / tileSize;
+    if (partialsCapacity < tiles) {
+        if (!partials[0])
+            glGenBuffers(2, partials);
+        for (int i = 0; i < 2; i++) {
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, partials[i]);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, tiles * partialBytes, nullptr,
+                    GL_DYNAMIC_COPY);
+        }
+        partialsCapacity = tiles;
+    }
+
+    Kernel kernel = system.isCompact() ? PARTICLES_COMPACT : PARTICLES;
+    GLuint in = system.getBuffer();
+    int out = 0;
+    while (count > 0) {
+        tiles = (count + tileSize - 1) / tileSize;
+        GLuint target = tiles == 1 ? results[current] : partials[out];
+        use(kernel, count, tiles);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, in);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, target);
+        dispatchGroups(tiles);
+        if (tiles == 1)
+            break;
+        in = target;
+        out ^= 1;
+        count = tiles;
+        kernel = PARTIALS;
+    }
+    fences[current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    current = previous;
+}
@@ -0,0 +1,70 @@
+#ifndef GRAVITY_GPUDIAGNOSTICS_H
+#define GRAVITY_GPUDIAGNOSTICS_H
+
+#include <GL/glew.h>
+
+#include "diagnostics.h"
+#include "particlesystem.h"
+#include "programcache.h"
+
+// A ParticleSystem's Diagnostics, reduced on the GPU from its buffer by
+// compute shaders, a tile of 1024 particles per workgroup and then the
+// tiles' partial results until one is left. Only those 32 bytes come
+// back, and they are double buffered like GpuTimer's queries: a step's
+// result is collected on the next update(), and dropped rather than
+// waited for if the GPU has not got to it by then, so the diagnostics
+// never stall the pipeline.
+//
+// The programs come from, and are owned by, a ProgramCache that has to
+// outlive this. Calls leave their program bound and storage buffer
+// bindings 0 and 1 changed. Needs its context current for every call,
+// destruction included.
+class GpuDiagnostics {
+public:
+    explicit GpuDiagnostics(ProgramCache& cache);
+    ~GpuDiagnostics();
+
+    GpuDiagnostics(const GpuDiagnostics&) = delete;
+    GpuDiagnostics& operator=(const GpuDiagnostics&) = delete;
+
+    // GL 4.3, for compute shaders and storage buffers, like GpuPrimitives
+    static bool isSupported();
+
+    // false if a program failed to build; waits for them
+    bool isValid();
+
+    // collect the last update's result if it is ready, then start reducing
+    // the system's current particles; call once per step, with the system
+    // settled
+    void update(const ParticleSystem& system);
+
+    // the result collected by the last update(), if there was one
+    bool getLatest(Diagnostics* diagnostics) const
+    {
+        *diagnostics = latest;
+        return fresh;
+    }
+
+    // results the GPU had not finished when they were due
+    int getDropped() const { return dropped; }
+
+private:
+    enum Kernel { PARTICLES, PARTICLES_COMPACT, PARTIALS, NUM_KERNELS };
+
+    void use(Kernel kernel, size_t count, size_t groups);
+
+    ProgramCache& cache;
+    ProgramVariant variants[NUM_KERNELS];
+    GLuint programs[NUM_KERNELS];
+    GLuint partials[2]; // ping-pong between the levels of the reduction
+    size_t partialsCapacity; // tiles
+    GLuint results[2];
+    GLsync fences[2];
+    uint64_t counts[2]; // particles each result is of
+    int current;
+    int dropped;
+    Diagnostics latest;
+    bool fresh;
+};
+
+#endif
@@ -0,0 +1,537 @@
+#include "gpuprimitives.h"
+
+#include <algorithm>
+
+#include "packed.h"
+#include "trace.h"
+
+namespace {
+
+const size_t groupSize = 256;
+const size_t tileSize = 1024; // scan tiles, 4 elements a thread
+const size_t maxGroups = 65535; // along one dimension, the least GL allows
+const int radixBits = 4;
+const int radixDigits = 1 << radixBits;
+
+// Each thread scans its four elements in turn, a Hillis-Steele scan over
+// the threads' totals in shared memory gives each thread its carry, and
+// the tile's total, its SEGMENTED flag and where its first flag is go to
+// the level above, for the carries between tiles. Values and sums may be the
+// same buffer: each element is read and then written by one thread.
+const char* const scanSource = R"(
+const uint tile = 1024u;
+
+layout(std430, binding = 0) buffer Values { uint values[]; };
+#ifndef REDUCE
+layout(std430, binding = 1) buffer Sums { uint sums[]; };
+#endif
+layout(std430, binding = 3) buffer TileSums { uint tileSums[]; };
+#ifdef SEGMENTED
+layout(std430, binding = 2) buffer Flags { uint flags[]; };
+layout(std430, binding = 4) buffer TileFlags { uint tileFlags[]; };
+layout(std430, binding = 5) buffer TileFirst { uint tileFirst[]; };
+shared uint partialFlags[256];
+shared uint first;
+#endif
+shared uint partial[256];
+
+void main() {
+    uint group = groupIndex();
+    if (group >= numGroups)
+        return;
+    uint local = gl_LocalInvocationID.x;
+    uint base = group*tile + 4u*local;
+
+#ifdef SEGMENTED
+    if (local == 0u)
+        first = tile;
+    barrier();
+    bool flagged[4];
+    bool seen = false;
+#endif
+    uint own[4];
+    uint sum = 0u;
+    for (uint k = 0u; k < 4u; k++) {
+        uint i = base + k;
+        uint v = i < count ? values[i] : 0u;
+#ifdef SEGMENTED
+        if (i < count && flags[i] != 0u) {
+            if (!seen)
+                atomicMin(first, 4u*local + k);
+            seen = true;
+            sum = 0u;
+        }
+        flagged[k] = seen;
+#endif
+        own[k] = sum;
+        sum += v;
+    }
+
+    partial[local] = sum;
+#ifdef SEGMENTED
+    partialFlags[local] = seen ? 1u : 0u;
+#endif
+    barrier();
+    for (uint offset = 1u; offset < 256u; offset <<= 1) {
+        uint s = partial[local];
+#ifdef SEGMENTED
+        uint f = partialFlags[local];
+        if (local >= offset) {
+            if (f == 0u)
+                s += partial[local - offset];
+            f |= partialFlags[local - offset];
+        }
+#else
+        if (local >= offset)
+            s += partial[local - offset];
+#endif
+        barrier();
+        partial[local] = s;
+#ifdef SEGMENTED
+        partialFlags[local] = f;
+#endif
+        barrier();
+    }
+
+#ifndef REDUCE
+    uint carry = local > 0u ? partial[local - 1u] : 0u;
+    for (uint k = 0u; k < 4u; k++) {
+        uint i = base + k;
+#ifdef SEGMENTED
+        if (i < count)
+            sums[i] = flagged[k] ? own[k] : own[k] + carry;
+#else
+        if (i < count)
+            sums[i] = own[k] + carry;
+#endif
+    }
+#endif
+
+    if (local == 255u) {
+        tileSums[group] = partial[255];
+#ifdef SEGMENTED
+        tileFlags[group] = partialFlags[255];
+        tileFirst[group] = first;
+#endif
+    }
+}
+)";
+
+// what the tiles before each one add up to, into all of it, or with
+// SEGMENTED into what comes before its first flag
+const char* const addCarriesSource = R"(
+const uint tile = 1024u;
+
+layout(std430, binding = 1) buffer Sums { uint sums[]; };
+layout(std430, binding = 3) buffer TileSums { uint tileSums[]; };
+layout(std430, binding = 6) buffer TileScanned { uint tileScanned[]; };
+#ifdef SEGMENTED
+layout(std430, binding = 5) buffer TileFirst { uint tileFirst[]; };
+#endif
+
+void main() {
+    uint group = groupIndex();
+    if (group == 0u || group >= numGroups)
+        return;
+    uint carry = tileScanned[group - 1u] + tileSums[group - 1u];
+#ifdef SEGMENTED
+    uint limit = tileFirst[group];
+#else
+    uint limit = tile;
+#endif
+    for (uint k = 0u; k < 4u; k++) {
+        uint local = k*256u + gl_LocalInvocationID.x;
+        uint i = group*tile + local;
+        if (i < count && local < limit)
+            sums[i] += carry;
+    }
+}
+)";
+
+// how many of each tile's keys have each digit, digit by digit, so that
+// scanned they are where each tile's run of each digit goes
+const char* const radixCountSource = R"(
+layout(location = 2) uniform uint shift;
+layout(location = 3) uniform uint digitBits;
+
+layout(std430, binding = 0) buffer Keys { uint keys[]; };
+layout(std430, binding = 4) buffer Counts { uint counts[]; };
+
+shared uint histogram[16];
+
+void main() {
+    uint group = groupIndex();
+    if (group >= numGroups)
+        return;
+    uint local = gl_LocalInvocationID.x;
+    if (local < 16u)
+        histogram[local] = 0u;
+    barrier();
+    uint i = group*256u + local;
+    if (i < count)
+        atomicAdd(histogram[(keys[i] >> shift) & ((1u << digitBits) - 1u)], 1u);
+    barrier();
+    if (local < 16u)
+        counts[local*numGroups + group] = histogram[local];
+}
+)";
+
+// Sorts the tile by the digit a bit at a time in shared memory, each bit a
+// stable split by a scan of the zeros, so that each digit's keys are
+// together and in order, then moves them after those of earlier tiles.
+// Past the end are keys of all ones, which sort last.
+const char* const radixScatterSource = R"(
+layout(location = 2) uniform uint shift;
+layout(location = 3) uniform uint digitBits;
+
+layout(std430, binding = 0) buffer Keys { uint keys[]; };
+layout(std430, binding = 1) buffer Values { uint values[]; };
+layout(std430, binding = 2) buffer ToKeys { uint toKeys[]; };
+layout(std430, binding = 3) buffer ToValues { uint toValues[]; };
+layout(std430, binding = 4) buffer Offsets { uint offsets[]; };
+
+shared uint zeros[256];
+shared uint sortedKeys[256];
+shared uint sortedValues[256];
+shared uint starts[16];
+
+void main() {
+    uint group = groupIndex();
+    if (group >= numGroups)
+        return;
+    uint local = gl_LocalInvocationID.x;
+    uint i = group*256u + local;
+    uint key = i < count ? keys[i] : 0xffffffffu;
+    uint value = i < count ? values[i] : 0u;
+
+    for (uint bit = 0u; bit < digitBits; bit++) {
+        uint zero = 1u - ((key >> (shift + bit)) & 1u);
+        zeros[local] = zero;
+        barrier();
+        for (uint offset = 1u; offset < 256u; offset <<= 1) {
+            uint z = zeros[local];
+            if (local >= offset)
+                z += zeros[local - offset];
+            barrier();
+            zeros[local] = z;
+            barrier();
+        }
+        uint before = zeros[local] - zero;
+        uint to = zero != 0u ? before : zeros[255] + local - before;
+        sortedKeys[to] = key;
+        sortedValues[to] = value;
+        barrier();
+        key = sortedKeys[local];
+        value = sortedValues[local];
+        barrier();
+    }
+
+    uint digitMask = (1u << digitBits) - 1u;
+    uint digit = (key >> shift) & digitMask;
+    if (local == 0u || ((sortedKeys[local - 1u] >> shift) & digitMask) != digit)
+        starts[digit] = local;
+    barrier();
+    if (local < min(count - group*256u, 256u)) {
+        uint to = offsets[digit*numGroups + group] + local - starts[digit];
+        toKeys[to] = key;
+        toValues[to] = value;
+    }
+}
+)";
+
+// precise, so that the cell rounds as CpuPrimitives' does
+const char* const cellKeysHeader = R"(
+layout(location = 2) uniform uvec2 grid;
+layout(location = 3) uniform vec2 scale;
+
+#ifdef COMPACT
+layout(std430, binding = 0) buffer Particles { uvec2 particles[]; };
+#else
+layout(std430, binding = 0) buffer Particles { vec4 particles[]; };
+#endif
+layout(std430, binding = 1) buffer Keys { uint keys[]; };
+layout(std430, binding = 2) buffer Indices { uint indices[]; };
+)";
+
+const char* const cellKeysMain = R"(
+uint gridCell(float v, float scale, uint cells) {
+    precise float c = (v + 1.0)*scale;
+    return uint(clamp(int(c), 0, int(cells) - 1));
+}
+
+void main() {
+    uint i = groupIndex()*256u + gl_LocalInvocationID.x;
+    if (i >= count)
+        return;
+#ifdef COMPACT
+    vec2 p = unpackPosition(particles[i].x);
+#else
+    vec2 p = particles[i].xy;
+#endif
+    keys[i] = gridCell(p.y, scale.y, grid.y)*grid.x + gridCell(p.x, scale.x, grid.x);
+    indices[i] = i;
+}
+)";
+
+// scratch for count uints, creating the buffer if need be
+void allocate(GLuint& buffer, size_t count)
+{
+    if (!buffer)
+        glGenBuffers(1, &buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, std::max<size_t>(count, 1) * sizeof(GLuint),
+            nullptr, GL_DYNAMIC_COPY);
+}
+
+void bind(GLuint index, GLuint buffer)
+{
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, index, buffer);
+}
+
+} // namespace
+
+// Past maxGroups workgroups the dispatch is two dimensional, and some of
+// the last row's groups have nothing to do; numGroups is how many do.
+const char* const computeHeader = R"(
+#version 430
+
+layout(local_size_x = 256) in;
+
+layout(location = 0) uniform uint count;
+layout(location = 1) uniform uint numGroups;
+
+uint groupIndex() {
+    return gl_WorkGroupID.y*gl_NumWorkGroups.x + gl_WorkGroupID.x;
+}
+)";
+
+void dispatchGroups(size_t groups)
+{
+    if (groups == 0)
+        return;
+    GLuint x = GLuint(std::min(groups, maxGroups));
+    glDispatchCompute(x, GLuint((groups + x - 1) / x), 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+}
+
+GpuPrimitives::GpuPrimitives(ProgramCache& cache)
+    : cache(cache), spareKeys(0), spareValues(0), counts(0), spareCapacity(0),
+      countsCapacity(0)
+{
+    const char* sources[NUM_KERNELS] = {
+        scanSource, scanSource, scanSource, addCarriesSource, addCarriesSource,
+        radixCountSource, radixScatterSource, cellKeysHeader, cellKeysHeader
+    };
+    for (int k = 0; k < NUM_KERNELS; k++) {
+        variants[k].computeSource = std::string(computeHeader) + sources[k];
+        if (k == CELL_KEYS || k == CELL_KEYS_COMPACT)
+            variants[k].computeSource += std::string(packedGlsl) + cellKeysMain;
+        programs[k] = 0;
+    }
+    variants[SEGMENTED_SCAN].flags.push_back("SEGMENTED");
+    variants[REDUCE].flags.push_back("REDUCE");
+    variants[ADD_SEGMENTED_CARRIES].flags.push_back("SEGMENTED");
+    variants[CELL_KEYS_COMPACT].flags.push_back("COMPACT");
+
+    for (Level& level : levels) {
+        level.sums = level.scanned = level.flags = level.first = 0;
+        level.capacity = 0;
+    }
+
+    if (isSupported())
+        for (int k = 0; k < NUM_KERNELS; k++)
+            cache.request(variants[k]);
+}
+
+GpuPrimitives::~GpuPrimitives()
+{
+    for (Level& level : levels) {
+        glDeleteBuffers(1, &level.sums);
+        glDeleteBuffers(1, &level.scanned);
+        glDeleteBuffers(1, &level.flags);
+        glDeleteBuffers(1, &level.first);
+    }
+    glDeleteBuffers(1, &spareKeys);
+    glDeleteBuffers(1, &spareValues);
+    glDeleteBuffers(1, &counts);
+}
+
+bool GpuPrimitives::isSupported()
+{
+    return GLEW_VERSION_4_3;
+}
+
+bool GpuPrimitives::isValid()
+{
+    if (!isSupported())
+        return false;
+    bool valid = true;
+    for (int k = 0; k < NUM_KERNELS; k++) {
+        if (!programs[k])
+            programs[k] = cache.get(variants[k]);
+        valid = valid && programs[k];
+    }
+    return valid;
+}
+
+void GpuPrimitives::use(Kernel kernel, size_t count, size_t groups)
+{
+    if (!programs[kernel])
+        programs[kernel] = cache.get(variants[kernel]);
+    glUseProgram(programs[kernel]);
+    glUniform1ui(0, GLuint(count));
+    glUniform1ui(1, GLuint(groups));
+}
+
+GpuPrimitives::Level& GpuPrimitives::getLevel(int level, size_t tiles)
+{
+    Level& l = levels[level];
+    if (l.capacity < tiles) {
+        allocate(l.sums, tiles);
+        allocate(l.scanned, tiles);
+        allocate(l.flags, tiles);
+        allocate(l.first, tiles);
+        l.capacity = tiles;
+    }
+    return l;
+}
+
+uint32_t GpuPrimitives::reduce(GLuint values, size_t count)
+{
+    TRACE_SCOPE("gpu reduce");
+    if (count == 0)
+        return 0;
+    int level = 0;
+    for (;;) {
+        size_t tiles = (count + tileSize - 1) / tileSize;
+        Level& l = getLevel(level, tiles);
+        use(REDUCE, count, tiles);
+        bind(0, values);
+        bind(3, l.sums);
+        dispatchGroups(tiles);
+        if (tiles == 1)
+            break;
+        values = l.sums;
+        count = tiles;
+        level++;
+    }
+    uint32_t sum;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, levels[level].sums);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(sum), &sum);
+    return sum;
+}
+
+void GpuPrimitives::exclusiveScan(GLuint values, size_t count, GLuint sums)
+{
+    TRACE_SCOPE("gpu scan");
+    scan(values, 0, count, sums, 0);
+}
+
+void GpuPrimitives::segmentedScan(GLuint values, GLuint flags, size_t count, GLuint sums)
+{
+    TRACE_SCOPE("gpu segmented scan");
+    scan(values, flags, count, sums, 0);
+}
+
+// scan each tile, then the tiles' sums a level up, and add those in
+void GpuPrimitives::scan(GLuint values, GLuint flags, size_t count, GLuint sums, int level)
+{
+    if (count == 0)
+        return;
+    size_t tiles = (count + tileSize - 1) / tileSize;
+    Level& l = getLevel(level, tiles);
+    use(flags ? SEGMENTED_SCAN : SCAN, count, tiles);
+    bind(0, values);
+    bind(1, sums);
+    bind(2, flags);
+    bind(3, l.sums);
+    bind(4, l.flags);
+    bind(5, l.first);
+    dispatchGroups(tiles);
+    if (tiles == 1)
+        return;
+
+    scan(l.sums, flags ? l.flags : 0, tiles, l.scanned, level + 1);
+
+    use(flags ? ADD_SEGMENTED_CARRIES : ADD_CARRIES, count, tiles);
+    bind(1, sums);
+    bind(3, l.sums);
+    bind(5, l.first);
+    bind(6, l.scanned);
+    dispatchGroups(tiles);
+}
+
+// Least significant digit first radix sort, four bits a pass, the last
+// narrower if bits is not a multiple of four: count the digits of each tile
+// of 256 keys, scan the counts into where each tile's run of each digit
+// goes, and move the pairs there. The passes alternate between the buffers
+// and the spares.
+void GpuPrimitives::sortPairs(GLuint keys, GLuint values, size_t count, int bits)
+{
+    TRACE_SCOPE("gpu sort pairs");
+    if (count == 0)
+        return;
+    size_t tiles = (count + groupSize - 1) / groupSize;
+    if (spareCapacity < count) {
+        allocate(spareKeys, count);
+        allocate(spareValues, count);
+        spareCapacity = count;
+    }
+    if (countsCapacity < radixDigits * tiles) {
+        allocate(counts, radixDigits * tiles);
+        countsCapacity = radixDigits * tiles;
+    }
+
+    GLuint fromKeys = keys, fromValues = values;
+    GLuint toKeys = spareKeys, toValues = spareValues;
+    for (int shift = 0; shift < bits; shift += radixBits) {
+        GLuint digitBits = GLuint(std::min(radixBits, bits - shift));
+        use(RADIX_COUNT, count, tiles);
+        glUniform1ui(2, GLuint(shift));
+        glUniform1ui(3, digitBits);
+        bind(0, fromKeys);
+        bind(4, counts);
+        dispatchGroups(tiles);
+
+        scan(counts, 0, radixDigits * tiles, counts, 0);
+
+        use(RADIX_SCATTER, count, tiles);
+        glUniform1ui(2, GLuint(shift));
+        glUniform1ui(3, digitBits);
+        bind(0, fromKeys);
+        bind(1, fromValues);
+        bind(2, toKeys);
+        bind(3, toValues);
+        bind(4, counts);
+        dispatchGroups(tiles);
+
+        std::swap(fromKeys, toKeys);
+        std::swap(fromValues, toValues);
+    }
+
+    if (fromKeys != keys) {
+        glBindBuffer(GL_COPY_READ_BUFFER, fromKeys);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, keys);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0,
+                count * sizeof(GLuint));
+        glBindBuffer(GL_COPY_READ_BUFFER, fromValues);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, values);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0,
+                count * sizeof(GLuint));
+    }
+}
+
+void GpuPrimitives::cellKeys(const ParticleSystem& system, int gridWidth, int gridHeight,
+        GLuint keys, GLuint indices)
+{
+    TRACE_SCOPE("gpu cell keys");
+    size_t count = system.count();
+    size_t groups = (count + groupSize - 1) / groupSize;
+    use(system.isCompact() ? CELL_KEYS_COMPACT : CELL_KEYS, count, groups);
+    glUniform2ui(2, GLuint(gridWidth), GLuint(gridHeight));
+    glUniform2f(3, 0.5f * float(gridWidth), 0.5f * float(gridHeight));
+    bind(0, system.getBuffer());
+    bind(1, keys);
+    bind(2, indices);
+    dispatchGroups(groups);
+}
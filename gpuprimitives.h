@@ -0,0 +1,91 @@
+#ifndef GRAVITY_GPUPRIMITIVES_H
+#define GRAVITY_GPUPRIMITIVES_H
+
+#include <GL/glew.h>
+#include <cstddef>
+#include <cstdint>
+
+#include "particlesystem.h"
+#include "programcache.h"
+
+// The start of a compute shader of 256 thread workgroups: #version, the
+// uniforms count at location 0 and numGroups at 1, and groupIndex(), the
+// workgroup's index among numGroups. Kernels return at once past those.
+extern const char* const computeHeader;
+
+// dispatch groups of a kernel that starts with computeHeader, in rows of
+// at most 65535, and make what it wrote visible to later kernels and
+// buffer reads
+void dispatchGroups(size_t groups);
+
+// CpuPrimitives as compute shaders, on GL buffers of 32-bit unsigned
+// integers, with the same results bit for bit. Works a tile of 1024
+// elements per workgroup, and scans the tiles' sums with itself until one
+// tile holds them all.
+//
+// The programs come from, and are owned by, a ProgramCache that has to
+// outlive this; they are requested on construction and collected on first
+// use. Calls leave their programs bound and storage buffer bindings 0 to 6
+// changed, and their results ready for later shaders and buffer reads;
+// drawing from them needs a further glMemoryBarrier. Scratch buffers are
+// kept between calls. Needs its context current for every call,
+// destruction included.
+class GpuPrimitives {
+public:
+    explicit GpuPrimitives(ProgramCache& cache);
+    ~GpuPrimitives();
+
+    GpuPrimitives(const GpuPrimitives&) = delete;
+    GpuPrimitives& operator=(const GpuPrimitives&) = delete;
+
+    // GL 4.3, for compute shaders, storage buffers and uniform locations,
+    // without which nothing here works
+    static bool isSupported();
+
+    // false if a program failed to build; waits for them
+    bool isValid();
+
+    // the sum of the first count values; waits for it
+    uint32_t reduce(GLuint values, size_t count);
+
+    // sums[i] = values[0] + ... + values[i-1]; sums may be values
+    void exclusiveScan(GLuint values, size_t count, GLuint sums);
+
+    // the same, starting again from 0 at every nonzero flag
+    void segmentedScan(GLuint values, GLuint flags, size_t count, GLuint sums);
+
+    // sort keys ascending by their low bits, carrying values along, and
+    // keeping pairs with equal keys in order, as CpuPrimitives does
+    void sortPairs(GLuint keys, GLuint values, size_t count, int bits = 32);
+
+    // the grid cell of each of the system's particles and its index, as
+    // CpuPrimitives::cellKeys() works them out; the system has to be
+    // settled
+    void cellKeys(const ParticleSystem& system, int gridWidth, int gridHeight,
+            GLuint keys, GLuint indices);
+
+private:
+    enum Kernel {
+        SCAN, SEGMENTED_SCAN, REDUCE, ADD_CARRIES, ADD_SEGMENTED_CARRIES,
+        RADIX_COUNT, RADIX_SCATTER, CELL_KEYS, CELL_KEYS_COMPACT, NUM_KERNELS
+    };
+
+    // a uint each of scratch per tile of the level below
+    struct Level {
+        GLuint sums, scanned, flags, first;
+        size_t capacity; // tiles
+    };
+
+    void use(Kernel kernel, size_t count, size_t groups);
+    Level& getLevel(int level, size_t tiles);
+    void scan(GLuint values, GLuint flags, size_t count, GLuint sums, int level);
+
+    ProgramCache& cache;
+    ProgramVariant variants[NUM_KERNELS];
+    GLuint programs[NUM_KERNELS];
+    Level levels[3]; // as many as 2^32 elements need
+    GLuint spareKeys, spareValues, counts;
+    size_t spareCapacity, countsCapacity; // uints
+};
+
+#endif
@@ -0,0 +1,124 @@
+// Checks that GpuPrimitives gives the same bits as CpuPrimitives, which
+// primitivestest checks against serial loops. Skipped, with ctest's skip
+// code, where there is no offscreen context or it lacks GL 4.3.
+
+#include <GL/glew.h>
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "context.h"
+#include "gpuprimitives.h"
+#include "primitives.h"
+#include "programcache.h"
+#include "threadpool.h"
+
+static const int skipped = 77;
+
+static int failures = 0;
+
+static void check(bool ok, const char* what, size_t count)
+{
+    if (!ok) {
+        std::fprintf(stderr, "FAILED %s, %zu elements\n", what, count);
+        failures++;
+    }
+}
+
+static void upload(GLuint buffer, const std::vector<uint32_t>& data)
+{
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, std::max<size_t>(data.size(), 1) * sizeof(uint32_t),
+            data.data(), GL_DYNAMIC_COPY);
+}
+
+static std::vector<uint32_t> download(GLuint buffer, size_t count)
+{
+    std::vector<uint32_t> data(count);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, count * sizeof(uint32_t), data.data());
+    return data;
+}
+
+static void checkCount(CpuPrimitives& cpu, GpuPrimitives& gpu, const GLuint* buffers,
+        size_t count)
+{
+    std::default_random_engine generator(uint32_t(count) + 1);
+    std::vector<uint32_t> values(count), flags(count), keys(count), indices(count);
+    for (size_t i = 0; i < count; i++) {
+        values[i] = uint32_t(generator());
+        // segments starting on and either side of the 1024 element tiles
+        size_t tile = i % 1024;
+        flags[i] = generator() % 64 == 0 || tile == 0 || tile == 1 || tile == 1023;
+        keys[i] = uint32_t(generator());
+        indices[i] = uint32_t(i);
+    }
+
+    upload(buffers[0], values);
+    check(gpu.reduce(buffers[0], count) == cpu.reduce(values.data(), count), "reduce", count);
+
+    std::vector<uint32_t> sums(count);
+    upload(buffers[1], sums);
+    cpu.exclusiveScan(values.data(), count, sums.data());
+    gpu.exclusiveScan(buffers[0], count, buffers[1]);
+    check(download(buffers[1], count) == sums, "exclusive scan", count);
+
+    upload(buffers[2], flags);
+    cpu.segmentedScan(values.data(), flags.data(), count, sums.data());
+    gpu.segmentedScan(buffers[0], buffers[2], count, buffers[1]);
+    check(download(buffers[1], count) == sums, "segmented scan", count);
+
+    // 12 is not a whole number of digits for either; the bits above those
+    // sorted on ride along and must stay in order
+    const int bits[] = { 12, 16, 32 };
+    for (int b : bits) {
+        std::vector<uint32_t> sortedKeys = keys, sortedIndices = indices;
+        upload(buffers[0], sortedKeys);
+        upload(buffers[1], sortedIndices);
+        cpu.sortPairs(sortedKeys.data(), sortedIndices.data(), count, b);
+        gpu.sortPairs(buffers[0], buffers[1], count, b);
+        char what[32];
+        std::snprintf(what, sizeof(what), "sort pairs, %d bits", b);
+        check(download(buffers[0], count) == sortedKeys
+                && download(buffers[1], count) == sortedIndices, what, count);
+    }
+}
+
+int main()
+{
+    std::unique_ptr<Context> context = createOffscreenContext(64, 64, 1);
+    if (!context) {
+        std::printf("no offscreen context, skipped\n");
+        return skipped;
+    }
+    if (!GpuPrimitives::isSupported()) {
+        std::printf("no GL 4.3 compute shaders, skipped\n");
+        return skipped;
+    }
+
+    ProgramCache cache;
+    GpuPrimitives gpu(cache);
+    if (!gpu.isValid()) {
+        std::fprintf(stderr, "FAILED to build the compute shaders\n");
+        return 1;
+    }
+    ThreadPool pool(4);
+    CpuPrimitives cpu(pool);
+
+    GLuint buffers[3];
+    glGenBuffers(3, buffers);
+    // one tile, several, and enough for the tile sums to be scanned in tiles
+    const size_t counts[] = { 1, 3, 255, 256, 257, 1023, 1024, 1025, 4097, 65537, 1100003 };
+    for (size_t count : counts)
+        checkCount(cpu, gpu, buffers, count);
+    glDeleteBuffers(3, buffers);
+
+    if (failures > 0) {
+        std::fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    std::printf("GPU primitives agree with the CPU ones\n");
+    return 0;
+}
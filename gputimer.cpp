@@ -0,0 +1,68 @@
+#include "gputimer.h"
+
+GpuTimer::GpuTimer()
+    : supported(GLEW_VERSION_3_3 || GLEW_ARB_timer_query), current(0), dropped(0)
+{
+    for (int phase = 0; phase < NUM_PHASES; phase++) {
+        pending[0][phase] = pending[1][phase] = false;
+        latest[phase] = 0.0;
+        fresh[phase] = false;
+    }
+
+    if (supported)
+        glGenQueries(2 * NUM_PHASES, &queries[0][0]);
+}
+
+GpuTimer::~GpuTimer()
+{
+    if (supported)
+        glDeleteQueries(2 * NUM_PHASES, &queries[0][0]);
+}
+
+void GpuTimer::begin(Phase phase)
+{
+    if (!supported)
+        return;
+    glBeginQuery(GL_TIME_ELAPSED, queries[current][phase]);
+    pending[current][phase] = true;
+}
+
+void GpuTimer::end()
+{
+    if (supported)
+        glEndQuery(GL_TIME_ELAPSED);
+}
+
+void GpuTimer::endFrame()
+{
+    if (!supported)
+        return;
+
+    // the other set holds the previous frame, and is reused next frame
+    current ^= 1;
+    for (int phase = 0; phase < NUM_PHASES; phase++) {
+        fresh[phase] = false;
+        if (!pending[current][phase])
+            continue;
+        pending[current][phase] = false;
+
+        GLint available = 0;
+        glGetQueryObjectiv(queries[current][phase], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) {
+            dropped++;
+            continue;
+        }
+
+        GLuint64 elapsed;
+        glGetQueryObjectui64v(queries[current][phase], GL_QUERY_RESULT, &elapsed);
+        latest[phase] = elapsed * 1e-6;
+        fresh[phase] = true;
+        stats[phase].add(latest[phase]);
+    }
+}
+
+const char* GpuTimer::getName(Phase phase)
+{
+    static const char* names[NUM_PHASES] = { "simulate", "render", "present" };
+    return names[phase];
+}
@@ -0,0 +1,58 @@
+#ifndef GRAVITY_GPUTIMER_H
+#define GRAVITY_GPUTIMER_H
+
+#include <GL/glew.h>
+
+#include "stats.h"
+
+// GPU time spent in each phase of a frame, from GL_TIME_ELAPSED queries.
+// Queries are double buffered: a frame's results are collected while the
+// next frame is recorded, and dropped rather than waited for if the GPU has
+// not got to them by then, so timing never stalls the pipeline.
+class GpuTimer {
+public:
+    enum Phase { SIMULATE, RENDER, PRESENT, NUM_PHASES };
+
+    GpuTimer();
+    ~GpuTimer();
+
+    GpuTimer(const GpuTimer&) = delete;
+    GpuTimer& operator=(const GpuTimer&) = delete;
+
+    // needs OpenGL 3.3 or ARB_timer_query; otherwise every call is a no-op
+    bool isSupported() const { return supported; }
+
+    // phases cannot overlap
+    void begin(Phase phase);
+    void end();
+
+    // call after the last phase of each frame
+    void endFrame();
+
+    // milliseconds per frame
+    const RollingStats& getStats(Phase phase) const { return stats[phase]; }
+
+    // the result collected by the last endFrame(), if there was one
+    bool getLatest(Phase phase, double* ms) const
+    {
+        *ms = latest[phase];
+        return fresh[phase];
+    }
+
+    // results the GPU had not finished when they were due
+    int getDropped() const { return dropped; }
+
+    static const char* getName(Phase phase);
+
+private:
+    bool supported;
+    GLuint queries[2][NUM_PHASES];
+    bool pending[2][NUM_PHASES];
+    int current;
+    int dropped;
+    RollingStats stats[NUM_PHASES];
+    double latest[NUM_PHASES];
+    bool fresh[NUM_PHASES];
+};
+
+#endif
@@ -1,181 +1,905 @@
 #include <GL/glew.h>
-#include <GLFW/glfw3.h>
-#include <glm/glm.hpp>
-#include <random>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
 #include <iostream>
-
-static const int numVertices = 50;
-
-const GLchar* vertexSource = R"(
+#include <random>
+#include <string>
+#include <vector>
+
+#include "allocs.h"
+#include "context.h"
+#include "diagnostics.h"
+#include "forces.h"
+#include "framestats.h"
+#include "frametarget.h"
+#include "gpudiagnostics.h"
+#include "gpuprimitives.h"
+#include "gputimer.h"
+#include "lifecycle.h"
+#include "overlay.h"
+#include "packed.h"
+#include "particles.h"
+#include "particlesystem.h"
+#include "primitives.h"
+#include "programcache.h"
+#include "replay.h"
+#include "statsserver.h"
+#include "threadpool.h"
+#include "trace.h"
+#include "view.h"
+
+// a point per particle, or with QUADS a quad per instance, sized and
+// coloured by speed unless it is a DENSITY splat; COMPACT particles are
+// unpacked by packedGlsl, which goes between the two halves
+const GLchar* renderVertexHeader = R"(
 #version 150
 
-in vec2 position; // current vertex position
-in vec2 velocity; // current vertex velocity
+#ifdef COMPACT
+in uint position;
+in uint velocity;
+#else
+in vec2 position;
+in vec2 velocity;
+#endif
 
-out vec2 newPos; // updated vertex position
-out vec2 newVel; // updated vertex velocity
+uniform vec2 scale; // world to clip space, keeps the box square
+uniform float pointSize; // in framebuffer pixels
+uniform vec2 pixelScale; // clip space per framebuffer pixel
 
-uniform vec2 source; // position of gravity source (cursor)
-uniform float dt; // timestep
+out vec2 corner; // -1 to 1 across the quad
+out vec3 color;
 
-const float reflectLoss = 0.5;
+const float fastSpeed = 2.0;
+)";
 
+const GLchar* renderVertexMain = R"(
 void main() {
-    vec2 diff = source - position;
-    float r2 = clamp(length(diff) * length(diff), 0.1, 1.0);
-    newVel = velocity + dt*normalize(diff)/r2;
-    newPos = position + dt*newVel;
-
-    if (newPos.x < -1.0 || newPos.x > 1.0)
-        newVel = reflectLoss*reflect(newVel, vec2(1.0, 0.0));
-    if (newPos.y < -1.0 || newPos.y > 1.0)
-        newVel = reflectLoss*reflect(newVel, vec2(0.0, 1.0));
-
-    gl_PointSize = 5.0;
-    gl_Position = vec4(position, 0.0, 1.0);
+#ifdef COMPACT
+    vec2 pos = unpackPosition(position);
+    vec2 vel = unpackVelocity(velocity);
+#else
+    vec2 pos = position;
+    vec2 vel = velocity;
+#endif
+    gl_Position = vec4(scale*pos, 0.0, 1.0);
+    color = vec3(1.0);
+#ifdef QUADS
+    // a triangle strip of 4 vertices per instance
+    corner = vec2(gl_VertexID & 1, gl_VertexID >> 1)*2.0 - 1.0;
+    float size = pointSize;
+#ifndef DENSITY
+    float fast = min(length(vel)/fastSpeed, 1.0);
+    size *= 0.75 + 0.5*fast;
+    color = mix(vec3(0.3, 0.5, 1.0), vec3(1.0), fast);
+#endif
+    gl_Position.xy += 0.5*size*pixelScale*corner;
+#else
+    gl_PointSize = pointSize;
+#endif
 })";
 
+// white points, or with DENSITY additive splats for the density target
 const GLchar* fragmentSource = R"(
 #version 150
 
+uniform float splatNorm; // inverse of the kernel summed over the point
+
+in vec2 corner;
+in vec3 color;
+
 out vec4 outColor;
 
 void main() {
-    outColor = vec4(1.0);
+#ifdef DENSITY
+    // Epanechnikov kernel, normalised so each particle adds up to one
+#ifdef QUADS
+    vec2 d = corner;
+#else
+    vec2 d = 2.0*gl_PointCoord - 1.0;
+#endif
+    outColor = vec4(max(1.0 - dot(d, d), 0.0) * splatNorm);
+#else
+    outColor = vec4(color, 1.0);
+#endif
 })";
 
-int main(int argc, char** argv)
+// show the rolling GPU timings in the window title and log them as JSON
+static void reportTimings(const GpuTimer& timer, Context& context, FILE* log, int frame)
 {
-    glfwInit();
-
-    // support at least OpenGL 3.2
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 2);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-
-    glfwWindowHint(GLFW_RESIZABLE, GL_FALSE);
-
-    // create a windowed window
-    GLFWwindow* window = glfwCreateWindow(800, 600, "Cursor Gravity", nullptr, nullptr);
-    glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_HIDDEN);
-
-    // activate the OpenGL context
-    glfwMakeContextCurrent(window);
-
-    // initialise GLEW
-    glewExperimental = GL_TRUE;
-    glewInit();
-
-    std::vector<glm::vec4> vertices;
-    std::default_random_engine generator; // random engine
-    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
-
-    // generate random initial positions for vertices, with 0 velocity
-    for (int i = 0; i < numVertices; i++)
-        vertices.push_back(glm::vec4(dist(generator), dist(generator), 0.0f, 0.0f));
-
-    // create vertex array object
-    GLuint vao[2];
-    glGenVertexArrays(2, vao);
-
-    // create vertex buffers and transform feedbacks
-    GLuint vbo[2];
-    glGenBuffers(2, vbo);
+    // in a fixed buffer, so that reporting allocates nothing
+    char title[512];
+    int length = std::snprintf(title, sizeof(title), "Cursor Gravity |");
+    if (log)
+        std::fprintf(log, "{\"frame\":%d,\"dropped\":%d", frame, timer.getDropped());
+
+    for (int i = 0; i < GpuTimer::NUM_PHASES; i++) {
+        GpuTimer::Phase phase = GpuTimer::Phase(i);
+        const RollingStats& stats = timer.getStats(phase);
+        double mean = stats.mean(), p50 = stats.percentile(0.5), p99 = stats.percentile(0.99);
+
+        length += std::snprintf(title + length, sizeof(title) - length,
+                " %s %.2f/%.2f/%.2f ms", GpuTimer::getName(phase), mean, p50, p99);
+
+        if (log)
+            std::fprintf(log, ",\"%s\":{\"mean\":%.4f,\"p50\":%.4f,\"p99\":%.4f}",
+                    GpuTimer::getName(phase), mean, p50, p99);
+    }
 
-    // vbo with initial vertex data
-    glBindBuffer(GL_ARRAY_BUFFER, vbo[0]);
-    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(glm::vec4),
-            &vertices[0], GL_DYNAMIC_DRAW);
-    // vbo for transform feedback
-    glBindBuffer(GL_ARRAY_BUFFER, vbo[1]);
-    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(glm::vec4),
-            nullptr, GL_DYNAMIC_DRAW);
+    std::snprintf(title + length, sizeof(title) - length, " (mean/p50/p99)");
+    context.setTitle(title);
+    if (log) {
+        std::fprintf(log, "}\n");
+        std::fflush(log);
+    }
+}
 
-    // create shaders
-    GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertexShader, 1, &vertexSource, nullptr);
-    glCompileShader(vertexShader);
+// median milliseconds per call of fn, waiting for the GPU after each
+static double timeMedianMs(const std::function<void()>& fn)
+{
+    std::vector<double> times;
+    for (int i = 0; i < 7; i++) {
+        glFinish();
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        glFinish();
+        times.push_back(std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start).count());
+    }
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
 
-    GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragmentShader, 1, &fragmentSource, nullptr);
-    glCompileShader(fragmentShader);
+// Run the CPU and GPU primitives on the same random data and on the
+// system's particles, print how long each took and whether they agree;
+// false if any result differs.
+static bool benchPrimitives(ProgramCache& cache, ParticleSystem& system)
+{
+    GpuPrimitives gpu(cache);
+    if (!gpu.isValid()) {
+        std::cerr << "compute shaders unsupported or failed to build" << std::endl;
+        return false;
+    }
+    ThreadPool pool;
+    CpuPrimitives cpu(pool);
+
+    size_t count = system.count();
+    std::default_random_engine generator(1);
+    std::vector<uint32_t> values(count), flags(count), keys(count), indices(count);
+    for (size_t i = 0; i < count; i++) {
+        values[i] = uint32_t(generator());
+        flags[i] = generator() % 64 == 0;
+        keys[i] = uint32_t(generator());
+        indices[i] = uint32_t(i);
+    }
 
-    GLuint shaderProgram = glCreateProgram();
-    glAttachShader(shaderProgram, vertexShader);
-    glAttachShader(shaderProgram, fragmentShader);
+    GLuint buffers[4];
+    glGenBuffers(4, buffers);
+    auto upload = [&](int b, const std::vector<uint32_t>& data) {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[b]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, std::max<size_t>(count, 1) * sizeof(uint32_t),
+                data.data(), GL_DYNAMIC_COPY);
+    };
+    auto matches = [&](int b, const std::vector<uint32_t>& expected) {
+        std::vector<uint32_t> result(count);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[b]);
+        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, count * sizeof(uint32_t), result.data());
+        return result == expected;
+    };
+    bool allEqual = true;
+    auto report = [&](const char* name, double cpuMs, double gpuMs, bool equal) {
+        std::printf("%-16s %10.3f ms %10.3f ms %s\n", name, cpuMs, gpuMs,
+                equal ? "equal" : "DIFFERENT");
+        allEqual = allEqual && equal;
+    };
+    std::printf("%-16s %13s %13s %d threads, %zu elements\n", "primitive", "cpu", "gpu",
+            pool.size(), count);
+
+    uint32_t cpuSum = 0, gpuSum = 0;
+    upload(0, values);
+    double cpuMs = timeMedianMs([&] { cpuSum = cpu.reduce(values.data(), count); });
+    double gpuMs = timeMedianMs([&] { gpuSum = gpu.reduce(buffers[0], count); });
+    report("reduce", cpuMs, gpuMs, cpuSum == gpuSum);
+
+    std::vector<uint32_t> sums(count);
+    upload(1, sums);
+    cpuMs = timeMedianMs([&] { cpu.exclusiveScan(values.data(), count, sums.data()); });
+    gpuMs = timeMedianMs([&] { gpu.exclusiveScan(buffers[0], count, buffers[1]); });
+    report("scan", cpuMs, gpuMs, matches(1, sums));
+
+    upload(2, flags);
+    cpuMs = timeMedianMs([&] {
+        cpu.segmentedScan(values.data(), flags.data(), count, sums.data());
+    });
+    gpuMs = timeMedianMs([&] { gpu.segmentedScan(buffers[0], buffers[2], count, buffers[1]); });
+    report("segmented scan", cpuMs, gpuMs, matches(1, sums));
+
+    // each run sorts the same pairs afresh
+    std::vector<uint32_t> sortedKeys, sortedIndices;
+    cpuMs = timeMedianMs([&] {
+        sortedKeys = keys;
+        sortedIndices = indices;
+        cpu.sortPairs(sortedKeys.data(), sortedIndices.data(), count);
+    });
+    gpuMs = timeMedianMs([&] {
+        upload(0, keys);
+        upload(1, indices);
+        gpu.sortPairs(buffers[0], buffers[1], count);
+    });
+    report("sort pairs", cpuMs, gpuMs, matches(0, sortedKeys) && matches(1, sortedIndices));
+
+    // binning the particles: a 256 x 256 grid has 16-bit keys
+    const int grid = 256;
+    std::vector<Particle> particles(count);
+    system.readback(particles.data());
+    cpuMs = timeMedianMs([&] {
+        cpu.cellKeys(particles.data(), count, grid, grid, keys.data(), indices.data());
+    });
+    gpuMs = timeMedianMs([&] { gpu.cellKeys(system, grid, grid, buffers[0], buffers[1]); });
+    report("cell keys", cpuMs, gpuMs, matches(0, keys) && matches(1, indices));
+
+    cpuMs = timeMedianMs([&] {
+        sortedKeys = keys;
+        sortedIndices = indices;
+        cpu.sortPairs(sortedKeys.data(), sortedIndices.data(), count, 16);
+    });
+    gpuMs = timeMedianMs([&] {
+        gpu.cellKeys(system, grid, grid, buffers[0], buffers[1]);
+        gpu.sortPairs(buffers[0], buffers[1], count, 16);
+    });
+    report("sort cells", cpuMs, gpuMs, matches(0, sortedKeys) && matches(1, sortedIndices));
+
+    glDeleteBuffers(4, buffers);
+    return allEqual;
+}
 
-    // notify OpenGL of the things we need out of the transform feedback
-    const GLchar* feedbackVaryings[] = { "newPos", "newVel" };
-    glTransformFeedbackVaryings(shaderProgram, 2, feedbackVaryings, GL_INTERLEAVED_ATTRIBS);
+static void usage(const char* name)
+{
+    std::cerr << "usage: " << name << " [options]\n"
+        "  --size WxH         window or offscreen framebuffer size (default 800x600)\n"
+        "  --supersample N    render at N x N samples per pixel and downsample\n"
+        "  --particles N      number of particles (default 50)\n"
+        "  --field NAME       cursor, or mixed to add masses, a spring, a vortex and drag\n"
+        "  --render MODE      points, or density for tone mapped additive splats\n"
+        "  --storage KIND     full (16 bytes a particle) or compact (8, positions\n"
+        "                     as 16-bit integers and velocities as halves)\n"
+        "  --emitter X,Y,RATE add RATE particles a second at X,Y (repeatable)\n"
+        "  --sink R           remove particles that come within R of the cursor\n"
+        "  --capacity N       most particles alive at once, at least --particles\n"
+        "                     (the default)\n"
+        "  --sprites KIND     points, quads (instanced, sized and coloured by speed)\n"
+        "                     or auto, points unless too large for the driver\n"
+        "  --offscreen        render into an offscreen framebuffer, no display needed\n"
+        "  --frames N         offscreen frames (default 600, or the replay length)\n"
+        "  --output FILE.ppm  save the last offscreen frame\n"
+        "  --record FILE      save each frame's timestep and cursor as a replay\n"
+        "  --replay FILE      drive the simulation from a replay instead of the cursor\n"
+        "  --shader-cache DIR keep linked program binaries in DIR between runs\n"
+        "  --shader-compile M auto, parallel (driver threads), thread (a shared\n"
+        "                     context on a worker thread) or serial (default auto)\n"
+        "  --timings          time frame phases on the GPU and show them\n"
+        "  --timing-log FILE  append timing statistics as JSON lines\n"
+        "  --trace FILE.json  record a Chrome trace of the frame loop\n"
+        "  --stall-ms T       frames longer than T ms count as stalls (default 100)\n"
+        "  --stall-trace PRE  dump a trace around each stall to PRE<n>.json\n"
+        "  --stats FILE.json  write frame and step time percentiles on exit\n"
+        "  --warmup N         frames after the programs are ready before the frame\n"
+        "                     loop should stop allocating (default 10)\n"
+        "  --no-alloc         abort on any allocation in a frame after the warm-up\n"
+        "  --diagnostics      reduce the energy, momentum and bounding box of the\n"
+        "                     particles on the GPU after each step, print them\n"
+        "                     once a second and on exit\n"
+        "  --stats-server A   stream each frame's times, particle count and\n"
+        "                     diagnostics as JSON lines to the clients of A,\n"
+        "                     unix:PATH or a loopback TCP port; step times need\n"
+        "                     --timings\n"
+        "  --snapshots N      with --stats-server, also stream the positions of up\n"
+        "                     to 4096 particles every N frames, which waits for\n"
+        "                     the GPU to read them back\n"
+        "  --bench-primitives check the GPU scans and sorts against the CPU ones\n"
+        "                     on --particles elements, time both, and exit\n";
+}
 
-    glLinkProgram(shaderProgram);
-    glUseProgram(shaderProgram);
+int main(int argc, char** argv)
+{
+    int width = 800, height = 600;
+    bool offscreen = false;
+    int frames = -1; // unset
+    int supersample = 1;
+    int numParticles = 50;
+    FrameTarget::Mode renderMode = FrameTarget::COLOR;
+    bool quads = false, autoSprites = true;
+    bool mixedField = false;
+    bool compact = false;
+    Lifecycle lifecycle;
+    int capacity = 0;
+    const char* output = nullptr;
+    bool timings = false;
+    const char* timingLog = nullptr;
+    const char* tracePath = nullptr;
+    double stallMs = 100.0;
+    const char* stallTrace = nullptr;
+    const char* statsPath = nullptr;
+    int warmup = 10;
+    bool noAlloc = false;
+    const char* recordPath = nullptr;
+    const char* replayPath = nullptr;
+    const char* shaderCache = nullptr;
+    ProgramCache::Compile compile = ProgramCache::AUTO;
+    bool reportPrograms = false;
+    bool benchmark = false;
+    bool diagnose = false;
+    const char* statsAddress = nullptr;
+    int snapshotInterval = 0;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--offscreen") {
+            offscreen = true;
+        } else if (arg == "--size" && i + 1 < argc) {
+            if (std::sscanf(argv[++i], "%dx%d", &width, &height) != 2
+                    || width <= 0 || height <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--supersample" && i + 1 < argc) {
+            supersample = std::atoi(argv[++i]);
+            if (supersample < 1) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--particles" && i + 1 < argc) {
+            numParticles = std::atoi(argv[++i]);
+            if (numParticles < 1) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--field" && i + 1 < argc) {
+            std::string field = argv[++i];
+            if (field == "cursor" || field == "mixed") {
+                mixedField = field == "mixed";
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--storage" && i + 1 < argc) {
+            std::string kind = argv[++i];
+            if (kind == "full" || kind == "compact") {
+                compact = kind == "compact";
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--emitter" && i + 1 < argc) {
+            Emitter emitter;
+            if (!parseEmitter(argv[++i], &emitter)) {
+                usage(argv[0]);
+                return 1;
+            }
+            lifecycle.addEmitter(emitter);
+        } else if (arg == "--sink" && i + 1 < argc) {
+            Sink sink = { 0.0f, 0.0f, float(std::atof(argv[++i])) };
+            if (!(sink.radius > 0.0f) || !lifecycle.addSink(sink)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--capacity" && i + 1 < argc) {
+            capacity = std::atoi(argv[++i]);
+        } else if (arg == "--render" && i + 1 < argc) {
+            std::string mode = argv[++i];
+            if (mode == "points") {
+                renderMode = FrameTarget::COLOR;
+            } else if (mode == "density") {
+                renderMode = FrameTarget::DENSITY;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--sprites" && i + 1 < argc) {
+            std::string kind = argv[++i];
+            autoSprites = kind == "auto";
+            if (kind == "quads") {
+                quads = true;
+            } else if (kind != "points" && kind != "auto") {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--frames" && i + 1 < argc) {
+            frames = std::atoi(argv[++i]);
+        } else if (arg == "--output" && i + 1 < argc) {
+            output = argv[++i];
+        } else if (arg == "--record" && i + 1 < argc) {
+            recordPath = argv[++i];
+        } else if (arg == "--replay" && i + 1 < argc) {
+            replayPath = argv[++i];
+        } else if (arg == "--shader-cache" && i + 1 < argc) {
+            shaderCache = argv[++i];
+            reportPrograms = true;
+        } else if (arg == "--shader-compile" && i + 1 < argc) {
+            std::string mode = argv[++i];
+            if (mode == "auto")
+                compile = ProgramCache::AUTO;
+            else if (mode == "parallel")
+                compile = ProgramCache::PARALLEL;
+            else if (mode == "thread")
+                compile = ProgramCache::THREAD;
+            else if (mode == "serial")
+                compile = ProgramCache::SERIAL;
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+            reportPrograms = true;
+        } else if (arg == "--timings") {
+            timings = true;
+        } else if (arg == "--timing-log" && i + 1 < argc) {
+            timings = true;
+            timingLog = argv[++i];
+        } else if (arg == "--trace" && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (arg == "--stall-ms" && i + 1 < argc) {
+            stallMs = std::atof(argv[++i]);
+        } else if (arg == "--stall-trace" && i + 1 < argc) {
+            stallTrace = argv[++i];
+        } else if (arg == "--stats" && i + 1 < argc) {
+            statsPath = argv[++i];
+        } else if (arg == "--warmup" && i + 1 < argc) {
+            warmup = std::atoi(argv[++i]);
+        } else if (arg == "--no-alloc") {
+            noAlloc = true;
+        } else if (arg == "--bench-primitives") {
+            benchmark = true;
+        } else if (arg == "--diagnostics") {
+            diagnose = true;
+        } else if (arg == "--stats-server" && i + 1 < argc) {
+            statsAddress = argv[++i];
+        } else if (arg == "--snapshots" && i + 1 < argc) {
+            snapshotInterval = std::atoi(argv[++i]);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
 
-    // specify layout of vertex data for each vao
-    for (int i = 0; i < 2; i++) {
-        glBindVertexArray(vao[i]);
-        glBindBuffer(GL_ARRAY_BUFFER, vbo[i]);
+    if (capacity != 0 && capacity < numParticles) {
+        std::cerr << "--capacity has to be at least --particles" << std::endl;
+        return 1;
+    }
+    if (output && !offscreen) {
+        std::cerr << "--output needs --offscreen" << std::endl;
+        return 1;
+    }
 
-        GLint posAttrib = glGetAttribLocation(shaderProgram, "position");
-        glEnableVertexAttribArray(posAttrib);
-        glVertexAttribPointer(posAttrib, 2, GL_FLOAT, GL_FALSE,
-                4 * sizeof(float), 0);
+    std::vector<ReplayFrame> replay;
+    if (replayPath) {
+        if (!loadReplay(replayPath, replay)) {
+            std::cerr << "failed to read " << replayPath << std::endl;
+            return 1;
+        }
+        if (frames < 0)
+            frames = int(replay.size());
+    }
+    if (frames < 0)
+        frames = 600;
+    // a window can run for longer, and grows the recording past this
+    std::vector<ReplayFrame> recording;
+    if (recordPath)
+        recording.reserve(size_t(frames));
+
+    if (tracePath) {
+        trace::start();
+        TRACE_THREAD_NAME("main");
+    }
 
-        GLint velAttrib = glGetAttribLocation(shaderProgram, "velocity");
-        glEnableVertexAttribArray(velAttrib);
-        glVertexAttribPointer(velAttrib, 2, GL_FLOAT, GL_FALSE,
-                4 * sizeof(float), (void*) (2 * sizeof(float)));
+    uint64_t startTime = trace::now();
+    std::unique_ptr<Context> context = offscreen
+        ? createOffscreenContext(width, height, frames)
+        : createWindowContext(width, height, "Cursor Gravity");
+    if (!context)
+        return 1;
+
+    // random initial positions, with 0 velocity
+    std::vector<Particle> particles = randomParticles(numParticles);
+    ProgramCache programCache(shaderCache);
+    Context* mainContext = context.get();
+    compile = programCache.setCompile(compile, [mainContext] {
+        return mainContext->createSharedContext();
+    });
+
+    std::shared_ptr<SimulateProgram> simulateProgram;
+    std::vector<float> forceParams;
+    bool sinks = lifecycle.getNumSinks() > 0;
+    if (mixedField) {
+        simulateProgram = SimulateProgram::create<MixedField>(programCache, compact, sinks);
+        forceParams.resize(MixedField::numParams);
+        makeMixedField().getParams(&forceParams[0]);
+    } else {
+        simulateProgram = SimulateProgram::create<CursorField>(programCache, compact, sinks);
+        forceParams.resize(CursorField::numParams);
+        CursorField().getParams(&forceParams[0]);
+    }
+    ParticleSystem system(simulateProgram, &particles[0], particles.size(),
+            size_t(std::max(capacity, 0)));
+    // any frame's births, at most the capacity, without allocating
+    std::vector<Particle> births;
+    if (!lifecycle.isEmpty())
+        births.resize(system.getCapacity());
+
+    FrameTarget frameTarget(renderMode, supersample);
+
+    // points are the cheaper path where they are large enough; drivers
+    // may cap them at as little as 1 pixel
+    if (autoSprites) {
+        int winWidth, winHeight, fbWidth, fbHeight;
+        context->getWindowSize(&winWidth, &winHeight);
+        context->getFramebufferSize(&fbWidth, &fbHeight);
+        float pixelRatio = winWidth > 0 ? float(fbWidth) / winWidth : 1.0f;
+        GLfloat range[2];
+        glGetFloatv(GL_POINT_SIZE_RANGE, range);
+        quads = 5.0f * pixelRatio * frameTarget.getFactor() > range[1];
+    }
+    if (quads && !ParticleSystem::quadsSupported()) {
+        std::cerr << "instanced arrays unsupported, drawing points" << std::endl;
+        quads = false;
     }
 
-    GLint uniTime = glGetUniformLocation(shaderProgram, "dt");
-    GLint uniSource = glGetUniformLocation(shaderProgram, "source");
+    // the render program only draws, from the system's attributes
+    ProgramVariant renderVariant;
+    renderVariant.vertexSource = renderVertexHeader;
+    if (compact) {
+        renderVariant.vertexSource += packedGlsl;
+        renderVariant.flags.push_back("COMPACT");
+    }
+    renderVariant.vertexSource += renderVertexMain;
+    renderVariant.fragmentSource = fragmentSource;
+    renderVariant.attributes.push_back("position");
+    renderVariant.attributes.push_back("velocity");
+    if (renderMode == FrameTarget::DENSITY)
+        renderVariant.flags.push_back("DENSITY");
+    if (quads)
+        renderVariant.flags.push_back("QUADS");
+    programCache.request(renderVariant);
+
+    // a window shows frames while the programs build, and starts stepping
+    // and drawing the particles as each one is ready; offscreen waits for
+    // both so that the frames are the same every run
+    if (offscreen && (!simulateProgram->isValid() || !programCache.get(renderVariant)))
+        return 1;
+    if (benchmark)
+        return simulateProgram->isValid() && benchPrimitives(programCache, system) ? 0 : 1;
+    bool simulating = false;
+    GLuint renderProgram = 0;
+    GLint uniScale = -1, uniPointSize = -1, uniPixelScale = -1, uniSplatNorm = -1;
 
     glEnable(GL_PROGRAM_POINT_SIZE);
 
-    double prevTime = glfwGetTime();
-    int currVB = 0, currTFB = 1;
-    while (!glfwWindowShouldClose(window)) {
-        double frameTime = glfwGetTime();
+    std::unique_ptr<GpuTimer> gpuTimer;
+    FILE* timingFile = nullptr;
+    if (timings) {
+        gpuTimer.reset(new GpuTimer());
+        if (!gpuTimer->isSupported())
+            std::cerr << "timer queries unsupported, no timings" << std::endl;
+        if (timingLog && !(timingFile = std::fopen(timingLog, "a"))) {
+            std::cerr << "failed to open " << timingLog << std::endl;
+            return 1;
+        }
+    }
+    // the server's diagnostics are reduced whether or not they are printed
+    std::unique_ptr<StatsServer> statsServer;
+    std::vector<Particle> snapshotParticles;
+    if (statsAddress) {
+        if (!(statsServer = StatsServer::create(statsAddress, snapshotInterval)))
+            return 1;
+        if (snapshotInterval > 0)
+            snapshotParticles.resize(system.getCapacity());
+    }
+    std::unique_ptr<GpuDiagnostics> gpuDiagnostics;
+    if (diagnose || statsServer) {
+        gpuDiagnostics.reset(new GpuDiagnostics(programCache));
+        if (!gpuDiagnostics->isValid()) {
+            std::cerr << "compute shaders unsupported or failed to build, no diagnostics"
+                    << std::endl;
+            gpuDiagnostics.reset();
+        }
+    }
+    Diagnostics diagnostics;
+    bool diagnosed = false;
+    int diagnosedFrame = 0; // the step the diagnostics are of
+
+    double reportTime = context->getTime();
+    double diagnosticsTime = reportTime;
+    int frame = 0;
+
+    // wall clock frame times; simulation step times come from the GPU timer
+    FrameStats frameStats(stallMs, stallTrace);
+
+    // the warm-up starts once the programs are ready, which a window does
+    // not wait for
+    int readyFrame = -1, warmFrames = 0;
+    uint64_t warmAllocs = 0, warmBytes = 0, warmFrees = 0;
+
+    double prevTime = context->getTime();
+    while (!context->shouldClose() && !(replayPath && frame == int(replay.size()))) {
+        bool warm = readyFrame >= 0 && frame >= readyFrame + warmup;
+        if (warm && warmFrames++ == 0) {
+            warmAllocs = allocs::getCount();
+            warmBytes = allocs::getBytes();
+            warmFrees = allocs::getFrees();
+        }
+        allocs::Forbid forbid(noAlloc && warm);
+        TRACE_SCOPE("frame");
+        uint64_t frameStart = trace::now();
+        double frameTime = context->getTime();
         double dt = frameTime - prevTime;
-        glUniform1f(uniTime, dt);
+
+        // the window may have been resized or moved to another display
+        int winWidth, winHeight, fbWidth, fbHeight;
+        context->getWindowSize(&winWidth, &winHeight);
+        context->getFramebufferSize(&fbWidth, &fbHeight);
+        if (fbWidth == 0 || fbHeight == 0) {
+            // minimised, nothing to draw into
+            context->pollEvents();
+            prevTime = frameTime;
+            continue;
+        }
+        View view(fbWidth, fbHeight);
 
         // send cursor position to shader
         double x, y;
-        glfwGetCursorPos(window, &x, &y);
-        glUniform2f(uniSource, (x - 400.0)/400.0, (300.0 - y)/300.0);
-
-        glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-        glClear(GL_COLOR_BUFFER_BIT);
-
-        // bind vertex array object
-        glBindVertexArray(vao[currVB]);
-        // bind the other buffer to receive transform feedback
-        glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, vbo[currTFB]);
-
-        // draw vertices, wrapped in transform feedback
-        glBeginTransformFeedback(GL_POINTS);
-        glDrawArrays(GL_POINTS, 0, numVertices);
-        glEndTransformFeedback();
-
-        glfwSwapBuffers(window);
-        glfwPollEvents();
+        float sourceX, sourceY;
+        context->getCursorPos(&x, &y);
+        view.toWorld(x / winWidth, y / winHeight, &sourceX, &sourceY);
+
+        if (replayPath) {
+            dt = replay[frame].dt;
+            sourceX = replay[frame].sourceX;
+            sourceY = replay[frame].sourceY;
+        }
+        if (recordPath) {
+            allocs::Allow allowGrowth(recording.size() == recording.capacity());
+            ReplayFrame input = { float(dt), sourceX, sourceY };
+            recording.push_back(input);
+        }
+
+        if (!simulating && simulateProgram->isReady()) {
+            if (!simulateProgram->isValid())
+                return 1;
+            simulating = true;
+        }
+        if (!renderProgram && programCache.isReady(renderVariant)) {
+            if (!(renderProgram = programCache.get(renderVariant)))
+                return 1;
+            uniScale = glGetUniformLocation(renderProgram, "scale");
+            uniPointSize = glGetUniformLocation(renderProgram, "pointSize");
+            uniPixelScale = glGetUniformLocation(renderProgram, "pixelScale");
+            uniSplatNorm = glGetUniformLocation(renderProgram, "splatNorm");
+        }
+        if (reportPrograms && simulating && renderProgram) {
+            std::cerr << "programs: " << programCache.getCompiled() << " compiled";
+            if (shaderCache)
+                std::cerr << ", " << programCache.getLoaded() << " loaded from " << shaderCache;
+            std::cerr << ", " << ProgramCache::getName(compile) << ", ready after "
+                << (trace::now() - startTime) / 1e6 << " ms, "
+                << programCache.getBuildMs() << " ms of it waiting" << std::endl;
+            reportPrograms = false;
+        }
+        if (readyFrame < 0 && simulating && renderProgram)
+            readyFrame = frame;
+
+        // advance the particles into the other buffer, drawing nothing
+        if (gpuTimer)
+            gpuTimer->begin(GpuTimer::SIMULATE);
+
+        {
+            TRACE_SCOPE("simulate");
+            // the last frame's particles, reduced while this step goes on;
+            // with sinks, their count is known a frame late, so this is
+            // where it first is without waiting on the GPU
+            if (simulating && gpuDiagnostics) {
+                system.settle();
+                gpuDiagnostics->update(system);
+                if (gpuDiagnostics->getLatest(&diagnostics)) {
+                    diagnosed = true;
+                    diagnosedFrame = frame - 2;
+                }
+            }
+
+            // the cursor's x and y lead the parameters of either field
+            forceParams[0] = sourceX;
+            forceParams[1] = sourceY;
+            for (int i = 0; i < lifecycle.getNumSinks(); i++) {
+                lifecycle.getSink(i).x = sourceX;
+                lifecycle.getSink(i).y = sourceY;
+            }
+            simulateProgram->setSinks(lifecycle.getSinks(), lifecycle.getNumSinks());
+            if (simulating)
+                system.step(dt, &forceParams[0], int(forceParams.size()));
+
+            // births go in after the step's survivors, from the same
+            // generator as gravity-headless
+            if (simulating && !lifecycle.isEmpty()) {
+                size_t born = lifecycle.emit(float(dt), births.data(),
+                        system.getCapacity() - system.count());
+                system.emit(births.data(), born);
+            }
+        }
+
+        if (gpuTimer) {
+            gpuTimer->end();
+            gpuTimer->begin(GpuTimer::RENDER);
+        }
+
+        frameTarget.begin(context->getFramebuffer(), fbWidth, fbHeight);
+
+        // same size on screen at any pixel density
+        float pixelRatio = float(fbWidth) / winWidth;
+        float pointSize = 5.0f * pixelRatio;
+        if (renderMode == FrameTarget::DENSITY) {
+            // shrink splats to about two particle spacings as the count
+            // grows, which keeps large N smooth and cuts the fill cost; the
+            // live count, which births and deaths move
+            float live = float(std::max<size_t>(system.count(), 1));
+            float boxPixels = view.scaleX*fbWidth * view.scaleY*fbHeight;
+            float spacing = std::sqrt(boxPixels / live);
+            pointSize = std::min(std::max(2.0f*spacing, 1.0f), pointSize);
+            frameTarget.setExposure(live / boxPixels);
+        }
+        pointSize *= frameTarget.getFactor();
+        float splatRadius = 0.5f * pointSize;
+
+        if (renderProgram) {
+            TRACE_SCOPE("upload uniforms");
+            glUseProgram(renderProgram);
+            glUniform2f(uniScale, view.scaleX, view.scaleY);
+            glUniform1f(uniPointSize, pointSize);
+            glUniform2f(uniPixelScale, 2.0f / (fbWidth * frameTarget.getFactor()),
+                    2.0f / (fbHeight * frameTarget.getFactor()));
+            glUniform1f(uniSplatNorm,
+                    1.0f / std::max(0.5f * float(M_PI) * splatRadius*splatRadius, 1.0f));
+        }
+
+        {
+            TRACE_SCOPE("draw");
+
+            glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+            glClear(GL_COLOR_BUFFER_BIT);
+
+            // draw the updated particles
+            if (renderProgram && quads)
+                system.renderQuads();
+            else if (renderProgram)
+                system.render();
+        }
+
+        frameTarget.end();
+
+        if (gpuTimer && gpuTimer->isSupported()) {
+            TRACE_SCOPE("overlay");
+
+            // mean as the bar, p99 as the tick, against a 60 Hz frame
+            OverlayBar bars[GpuTimer::NUM_PHASES];
+            const float colors[GpuTimer::NUM_PHASES][3] = {
+                { 0.2f, 0.6f, 1.0f }, { 1.0f, 0.6f, 0.2f }, { 0.4f, 0.9f, 0.3f }
+            };
+            for (int i = 0; i < GpuTimer::NUM_PHASES; i++) {
+                const RollingStats& stats = gpuTimer->getStats(GpuTimer::Phase(i));
+                OverlayBar bar = { float(stats.mean()), float(stats.percentile(0.99)),
+                    colors[i][0], colors[i][1], colors[i][2] };
+                bars[i] = bar;
+            }
+            drawOverlay(bars, GpuTimer::NUM_PHASES, 1000.0f / 60.0f,
+                    fbWidth, pixelRatio);
+        }
+
+        if (gpuTimer) {
+            gpuTimer->end();
+            gpuTimer->begin(GpuTimer::PRESENT);
+        }
+
+        {
+            TRACE_SCOPE("swap");
+            context->swapBuffers();
+        }
+
+        double stepMs = -1.0; // of an earlier frame, if the GPU timer has one
+        if (gpuTimer) {
+            gpuTimer->end();
+            gpuTimer->endFrame();
+
+            double latestMs;
+            if (gpuTimer->getLatest(GpuTimer::SIMULATE, &latestMs)) {
+                frameStats.step(uint64_t(latestMs * 1e6));
+                stepMs = latestMs;
+            }
+        }
+
+        {
+            TRACE_SCOPE("poll events");
+            context->pollEvents();
+        }
+        frame++;
+
+        if (gpuTimer && frameTime - reportTime >= 1.0) {
+            TRACE_SCOPE("report timings");
+            reportTimings(*gpuTimer, *context, timingFile, frame);
+            reportTime = frameTime;
+        }
+
+        if (diagnose && diagnosed && frameTime - diagnosticsTime >= 1.0) {
+            printDiagnostics(stdout, diagnostics);
+            diagnosticsTime = frameTime;
+        }
+
+        // frame has already moved past the one just drawn
+        if (statsServer && simulating && statsServer->wantsSnapshot(frame - 1)) {
+            TRACE_SCOPE("snapshot");
+            system.readback(snapshotParticles.data());
+            statsServer->publishSnapshot(frame - 1, snapshotParticles.data(), system.count());
+        }
+
+        uint64_t frameEnd = trace::now();
+        frameStats.frame(frameStart, frameEnd);
+
+        if (statsServer) {
+            FrameReport report;
+            report.frame = frame - 1;
+            report.frameMs = (frameEnd - frameStart) / 1e6;
+            report.stepMs = stepMs;
+            report.particles = system.count();
+            if (diagnosed)
+                report.diagnostics = diagnostics;
+            report.diagnosticsFrame = diagnosedFrame;
+            statsServer->publish(report);
+        }
 
         prevTime = frameTime;
+    }
+    uint64_t loopAllocs = allocs::getCount() - warmAllocs;
+    uint64_t loopBytes = allocs::getBytes() - warmBytes;
+    uint64_t loopFrees = allocs::getFrees() - warmFrees;
+
+    if (output) {
+        TRACE_SCOPE("write image");
+        if (!saveFramebuffer(output, width, height)) {
+            std::cerr << "failed to write " << output << std::endl;
+            return 1;
+        }
+    }
 
-        // swap vertex buffers
-        currVB = currTFB;
-        currTFB = currTFB ^ 1;
+    if (recordPath && !saveReplay(recordPath, recording)) {
+        std::cerr << "failed to write " << recordPath << std::endl;
+        return 1;
     }
 
-    // cleanup and terminate
-    glDeleteProgram(shaderProgram);
-    glDeleteShader(vertexShader);
-    glDeleteShader(fragmentShader);
+    if (tracePath && !trace::writeChromeTrace(tracePath)) {
+        std::cerr << "failed to write " << tracePath << std::endl;
+        return 1;
+    }
+
+    frameStats.print(stdout);
+    if (warmFrames > 0)
+        std::printf("allocs %8.1f /frame %8.1f KB/frame %8.1f frees/frame"
+                " after %d frames of warm-up\n",
+                double(loopAllocs) / warmFrames, loopBytes / 1024.0 / warmFrames,
+                double(loopFrees) / warmFrames, warmup);
+    if (diagnose && diagnosed)
+        printDiagnostics(stdout, diagnostics);
+    if (diagnose && gpuDiagnostics && gpuDiagnostics->getDropped() > 0)
+        std::printf("%d diagnostics dropped, not ready in time\n", gpuDiagnostics->getDropped());
+    if (statsServer)
+        std::printf("stats server: %llu clients, %llu lines dropped\n",
+                (unsigned long long) statsServer->getClients(),
+                (unsigned long long) statsServer->getDropped());
+    if (statsPath && !frameStats.writeJson(statsPath)) {
+        std::cerr << "failed to write " << statsPath << std::endl;
+        return 1;
+    }
 
-    glDeleteVertexArrays(2, vao);
-    glDeleteBuffers(2, vbo);
+    if (timingFile)
+        std::fclose(timingFile);
 
-    glfwTerminate();
     return 0;
 }
@@ -0,0 +1,702 @@
+// Runs the simulation and renders density images on the CPU only, for
+// machines without a GPU or display.
+
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#include "allocs.h"
+#include "diagnostics.h"
+#include "domain.h"
+#include "forces.h"
+#include "framestats.h"
+#include "image.h"
+#include "lifecycle.h"
+#include "numa.h"
+#include "packed.h"
+#include "particles.h"
+#include "perfcounters.h"
+#include "raster.h"
+#include "replay.h"
+#include "simulate.h"
+#include "statsserver.h"
+#include "threadpool.h"
+#include "trace.h"
+#include "transport.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static double secondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// frames between checks of how evenly the ranks are loaded
+static const int rebalanceInterval = 10;
+
+static void onChildExit(int)
+{
+    int status;
+    while (waitpid(-1, &status, WNOHANG) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            const char message[] = "a rank failed\n";
+            ssize_t written = write(2, message, sizeof(message) - 1);
+            (void) written;
+            _exit(1);
+        }
+    }
+}
+
+// fork ranks 1 to ranks - 1 of a distributed run, returning the rank of
+// the calling process, or -1 if forking failed. The others exit if rank 0
+// does, and rank 0 exits if any other one fails, so that nobody waits for
+// a rank that is gone.
+static int forkRanks(int ranks)
+{
+    pid_t parent = getpid();
+    for (int rank = 1; rank < ranks; rank++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            std::cerr << "failed to fork rank " << rank << std::endl;
+            return -1;
+        }
+        if (pid == 0) {
+#ifdef __linux__
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+            if (getppid() != parent)
+                _exit(1);
+            return rank;
+        }
+    }
+    std::signal(SIGCHLD, onChildExit);
+    return 0;
+}
+
+// the remaining ranks, once they are done with the run
+static bool waitRanks()
+{
+    std::signal(SIGCHLD, SIG_DFL);
+    bool ok = true;
+    int status;
+    // any already reaped by onChildExit succeeded
+    while (wait(&status) > 0)
+        ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    return ok;
+}
+
+// the live ones of whichever of the two holds the particles, working out
+// their diagnostics in the same pass if asked to; each thread starts on the
+// share of the whole allocation that it placed, not of the live ones
+template <typename Field>
+static void stepAll(ThreadPool& pool, const Field& field, ParticleVector& particles,
+        PackedVector& packed, size_t live, float dt, Diagnostics* diagnostics)
+{
+    if (diagnostics) {
+        diagnostics->clear();
+        if (!packed.empty())
+            stepParticles(pool, field, packed.data(), live, packed.capacity(), dt,
+                    diagnostics);
+        else
+            stepParticles(pool, field, particles.data(), live, particles.capacity(), dt,
+                    diagnostics);
+    } else if (!packed.empty()) {
+        stepParticles(pool, field, packed.data(), live, packed.capacity(), dt);
+    } else {
+        stepParticles(pool, field, particles.data(), live, particles.capacity(), dt);
+    }
+}
+
+// cull the dead into spare and swap it in, then add births in the room
+// after the live ones; returns how many are live
+template <typename Vector>
+static size_t updateLifecycle(ThreadPool& pool, Lifecycle& lifecycle, Vector& particles,
+        Vector& spare, size_t live, float dt)
+{
+    if (lifecycle.getNumSinks() > 0) {
+        live = lifecycle.cull(pool, particles.data(), live, spare.data());
+        particles.swap(spare);
+    }
+    return live + lifecycle.emit(dt, particles.data() + live, particles.size() - live);
+}
+
+static void usage(const char* name)
+{
+    std::cerr << "usage: " << name << " [options]\n"
+        "  --size WxH         image size (default 800x600)\n"
+        "  --particles N      number of particles (default 1000000)\n"
+        "  --frames N         frames to simulate (default 600, or the replay length)\n"
+        "  --replay FILE      take each step's dt and source from a recorded replay,\n"
+        "                     looping it if there are more frames\n"
+        "  --field NAME       cursor, or mixed to add masses, a spring, a vortex and drag\n"
+        "  --threads N        worker threads, 0 for one per core (default 0)\n"
+        "  --pin              keep each thread on one CPU, node by node\n"
+        "  --storage KIND     full floats, or compact 8-byte particles (default full)\n"
+        "  --emitter X,Y,RATE add RATE particles a second at X,Y (repeatable)\n"
+        "  --sink R           remove particles that come within R of the source\n"
+        "  --capacity N       most particles alive at once, at least --particles\n"
+        "                     (the default)\n"
+        "  --numa PLACEMENT   where the particles live: first-touch on the node of\n"
+        "                     the thread stepping them, interleave over all nodes,\n"
+        "                     or heap (default first-touch)\n"
+        "  --ranks N          split the box into N strips, each simulated by its\n"
+        "                     own process (default 1)\n"
+        "  --transport KIND   shm or tcp (loopback) between the ranks (default shm)\n"
+        "  --port P           first TCP port, rank r listens on P + r (default 47000)\n"
+        "  --rebalance T      move the strip edges when the busiest rank has more\n"
+        "                     than T times the mean particles (default 1.25)\n"
+        "  --trace FILE.json  record a Chrome trace of the run\n"
+        "  --stall-ms T       frames longer than T ms count as stalls (default 100)\n"
+        "  --stall-trace PRE  dump a trace around each stall to PRE<n>.json\n"
+        "  --stats FILE.json  write frame and step time percentiles on exit\n"
+        "  --warmup N         frames before the frame loop should stop allocating\n"
+        "                     (default 10, which takes in the first rebalance)\n"
+        "  --no-alloc         abort on any allocation in a frame after the warm-up\n"
+        "  --diagnostics      work out the energy, momentum and bounding box of the\n"
+        "                     particles as they are stepped, and print the last\n"
+        "  --stats-server A   stream each frame's times, particle count and\n"
+        "                     diagnostics as JSON lines to the clients of A,\n"
+        "                     unix:PATH or a loopback TCP port\n"
+        "  --snapshots N      with --stats-server, also stream the positions of up\n"
+        "                     to 4096 particles every N frames\n"
+        "  --perf             count cycles, instructions and cache misses per stage\n"
+        "  --perf-log FILE    write the counts of every step as CSV\n"
+        "  --output FILE.ppm  save the last frame; a printf pattern such as\n"
+        "                     frame%04d.ppm saves every frame\n";
+}
+
+int main(int argc, char** argv)
+{
+    int width = 800, height = 600;
+    long long numParticles = 1000000;
+    int frames = -1; // unset
+    int threads = 0;
+    std::string output;
+    const char* tracePath = nullptr;
+    double stallMs = 100.0;
+    const char* stallTrace = nullptr;
+    const char* statsPath = nullptr;
+    bool perf = false;
+    const char* perfLog = nullptr;
+    const char* replayPath = nullptr;
+    bool mixed = false;
+    int ranks = 1;
+    bool tcp = false;
+    int port = 47000;
+    float rebalance = 1.25f;
+    bool pin = false;
+    bool compact = false;
+    Lifecycle lifecycle;
+    long long capacity = 0;
+    int warmup = rebalanceInterval;
+    bool noAlloc = false;
+    bool diagnose = false;
+    const char* statsAddress = nullptr;
+    int snapshotInterval = 0;
+    NumaPlacement placement = NUMA_FIRST_TOUCH;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--size" && i + 1 < argc) {
+            if (std::sscanf(argv[++i], "%dx%d", &width, &height) != 2
+                    || width <= 0 || height <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--particles" && i + 1 < argc) {
+            numParticles = std::atoll(argv[++i]);
+        } else if (arg == "--frames" && i + 1 < argc) {
+            frames = std::atoi(argv[++i]);
+        } else if (arg == "--replay" && i + 1 < argc) {
+            replayPath = argv[++i];
+        } else if (arg == "--field" && i + 1 < argc) {
+            std::string field = argv[++i];
+            if (field == "cursor" || field == "mixed") {
+                mixed = field == "mixed";
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--threads" && i + 1 < argc) {
+            threads = std::atoi(argv[++i]);
+        } else if (arg == "--pin") {
+            pin = true;
+        } else if (arg == "--storage" && i + 1 < argc) {
+            std::string kind = argv[++i];
+            if (kind == "full" || kind == "compact") {
+                compact = kind == "compact";
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--emitter" && i + 1 < argc) {
+            Emitter emitter;
+            if (!parseEmitter(argv[++i], &emitter)) {
+                usage(argv[0]);
+                return 1;
+            }
+            lifecycle.addEmitter(emitter);
+        } else if (arg == "--sink" && i + 1 < argc) {
+            Sink sink = { 0.0f, 0.0f, float(std::atof(argv[++i])) };
+            if (!(sink.radius > 0.0f) || !lifecycle.addSink(sink)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--capacity" && i + 1 < argc) {
+            capacity = std::atoll(argv[++i]);
+        } else if (arg == "--numa" && i + 1 < argc) {
+            if (!parseNumaPlacement(argv[++i], &placement)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--ranks" && i + 1 < argc) {
+            ranks = std::atoi(argv[++i]);
+        } else if (arg == "--transport" && i + 1 < argc) {
+            std::string kind = argv[++i];
+            if (kind == "shm" || kind == "tcp") {
+                tcp = kind == "tcp";
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--port" && i + 1 < argc) {
+            port = std::atoi(argv[++i]);
+        } else if (arg == "--rebalance" && i + 1 < argc) {
+            rebalance = float(std::atof(argv[++i]));
+        } else if (arg == "--output" && i + 1 < argc) {
+            output = argv[++i];
+        } else if (arg == "--trace" && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (arg == "--stall-ms" && i + 1 < argc) {
+            stallMs = std::atof(argv[++i]);
+        } else if (arg == "--stall-trace" && i + 1 < argc) {
+            stallTrace = argv[++i];
+        } else if (arg == "--stats" && i + 1 < argc) {
+            statsPath = argv[++i];
+        } else if (arg == "--warmup" && i + 1 < argc) {
+            warmup = std::atoi(argv[++i]);
+        } else if (arg == "--no-alloc") {
+            noAlloc = true;
+        } else if (arg == "--diagnostics") {
+            diagnose = true;
+        } else if (arg == "--stats-server" && i + 1 < argc) {
+            statsAddress = argv[++i];
+        } else if (arg == "--snapshots" && i + 1 < argc) {
+            snapshotInterval = std::atoi(argv[++i]);
+        } else if (arg == "--perf") {
+            perf = true;
+        } else if (arg == "--perf-log" && i + 1 < argc) {
+            perf = true;
+            perfLog = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // without a replay, the same fixed step and centred source as the
+    // offscreen GL context
+    std::vector<ReplayFrame> replay(1);
+    replay[0].dt = 1.0f / 60.0f;
+    replay[0].sourceX = replay[0].sourceY = 0.0f;
+    if (replayPath) {
+        if (!loadReplay(replayPath, replay)) {
+            std::cerr << "failed to read " << replayPath << std::endl;
+            return 1;
+        }
+        if (frames < 0)
+            frames = int(replay.size());
+    }
+    if (frames < 0)
+        frames = 600;
+
+    if (numParticles < 1 || frames < 1 || ranks < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (compact && ranks > 1) {
+        std::cerr << "the ranks exchange full particles, --storage compact needs --ranks 1"
+                << std::endl;
+        return 1;
+    }
+    if (capacity != 0 && capacity < numParticles) {
+        std::cerr << "--capacity has to be at least --particles" << std::endl;
+        return 1;
+    }
+    if (!lifecycle.isEmpty() && ranks > 1) {
+        std::cerr << "emitters and sinks need --ranks 1" << std::endl;
+        return 1;
+    }
+    if (statsAddress && ranks > 1) {
+        std::cerr << "--stats-server needs --ranks 1" << std::endl;
+        return 1;
+    }
+
+    // the ranks are forked before any thread starts; the shared memory
+    // goes to all of them
+    std::unique_ptr<ShmTransport> shmTransport;
+    std::unique_ptr<TcpTransport> tcpTransport;
+    if (ranks > 1 && !tcp && !(shmTransport = ShmTransport::create(ranks)))
+        return 1;
+    int rank = forkRanks(ranks);
+    if (rank < 0)
+        return 1;
+    Transport* transport = nullptr;
+    if (shmTransport) {
+        shmTransport->setRank(rank);
+        transport = shmTransport.get();
+    } else if (ranks > 1) {
+        if (!(tcpTransport = TcpTransport::connect(rank, ranks, port)))
+            return 1;
+        transport = tcpTransport.get();
+    }
+    std::unique_ptr<Domain> domain;
+    if (transport)
+        domain.reset(new Domain(*transport));
+
+    // rank 0 reports for all of them
+    if (rank > 0) {
+        tracePath = stallTrace = statsPath = perfLog = nullptr;
+        perf = false;
+    }
+
+    if (tracePath) {
+        trace::start();
+        TRACE_THREAD_NAME("main");
+    }
+
+    // ranks on the same machine share its cores; pinned, each gets its
+    // own run of them, which the pool then pins its threads within
+    if (threads <= 0 && ranks > 1)
+        threads = std::max(1, int(std::thread::hardware_concurrency()) / ranks);
+    if (pin && ranks > 1) {
+        std::vector<int> cpus = numaCpus();
+        std::vector<int> mine(cpus.begin() + cpus.size() * rank / ranks,
+                cpus.begin() + cpus.size() * (rank + 1) / ranks);
+        if (!mine.empty() && !pinThread(mine))
+            std::cerr << "failed to pin rank " << rank << std::endl;
+    }
+    ThreadPool pool(threads, pin);
+
+    // each rank makes its share with its own seed, then hands them to
+    // their owners; one rank makes the same particles as ever
+    size_t count = size_t(numParticles / ranks) + (rank < numParticles % ranks);
+    ParticleVector particles(NumaAllocator<Particle>(pool, placement));
+    if (domain) {
+        // migrating can bring a rank any of the particles
+        particles.reserve(size_t(numParticles));
+        domain->reserve(size_t(numParticles));
+    }
+    {
+        std::vector<Particle> made = randomParticles(count, 1 + rank);
+        particles.assign(made.begin(), made.end());
+    }
+    if (domain && !domain->migrate(particles))
+        return 1;
+
+    // the live particles lead the array, with room for births after them
+    // and a second array to cull into
+    size_t live = particles.size();
+    size_t room = std::max(live, size_t(capacity));
+    bool sinks = lifecycle.getNumSinks() > 0;
+    ParticleVector spare(NumaAllocator<Particle>(pool, placement));
+    PackedVector packed(NumaAllocator<PackedParticle>(pool, placement));
+    PackedVector packedSpare(NumaAllocator<PackedParticle>(pool, placement));
+    if (compact) {
+        packed.resize(lifecycle.isEmpty() ? live : room);
+        for (size_t i = 0; i < live; i++)
+            packed[i] = packParticle(particles[i]);
+        particles.clear();
+        particles.shrink_to_fit();
+        if (sinks)
+            packedSpare.resize(room);
+    } else if (!lifecycle.isEmpty()) {
+        particles.resize(room);
+        if (sinks)
+            spare.resize(room);
+    }
+    SoftRasterizer rasterizer(pool, width, height);
+    // the most any frame can see: births fill the room, a rank can come to
+    // hold any of the particles, and rank 0 tone maps all of them
+    rasterizer.reserve(std::max(room, size_t(numParticles)));
+    lifecycle.reserve(pool);
+    std::vector<unsigned char> image(3 * size_t(width) * height);
+
+    bool everyFrame = output.find('%') != std::string::npos;
+
+    CursorField cursorField;
+    MixedField mixedField = makeMixedField();
+
+    FrameStats frameStats(stallMs, stallTrace);
+
+    // the server's diagnostics are worked out whether or not they are printed
+    std::unique_ptr<StatsServer> statsServer;
+    if (statsAddress && !(statsServer = StatsServer::create(statsAddress, snapshotInterval)))
+        return 1;
+
+    std::unique_ptr<PerfCounters> counters;
+    FILE* perfFile = nullptr;
+    PerfCounters::Stage renderTotal("render"), stepTotal("step");
+    if (perf) {
+        counters.reset(new PerfCounters(pool.getThreadIds()));
+        if (!counters->isAvailable())
+            std::cerr << "perf_event_open failed, no counters" << std::endl;
+        if (perfLog) {
+            if (!(perfFile = std::fopen(perfLog, "w"))) {
+                std::cerr << "failed to open " << perfLog << std::endl;
+                return 1;
+            }
+            PerfCounters::printCsvHeader(perfFile);
+        }
+    }
+
+    // gathering the images, kept between frames
+    Transport::Buffer gatherData;
+    std::vector<Transport::Buffer> images;
+
+    double stepTime = 0.0, renderTime = 0.0, exchangeTime = 0.0, lifecycleTime = 0.0;
+    Diagnostics diagnostics; // of the last step
+    Diagnostics* stepDiagnostics = diagnose || statsServer ? &diagnostics : nullptr;
+    double processed = 0.0; // particle frames on this rank
+    int rebalances = 0;
+    uint64_t warmAllocs = 0, warmBytes = 0, warmFrees = 0;
+    for (int frame = 0; frame < frames; frame++) {
+        if (frame == warmup) {
+            warmAllocs = allocs::getCount();
+            warmBytes = allocs::getBytes();
+            warmFrees = allocs::getFrees();
+        }
+        allocs::Forbid forbid(noAlloc && frame >= warmup);
+        TRACE_SCOPE("frame");
+        uint64_t frameStart = trace::now();
+
+        PerfCounters::Stage renderStage("render"), stepStage("step");
+        const ReplayFrame& input = replay[frame % replay.size()];
+
+        // like the GL path, draw the positions this step starts from
+        Clock::time_point start = Clock::now();
+        size_t rendered = live;
+        processed += rendered;
+        {
+            TRACE_SCOPE("render");
+            if (counters)
+                counters->begin();
+            if (compact)
+                rasterizer.render(packed.data(), live, packed.capacity());
+            else
+                rasterizer.render(particles.data(), live, particles.capacity());
+            if (counters)
+                counters->end(renderStage, rendered);
+        }
+        renderTime += secondsSince(start);
+
+        start = Clock::now();
+        {
+            TRACE_SCOPE("step");
+            if (counters)
+                counters->begin();
+            if (mixed) {
+                mixedField.get<0>().x = input.sourceX;
+                mixedField.get<0>().y = input.sourceY;
+                stepAll(pool, mixedField, particles, packed, live, input.dt,
+                        stepDiagnostics);
+            } else {
+                cursorField.get<0>().x = input.sourceX;
+                cursorField.get<0>().y = input.sourceY;
+                stepAll(pool, cursorField, particles, packed, live, input.dt,
+                        stepDiagnostics);
+            }
+            if (counters)
+                counters->end(stepStage, rendered);
+        }
+        double seconds = secondsSince(start);
+        stepTime += seconds;
+        frameStats.step(uint64_t(seconds * 1e9));
+
+        if (!lifecycle.isEmpty()) {
+            TRACE_SCOPE("lifecycle");
+            start = Clock::now();
+            for (int i = 0; i < lifecycle.getNumSinks(); i++) {
+                lifecycle.getSink(i).x = input.sourceX;
+                lifecycle.getSink(i).y = input.sourceY;
+            }
+            if (compact)
+                live = updateLifecycle(pool, lifecycle, packed, packedSpare, live, input.dt);
+            else
+                live = updateLifecycle(pool, lifecycle, particles, spare, live, input.dt);
+            lifecycleTime += secondsSince(start);
+        }
+
+        if (domain) {
+            TRACE_SCOPE("exchange");
+            start = Clock::now();
+            bool moved = false;
+            bool ok = domain->migrate(particles);
+            if (ok && frame % rebalanceInterval == rebalanceInterval - 1)
+                ok = domain->rebalance(particles, rebalance, &moved);
+            if (!ok) {
+                std::cerr << "rank " << rank << " lost the other ranks" << std::endl;
+                return 1;
+            }
+            rebalances += moved;
+            live = particles.size();
+            exchangeTime += secondsSince(start);
+        }
+
+        if (counters) {
+            renderTotal.add(renderStage);
+            stepTotal.add(stepStage);
+            if (perfFile) {
+                counters->printCsv(perfFile, frame, renderStage);
+                counters->printCsv(perfFile, frame, stepStage);
+            }
+        }
+
+        // a single image at the end is the first to be gathered and tone
+        // mapped, which no frame of the warm-up did
+        allocs::Allow allowImage(!output.empty() && !everyFrame && frame == frames - 1);
+
+        if (domain && !output.empty() && (everyFrame || frame == frames - 1)) {
+            TRACE_SCOPE("gather density");
+            // the particle count, then the image
+            const std::vector<uint32_t>& density = rasterizer.getDensity();
+            uint64_t count = rendered;
+            gatherData.resize(sizeof(count) + density.size() * sizeof(uint32_t));
+            std::memcpy(&gatherData[0], &count, sizeof(count));
+            std::memcpy(&gatherData[sizeof(count)], density.data(),
+                    density.size() * sizeof(uint32_t));
+            if (!transport->gather(gatherData, images)) {
+                std::cerr << "rank " << rank << " lost the other ranks" << std::endl;
+                return 1;
+            }
+            for (size_t r = 1; rank == 0 && r < images.size(); r++) {
+                std::memcpy(&count, images[r].data(), sizeof(count));
+                rasterizer.accumulate((const uint32_t*) &images[r][sizeof(count)], count);
+            }
+        }
+
+        if (!output.empty() && (everyFrame || frame == frames - 1) && rank == 0) {
+            TRACE_SCOPE("write image");
+            char path[4096];
+            std::snprintf(path, sizeof(path), output.c_str(), frame);
+            rasterizer.tonemap(&image[0]);
+            if (!writePPM(path, width, height, &image[0])) {
+                std::cerr << "failed to write " << path << std::endl;
+                return 1;
+            }
+        }
+
+        if (statsServer && statsServer->wantsSnapshot(frame)) {
+            TRACE_SCOPE("snapshot");
+            if (compact)
+                statsServer->publishSnapshot(frame, packed.data(), live);
+            else
+                statsServer->publishSnapshot(frame, particles.data(), live);
+        }
+
+        uint64_t frameEnd = trace::now();
+        frameStats.frame(frameStart, frameEnd);
+
+        if (statsServer) {
+            FrameReport report;
+            report.frame = frame;
+            report.frameMs = (frameEnd - frameStart) / 1e6;
+            report.stepMs = 1e3 * seconds;
+            report.particles = live;
+            report.diagnostics = diagnostics;
+            report.diagnosticsFrame = frame;
+            statsServer->publish(report);
+        }
+    }
+    uint64_t loopAllocs = allocs::getCount() - warmAllocs;
+    uint64_t loopBytes = allocs::getBytes() - warmBytes;
+    uint64_t loopFrees = allocs::getFrees() - warmFrees;
+
+    if (domain && !domain->count(particles))
+        return 1;
+
+    // every rank's strip, for rank 0 to print
+    if (domain && diagnose) {
+        gatherData.resize(sizeof(Diagnostics));
+        std::memcpy(&gatherData[0], &diagnostics, sizeof(Diagnostics));
+        if (!transport->gather(gatherData, images)) {
+            std::cerr << "rank " << rank << " lost the other ranks" << std::endl;
+            return 1;
+        }
+        for (size_t r = 1; rank == 0 && r < images.size(); r++) {
+            Diagnostics other;
+            std::memcpy(&other, images[r].data(), sizeof(Diagnostics));
+            diagnostics.merge(other);
+        }
+    }
+    if (rank > 0)
+        return 0;
+
+    if (tracePath && !trace::writeChromeTrace(tracePath)) {
+        std::cerr << "failed to write " << tracePath << std::endl;
+        return 1;
+    }
+
+    std::printf("%lld %s particles, %d frames, %d threads, %s memory\n",
+            numParticles, compact ? "compact" : "full", frames, pool.size(),
+            numaPlacementName(placement));
+    if (domain) {
+        std::printf("%d ranks over %s, %d rebalances, now", ranks, tcp ? "tcp" : "shm",
+                rebalances);
+        for (int r = 0; r < ranks; r++)
+            std::printf(" %zu", domain->getCounts()[r]);
+        std::printf(" particles, %.2f x the mean at most\n", domain->getImbalance());
+        std::printf("exchange %6.3f ms/frame, rank 0's own times below\n",
+                1e3 * exchangeTime / frames);
+    }
+    std::printf("step   %8.3f ms/frame %8.1f Mparticles/s\n",
+            1e3 * stepTime / frames, 1e-6 * processed / stepTime);
+    std::printf("render %8.3f ms/frame %8.1f Mparticles/s\n",
+            1e3 * renderTime / frames, 1e-6 * processed / renderTime);
+    if (!lifecycle.isEmpty())
+        std::printf("births and deaths %6.3f ms/frame, %llu born, %llu died, %zu of %zu alive\n",
+                1e3 * lifecycleTime / frames, (unsigned long long) lifecycle.getBorn(),
+                (unsigned long long) lifecycle.getDied(), live, room);
+    if (diagnose)
+        printDiagnostics(stdout, diagnostics);
+    if (statsServer)
+        std::printf("stats server: %llu clients, %llu lines dropped\n",
+                (unsigned long long) statsServer->getClients(),
+                (unsigned long long) statsServer->getDropped());
+    if (frames > warmup)
+        std::printf("allocs %8.1f /frame %8.1f KB/frame %8.1f frees/frame"
+                " after %d frames of warm-up\n",
+                double(loopAllocs) / (frames - warmup),
+                loopBytes / 1024.0 / (frames - warmup),
+                double(loopFrees) / (frames - warmup), warmup);
+    frameStats.print(stdout);
+
+    if (counters && counters->isAvailable()) {
+        PerfCounters::printHeader(stdout);
+        counters->print(stdout, renderTotal);
+        counters->print(stdout, stepTotal);
+    }
+    if (perfFile)
+        std::fclose(perfFile);
+
+    if (statsPath && !frameStats.writeJson(statsPath)) {
+        std::cerr << "failed to write " << statsPath << std::endl;
+        return 1;
+    }
+    if (ranks > 1 && !waitRanks())
+        return 1;
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include "histogram.h"
+
+#include <algorithm>
+
+const int Histogram::subBits;
+const int Histogram::maxBits;
+
+static int highestBit(uint64_t value)
+{
+    int bit = 0;
+    while (value >>= 1)
+        bit++;
+    return bit;
+}
+
+Histogram::Histogram()
+    : counts((maxBits - subBits + 2) << subBits),
+      total(0), sum(0), minValue(UINT64_MAX), maxValue(0)
+{
+}
+
+int Histogram::bucketOf(uint64_t value)
+{
+    const uint64_t subCount = uint64_t(1) << subBits;
+
+    // exact below two sub counts, then subCount buckets per power of two
+    if (value < 2 * subCount)
+        return int(value);
+    int shift = std::min(highestBit(value), maxBits) - subBits;
+    uint64_t sub = std::min(value >> shift, 2 * subCount - 1) - subCount;
+    return int(((shift + 1) << subBits) + sub);
+}
+
+uint64_t Histogram::lowestOf(int bucket)
+{
+    const int subCount = 1 << subBits;
+    if (bucket < 2 * subCount)
+        return uint64_t(bucket);
+    int shift = (bucket >> subBits) - 1;
+    return uint64_t((bucket & (subCount - 1)) + subCount) << shift;
+}
+
+void Histogram::record(uint64_t nanoseconds)
+{
+    counts[bucketOf(nanoseconds)]++;
+    total++;
+    sum += nanoseconds;
+    minValue = std::min(minValue, nanoseconds);
+    maxValue = std::max(maxValue, nanoseconds);
+}
+
+uint64_t Histogram::percentile(double p) const
+{
+    if (!total)
+        return 0;
+
+    uint64_t rank = std::min(uint64_t(p * total), total - 1);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); i++) {
+        seen += counts[i];
+        if (seen > rank) {
+            uint64_t low = lowestOf(int(i)), high = lowestOf(int(i) + 1);
+            return std::min(std::max((low + high) / 2, min()), max());
+        }
+    }
+    return max();
+}
+
+void Histogram::writeJson(FILE* file) const
+{
+    std::fprintf(file, "{\"count\":%llu,\"min\":%.4f,\"mean\":%.4f,\"p50\":%.4f,"
+            "\"p90\":%.4f,\"p99\":%.4f,\"p999\":%.4f,\"max\":%.4f}",
+            (unsigned long long) count(), min() * 1e-6, mean() * 1e-6,
+            percentile(0.5) * 1e-6, percentile(0.9) * 1e-6,
+            percentile(0.99) * 1e-6, percentile(0.999) * 1e-6, max() * 1e-6);
+}
@@ -0,0 +1,41 @@
+#ifndef GRAVITY_HISTOGRAM_H
+#define GRAVITY_HISTOGRAM_H
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+// Histogram of durations in nanoseconds with log spaced buckets, in the
+// style of HdrHistogram: every power of two is split into 128 linear
+// buckets, so any value is reported to within 1% from 1 ns up to about 18
+// minutes, in a fixed 35 KB. Recording is a few shifts and an increment.
+class Histogram {
+public:
+    Histogram();
+
+    void record(uint64_t nanoseconds);
+
+    uint64_t count() const { return total; }
+    uint64_t min() const { return total ? minValue : 0; }
+    uint64_t max() const { return maxValue; }
+    double mean() const { return total ? double(sum) / total : 0.0; }
+
+    // p in [0,1]; the midpoint of the bucket holding that rank
+    uint64_t percentile(double p) const;
+
+    // {"count":..,"mean":..,"p50":..} in milliseconds, no trailing newline
+    void writeJson(FILE* file) const;
+
+private:
+    static const int subBits = 7;
+    static const int maxBits = 40;
+
+    static int bucketOf(uint64_t value);
+    static uint64_t lowestOf(int bucket);
+
+    std::vector<uint64_t> counts;
+    uint64_t total, sum;
+    uint64_t minValue, maxValue;
+};
+
+#endif
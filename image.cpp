@@ -0,0 +1,15 @@
+#include "image.h"
+
+#include <cstdio>
+
+bool writePPM(const char* path, int width, int height, const unsigned char* rgb)
+{
+    FILE* file = std::fopen(path, "wb");
+    if (!file)
+        return false;
+
+    std::fprintf(file, "P6\n%d %d\n255\n", width, height);
+    std::fwrite(rgb, 3 * width, height, file);
+
+    return std::fclose(file) == 0;
+}
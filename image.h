@@ -0,0 +1,7 @@
+#ifndef GRAVITY_IMAGE_H
+#define GRAVITY_IMAGE_H
+
+// write 8-bit RGB pixels, rows from top to bottom, as a binary PPM file
+bool writePPM(const char* path, int width, int height, const unsigned char* rgb);
+
+#endif
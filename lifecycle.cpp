@@ -0,0 +1,58 @@
+#include "lifecycle.h"
+
+#include <cmath>
+#include <cstdio>
+
+bool parseEmitter(const char* text, Emitter* emitter)
+{
+    Emitter parsed = { 0.0f, 0.0f, 0.0f, 0.02f, 0.5f };
+    char end;
+    if (std::sscanf(text, "%f,%f,%f%c", &parsed.x, &parsed.y, &parsed.rate, &end) != 3
+            || !(parsed.rate >= 0.0f))
+        return false;
+    *emitter = parsed;
+    return true;
+}
+
+Lifecycle::Lifecycle(unsigned seed)
+    : generator(seed), born(0), died(0)
+{
+}
+
+void Lifecycle::addEmitter(const Emitter& emitter)
+{
+    emitters.push_back(emitter);
+    owed.push_back(0.0f);
+}
+
+bool Lifecycle::addSink(const Sink& sink)
+{
+    if (int(sinks.size()) == maxSinks)
+        return false;
+    sinks.push_back(sink);
+    return true;
+}
+
+size_t Lifecycle::getDue(float dt) const
+{
+    size_t due = 0;
+    for (size_t e = 0; e < emitters.size(); e++)
+        due += size_t(owed[e] + emitters[e].rate * dt);
+    return due;
+}
+
+void Lifecycle::reserve(const ThreadPool& pool)
+{
+    offsets.reserve(blocksPerThread * pool.size() + 1);
+}
+
+Particle Lifecycle::birth(const Emitter& emitter)
+{
+    // uniform over the disc, heading away from its centre
+    std::uniform_real_distribution<float> dist(0.0f, 1.0f);
+    float angle = 6.2831853f * dist(generator);
+    float r = emitter.radius * std::sqrt(dist(generator));
+    float cx = std::cos(angle), cy = std::sin(angle);
+    Particle p = { emitter.x + r*cx, emitter.y + r*cy, emitter.speed*cx, emitter.speed*cy };
+    return p;
+}
@@ -0,0 +1,164 @@
+#ifndef GRAVITY_LIFECYCLE_H
+#define GRAVITY_LIFECYCLE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "packed.h"
+#include "particles.h"
+#include "threadpool.h"
+#include "trace.h"
+
+// Particles born at emitters and dying in sinks. The live ones are kept
+// packed together at the front of their array, in order, so that steps and
+// draws cover them and nothing else.
+
+// a steady stream of new particles from a disc, flying straight out of it
+struct Emitter {
+    float x, y;
+    float rate;   // particles per second
+    float radius;
+    float speed;
+};
+
+// particles that end a step closer than radius to the centre die
+struct Sink {
+    float x, y, radius;
+
+    bool contains(float px, float py) const
+    {
+        float dx = px - x, dy = py - y;
+        return dx*dx + dy*dy < radius*radius;
+    }
+};
+
+// as many sinks as the simulate shader has uniforms for
+const int maxSinks = 4;
+
+// "X,Y,RATE", with the default radius and speed, as --emitter takes it
+bool parseEmitter(const char* text, Emitter* emitter);
+
+class Lifecycle {
+public:
+    // the same seed gives the same particles on the CPU and the GPU
+    explicit Lifecycle(unsigned seed = 1);
+
+    void addEmitter(const Emitter& emitter);
+    bool addSink(const Sink& sink); // false past maxSinks
+
+    int getNumSinks() const { return int(sinks.size()); }
+    Sink& getSink(int i) { return sinks[i]; }
+    const Sink* getSinks() const { return sinks.data(); }
+
+    bool isEmpty() const { return emitters.empty() && sinks.empty(); }
+
+    // how many particles the emitters give off over the next dt
+    size_t getDue(float dt) const;
+
+    // the particles born over the next dt, at most room of them, into out;
+    // returns how many. Births there is no room for are lost.
+    template <typename P>
+    size_t emit(float dt, P* out, size_t room);
+
+    // the live particles of in[0, count) into out, packed in the same
+    // order; returns how many. out does not overlap in.
+    template <typename P>
+    size_t cull(ThreadPool& pool, const P* in, size_t count, P* out);
+
+    // make room for culling on pool, so that cull allocates nothing
+    void reserve(const ThreadPool& pool);
+
+    // totals since construction
+    uint64_t getBorn() const { return born; }
+    uint64_t getDied() const { return died; }
+
+private:
+    Particle birth(const Emitter& emitter);
+
+    template <typename P>
+    bool isLive(const P& p) const
+    {
+        float x, y;
+        getPosition(p, &x, &y);
+        for (size_t i = 0; i < sinks.size(); i++)
+            if (sinks[i].contains(x, y))
+                return false;
+        return true;
+    }
+
+    std::vector<Emitter> emitters;
+    std::vector<float> owed; // fractions of a particle each emitter is due
+    std::vector<Sink> sinks;
+    std::default_random_engine generator;
+    uint64_t born, died;
+
+    // cull splits the particles into up to this many blocks per thread
+    static const int blocksPerThread = 16;
+    std::vector<size_t> offsets; // where each block's live particles go
+};
+
+template <typename P>
+size_t Lifecycle::emit(float dt, P* out, size_t room)
+{
+    TRACE_SCOPE("emit");
+    size_t added = 0;
+    for (size_t e = 0; e < emitters.size(); e++) {
+        owed[e] += emitters[e].rate * dt;
+        size_t due = size_t(owed[e]);
+        owed[e] -= float(due);
+        for (; due > 0 && added < room; due--)
+            storeParticle(birth(emitters[e]), &out[added++]);
+    }
+    born += added;
+    return added;
+}
+
+// Stream compaction by prefix sum: count the survivors of each block, add
+// the counts up into where each block's survivors start, then copy each
+// block's into place. The blocks run in parallel in both passes, and only
+// the sum over the blocks between them is serial.
+template <typename P>
+size_t Lifecycle::cull(ThreadPool& pool, const P* in, size_t count, P* out)
+{
+    TRACE_SCOPE("cull");
+    if (sinks.empty()) {
+        std::copy(in, in + count, out);
+        return count;
+    }
+
+    int blocks = int(std::min<size_t>(blocksPerThread * pool.size(),
+            std::max<size_t>(count, 1)));
+    size_t blockSize = (count + blocks - 1) / blocks;
+    offsets.resize(blocks + 1);
+
+    pool.run(blocks, [&](int b) {
+        size_t begin = std::min(b * blockSize, count);
+        size_t end = std::min(begin + blockSize, count);
+        size_t kept = 0;
+        for (size_t i = begin; i < end; i++)
+            kept += isLive(in[i]);
+        offsets[b + 1] = kept;
+    });
+
+    offsets[0] = 0;
+    for (int b = 0; b < blocks; b++)
+        offsets[b + 1] += offsets[b];
+
+    pool.run(blocks, [&](int b) {
+        size_t begin = std::min(b * blockSize, count);
+        size_t end = std::min(begin + blockSize, count);
+        P* next = out + offsets[b];
+        for (size_t i = begin; i < end; i++)
+            if (isLive(in[i]))
+                *next++ = in[i];
+    });
+
+    size_t live = offsets[blocks];
+    died += count - live;
+    return live;
+}
+
+#endif
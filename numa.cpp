@@ -0,0 +1,247 @@
+#include "numa.h"
+#include "allocs.h"
+#include "arena.h"
+#include "threadpool.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <utility>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// smaller allocations stay on the heap, where placing them is not worth a
+// mapping of their own, or a huge page
+static const size_t placedBytes = 1 << 20;
+
+int numaNodeCount()
+{
+#ifdef __linux__
+    // "0" or "0-1" and the like
+    FILE* file = std::fopen("/sys/devices/system/node/possible", "r");
+    if (!file)
+        return 1;
+    int first = 0, last = 0;
+    int fields = std::fscanf(file, "%d-%d", &first, &last);
+    std::fclose(file);
+    return fields == 2 ? last + 1 : 1;
+#else
+    return 1;
+#endif
+}
+
+int numaNodeOfCpu(int cpu)
+{
+#ifdef __linux__
+    // the CPU's directory links to its node as node<N>
+    char path[64];
+    std::snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR* dir = opendir(path);
+    if (!dir)
+        return 0;
+    int node = 0;
+    while (dirent* entry = readdir(dir)) {
+        if (std::strncmp(entry->d_name, "node", 4) == 0
+                && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+            node = std::atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+#else
+    (void) cpu;
+    return 0;
+#endif
+}
+
+int currentNumaNode()
+{
+#ifdef __linux__
+    int cpu = sched_getcpu();
+    return cpu < 0 ? 0 : numaNodeOfCpu(cpu);
+#else
+    return 0;
+#endif
+}
+
+std::vector<int> numaCpus()
+{
+    std::vector<int> cpus;
+#ifdef __linux__
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+        return cpus;
+    std::vector<std::pair<int, int>> byNode;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &set))
+            byNode.push_back(std::make_pair(numaNodeOfCpu(cpu), cpu));
+    std::sort(byNode.begin(), byNode.end());
+    for (size_t i = 0; i < byNode.size(); i++)
+        cpus.push_back(byNode[i].second);
+#endif
+    return cpus;
+}
+
+bool pinThread(const std::vector<int>& cpus)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 0; i < cpus.size(); i++)
+        CPU_SET(cpus[i], &set);
+    return !cpus.empty() && sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    (void) cpus;
+    return false;
+#endif
+}
+
+static const char* const placementNames[] = { "heap", "first-touch", "interleave" };
+
+const char* numaPlacementName(NumaPlacement placement)
+{
+    return placementNames[placement];
+}
+
+bool parseNumaPlacement(const char* name, NumaPlacement* placement)
+{
+    for (int i = 0; i <= NUMA_INTERLEAVE; i++) {
+        if (std::strcmp(name, placementNames[i]) == 0) {
+            *placement = NumaPlacement(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+#ifdef __linux__
+static size_t pageSize()
+{
+    long size = sysconf(_SC_PAGESIZE);
+    return size > 0 ? size_t(size) : 4096;
+}
+
+static bool interleave(void* memory, size_t bytes)
+{
+    unsigned long mask[16] = {};
+    const int bits = int(sizeof(mask) * 8);
+    int nodes = std::min(numaNodeCount(), bits);
+    for (int node = 0; node < nodes; node++)
+        mask[node / (8 * sizeof(long))] |= 1ul << (node % (8 * sizeof(long)));
+    return syscall(SYS_mbind, memory, bytes, MPOL_INTERLEAVE, mask, bits, 0) == 0;
+}
+#endif
+
+void* numaAllocate(size_t bytes, ThreadPool* pool, NumaPlacement placement)
+{
+#ifdef __linux__
+    if (placement != NUMA_HEAP && bytes >= placedBytes) {
+        void* memory = mapHugePages(bytes);
+        if (!memory)
+            return nullptr;
+        if (placement == NUMA_INTERLEAVE && !interleave(memory, bytes)) {
+            static bool warned = false;
+            if (!warned)
+                std::cerr << "mbind failed, memory is not interleaved" << std::endl;
+            warned = true;
+        }
+
+        // the first write to a page places it on the writer's node, or by
+        // the policy; write one byte of each page from the thread whose
+        // share holds it
+        if (pool) {
+            char* bytePointer = static_cast<char*>(memory);
+            size_t page = pageSize();
+            pool->runOnEach([=](int index) {
+                size_t begin = pool->shareBegin(bytes, index);
+                size_t end = pool->shareBegin(bytes, index + 1);
+                for (size_t offset = (begin + page - 1) / page * page; offset < end;
+                        offset += page)
+                    bytePointer[offset] = 0;
+            });
+        }
+        return memory;
+    }
+#else
+    (void) pool;
+    (void) placement;
+#endif
+    void* memory = std::malloc(bytes);
+    if (memory)
+        allocs::record(bytes);
+    return memory;
+}
+
+void numaFree(void* memory, size_t bytes, NumaPlacement placement)
+{
+#ifdef __linux__
+    if (placement != NUMA_HEAP && bytes >= placedBytes) {
+        unmapHugePages(memory, bytes);
+        return;
+    }
+#else
+    (void) bytes;
+    (void) placement;
+#endif
+    if (memory)
+        allocs::recordFree();
+    std::free(memory);
+}
+
+double numaLocalFraction(const void* memory, size_t bytes, ThreadPool& pool,
+        size_t capacity)
+{
+#ifdef __linux__
+    if (bytes == 0)
+        return -1.0;
+    capacity = std::max(capacity, bytes);
+    size_t page = pageSize();
+    uintptr_t start = uintptr_t(memory);
+    uintptr_t first = start / page * page;
+
+    // ask move_pages, without moving anything, which node each page is on
+    const size_t batch = 4096;
+    std::vector<void*> pages;
+    std::vector<int> owners, status(batch);
+    size_t local = 0, placed = 0;
+    int owner = 0;
+    for (uintptr_t address = first; address < start + bytes; address += page) {
+        size_t offset = address > start ? address - start : 0;
+        while (offset >= pool.shareBegin(capacity, owner + 1))
+            owner++;
+        pages.push_back(reinterpret_cast<void*>(address));
+        owners.push_back(owner);
+        if (pages.size() < batch && address + page < start + bytes)
+            continue;
+
+        if (syscall(SYS_move_pages, 0, pages.size(), pages.data(), nullptr,
+                status.data(), 0) != 0)
+            return -1.0;
+        for (size_t i = 0; i < pages.size(); i++) {
+            if (status[i] < 0) // not touched yet
+                continue;
+            placed++;
+            local += status[i] == pool.getNode(owners[i]);
+        }
+        pages.clear();
+        owners.clear();
+    }
+    return placed > 0 ? double(local) / placed : -1.0;
+#else
+    (void) memory;
+    (void) bytes;
+    (void) pool;
+    (void) capacity;
+    return -1.0;
+#endif
+}
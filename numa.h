@@ -0,0 +1,95 @@
+#ifndef GRAVITY_NUMA_H
+#define GRAVITY_NUMA_H
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+class ThreadPool;
+
+// NUMA topology from Linux's sysfs, and placement through the raw system
+// calls, without libnuma. Elsewhere, and on machines with a single node,
+// everything is node 0.
+
+// number of memory nodes, at least 1
+int numaNodeCount();
+
+// node of a logical CPU
+int numaNodeOfCpu(int cpu);
+
+// node of the CPU the calling thread is running on right now
+int currentNumaNode();
+
+// the CPUs the process may run on, grouped by node; empty where unknown
+std::vector<int> numaCpus();
+
+// keep the calling thread, and the threads it starts from now on, on these
+// CPUs; false where that is not possible
+bool pinThread(const std::vector<int>& cpus);
+
+// where the pages of an allocation go
+enum NumaPlacement {
+    NUMA_HEAP,        // the heap, so wherever the thread filling it runs
+    NUMA_FIRST_TOUCH, // each pool thread touches the pages of its share
+    NUMA_INTERLEAVE   // round robin over the nodes, for data every thread reads
+};
+
+// "heap", "first-touch" or "interleave", as the command line options take them
+const char* numaPlacementName(NumaPlacement placement);
+bool parseNumaPlacement(const char* name, NumaPlacement* placement);
+
+// bytes of memory placed as asked, or nullptr; large allocations are
+// mapped separately, on huge pages where possible (see mapHugePages), and
+// touched by the pool before they are returned, so pool.run steps each
+// share on the node it lives on
+void* numaAllocate(size_t bytes, ThreadPool* pool, NumaPlacement placement);
+void numaFree(void* memory, size_t bytes, NumaPlacement placement);
+
+// fraction of the pages of [memory, memory + bytes) on the node of the pool
+// thread whose share of a batch they hold, or -1 if the kernel cannot say;
+// the shares are of capacity bytes from memory, or just bytes if that is
+// more, as when only the front of an allocation is in use
+double numaLocalFraction(const void* memory, size_t bytes, ThreadPool& pool,
+        size_t capacity = 0);
+
+// allocator for containers of data the pool works through; default
+// constructed, it is the plain heap
+template <typename T>
+class NumaAllocator {
+public:
+    typedef T value_type;
+
+    NumaAllocator() : pool(nullptr), placement(NUMA_HEAP) {}
+    NumaAllocator(ThreadPool& pool, NumaPlacement placement)
+        : pool(&pool), placement(placement) {}
+    template <typename U>
+    NumaAllocator(const NumaAllocator<U>& other)
+        : pool(other.pool), placement(other.placement) {}
+
+    T* allocate(size_t n)
+    {
+        void* memory = numaAllocate(n * sizeof(T), pool, placement);
+        if (!memory)
+            throw std::bad_alloc();
+        return static_cast<T*>(memory);
+    }
+
+    void deallocate(T* memory, size_t n) { numaFree(memory, n * sizeof(T), placement); }
+
+    ThreadPool* pool;
+    NumaPlacement placement;
+};
+
+template <typename T, typename U>
+bool operator==(const NumaAllocator<T>& a, const NumaAllocator<U>& b)
+{
+    return a.pool == b.pool && a.placement == b.placement;
+}
+
+template <typename T, typename U>
+bool operator!=(const NumaAllocator<T>& a, const NumaAllocator<U>& b)
+{
+    return !(a == b);
+}
+
+#endif
@@ -0,0 +1,37 @@
+#include "overlay.h"
+
+#include <GL/glew.h>
+#include <algorithm>
+
+static void fillRect(int x, int y, int w, int h, float r, float g, float b)
+{
+    glScissor(x, y, w, h);
+    glClearColor(r, g, b, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+}
+
+void drawOverlay(const OverlayBar* bars, int count, float fullScale,
+        int width, float pixelRatio)
+{
+    const int margin = int(8 * pixelRatio);
+    const int barHeight = int(6 * pixelRatio);
+    const int length = width / 3;
+
+    glEnable(GL_SCISSOR_TEST);
+
+    fillRect(margin, margin, length + 2*margin, count * 2*barHeight + margin,
+            0.1f, 0.1f, 0.1f);
+
+    for (int i = 0; i < count; i++) {
+        const OverlayBar& bar = bars[i];
+        int x = 2*margin;
+        int y = 2*margin + (count - 1 - i) * 2*barHeight;
+        int w = int(length * std::min(bar.value / fullScale, 1.0f));
+        int tick = int(length * std::min(bar.marker / fullScale, 1.0f));
+
+        fillRect(x, y, std::max(w, 1), barHeight, bar.r, bar.g, bar.b);
+        fillRect(x + tick, y, std::max(int(pixelRatio), 1), barHeight, 1.0f, 1.0f, 1.0f);
+    }
+
+    glDisable(GL_SCISSOR_TEST);
+}
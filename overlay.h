@@ -0,0 +1,16 @@
+#ifndef GRAVITY_OVERLAY_H
+#define GRAVITY_OVERLAY_H
+
+// One horizontal bar of the overlay, with a tick mark at a second value.
+struct OverlayBar {
+    float value, marker;
+    float r, g, b;
+};
+
+// Draw bars stacked up from the bottom left corner of the bound framebuffer,
+// with fullScale spanning a third of its width. Uses scissored clears only,
+// so there is no shader or vertex state to disturb.
+void drawOverlay(const OverlayBar* bars, int count, float fullScale,
+        int width, float pixelRatio);
+
+#endif
@@ -0,0 +1,65 @@
+#include "packed.h"
+
+std::vector<PackedParticle> packParticles(const Particle* particles, size_t count)
+{
+    std::vector<PackedParticle> packed(count);
+    for (size_t i = 0; i < count; i++)
+        packed[i] = packParticle(particles[i]);
+    return packed;
+}
+
+// GLSL 1.50 has neither packSnorm2x16 nor packHalf2x16, nor the float bit
+// casts to write them with, so the halves are built arithmetically; log2
+// may be off by one next to a power of two, which the exponent is checked
+// for. Converting a negative int to uint keeps its bits.
+const char* const packedGlsl = R"(
+uint packSnorm16(float v) {
+    return uint(int(floor(clamp(v, -1.0, 1.0)*32767.0 + 0.5))) & 0xffffu;
+}
+
+float unpackSnorm16(uint bits) {
+    // sign extend the low half
+    return max(float(int(bits << 16) >> 16)/32767.0, -1.0);
+}
+
+uint packHalf(float v) {
+    uint sign = v < 0.0 ? 0x8000u : 0u;
+    float a = min(abs(v), 65504.0);
+    if (a < 6.103515625e-05)
+        return sign | uint(floor(a*16777216.0 + 0.5));
+    float e = floor(log2(a));
+    float p = exp2(e);
+    if (p > a) {
+        e -= 1.0;
+        p *= 0.5;
+    } else if (2.0*p <= a) {
+        e += 1.0;
+        p *= 2.0;
+    }
+    uint m = uint(floor((a/p - 1.0)*1024.0 + 0.5));
+    return sign | ((uint(e + 15.0) << 10) + m);
+}
+
+float unpackHalf(uint bits) {
+    float m = float(bits & 0x3ffu);
+    float e = float((bits >> 10) & 0x1fu);
+    float a = e == 0.0 ? m*5.9604644775390625e-08 : exp2(e - 15.0)*(1.0 + m/1024.0);
+    return (bits & 0x8000u) != 0u ? -a : a;
+}
+
+uint packPosition(vec2 p) {
+    return packSnorm16(p.x) | (packSnorm16(p.y) << 16);
+}
+
+vec2 unpackPosition(uint bits) {
+    return vec2(unpackSnorm16(bits), unpackSnorm16(bits >> 16));
+}
+
+uint packVelocity(vec2 v) {
+    return packHalf(v.x) | (packHalf(v.y) << 16);
+}
+
+vec2 unpackVelocity(uint bits) {
+    return vec2(unpackHalf(bits & 0xffffu), unpackHalf(bits >> 16));
+}
+)";
@@ -0,0 +1,129 @@
+#ifndef GRAVITY_PACKED_H
+#define GRAVITY_PACKED_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "particles.h"
+
+// A particle in 8 bytes rather than 16, for when moving particles through
+// memory is what limits the step. The position is two 16-bit normalized
+// integers across the [-1,1] box, x in the low half, good to 1/65534 of the
+// box; the velocity is two half floats, good to 1 part in 2048. Positions
+// outside the box, which the reflection lets particles reach for one step,
+// are clamped to its walls.
+//
+// The CPU functions here and packedGlsl round the same way, so both
+// backends store the same bits for the same floats.
+struct PackedParticle {
+    uint32_t position;
+    uint32_t velocity;
+};
+
+// floor without the library call, exact for anything an int holds
+inline int32_t floorToInt(float v)
+{
+    int32_t i = int32_t(v);
+    return i - (float(i) > v);
+}
+
+inline uint32_t packSnorm16(float v)
+{
+    float c = std::min(std::max(v, -1.0f), 1.0f);
+    return uint32_t(floorToInt(c * 32767.0f + 0.5f)) & 0xffffu;
+}
+
+inline float unpackSnorm16(uint32_t bits)
+{
+    return std::max(float(int16_t(uint16_t(bits))) / 32767.0f, -1.0f);
+}
+
+// rounding to nearest with ties away from zero, clamping to the largest
+// half rather than overflowing to infinity. The shader has to work the
+// exponent out arithmetically; here it is moved across from the float's
+// bits, which rounds the same. Both cases are worked out and one picked,
+// so that loops over particles vectorize.
+inline uint32_t packHalf(float v)
+{
+    uint32_t sign = v < 0.0f ? 0x8000u : 0u;
+    float a = std::min(std::fabs(v), 65504.0f);
+
+    // below the smallest normal half, 2^-14, in steps of 2^-24
+    const float minNormal = 6.103515625e-05f;
+    uint32_t subnormal = uint32_t(floorToInt(std::min(a, minNormal) * 16777216.0f + 0.5f));
+
+    // rebias the exponent from 127 to 15 and round off 13 mantissa bits;
+    // a mantissa that rounds up carries into the exponent
+    uint32_t bits;
+    std::memcpy(&bits, &a, sizeof(bits));
+    uint32_t normal = (bits - (112u << 23) + 0x1000u) >> 13;
+
+    return sign | (a < minNormal ? subnormal : normal);
+}
+
+inline float unpackHalf(uint32_t bits)
+{
+    uint32_t m = bits & 0x3ffu, e = (bits >> 10) & 0x1fu;
+    float subnormal = float(int32_t(m)) * 5.9604644775390625e-08f; // 2^-24
+    uint32_t f = ((e + 112u) << 23) | (m << 13) | ((bits & 0x8000u) << 16);
+    float normal;
+    std::memcpy(&normal, &f, sizeof(normal));
+    return e == 0 ? (bits & 0x8000u ? -subnormal : subnormal) : normal;
+}
+
+inline PackedParticle packParticle(const Particle& p)
+{
+    PackedParticle packed;
+    packed.position = packSnorm16(p.x) | (packSnorm16(p.y) << 16);
+    packed.velocity = packHalf(p.vx) | (packHalf(p.vy) << 16);
+    return packed;
+}
+
+inline Particle unpackParticle(const PackedParticle& packed)
+{
+    Particle p;
+    p.x = unpackSnorm16(packed.position);
+    p.y = unpackSnorm16(packed.position >> 16);
+    p.vx = unpackHalf(packed.velocity & 0xffffu);
+    p.vy = unpackHalf(packed.velocity >> 16);
+    return p;
+}
+
+// packed particles the pool steps, placed like a ParticleVector
+typedef std::vector<PackedParticle, NumaAllocator<PackedParticle>> PackedVector;
+
+// the position alone, for code that takes either kind of particle
+inline void getPosition(const Particle& p, float* x, float* y)
+{
+    *x = p.x;
+    *y = p.y;
+}
+
+inline void getPosition(const PackedParticle& p, float* x, float* y)
+{
+    *x = unpackSnorm16(p.position);
+    *y = unpackSnorm16(p.position >> 16);
+}
+
+// store a particle as either kind
+inline void storeParticle(const Particle& p, Particle* out)
+{
+    *out = p;
+}
+
+inline void storeParticle(const Particle& p, PackedParticle* out)
+{
+    *out = packParticle(p);
+}
+
+std::vector<PackedParticle> packParticles(const Particle* particles, size_t count);
+
+// GLSL of the same: uint packPosition(vec2), vec2 unpackPosition(uint),
+// uint packVelocity(vec2) and vec2 unpackVelocity(uint)
+extern const char* const packedGlsl;
+
+#endif
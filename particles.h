@@ -0,0 +1,24 @@
+#ifndef GRAVITY_PARTICLES_H
+#define GRAVITY_PARTICLES_H
+
+#include <cstddef>
+#include <vector>
+
+#include "numa.h"
+
+// One particle, laid out like the vec4 vertices the shaders read:
+// position in xy, velocity in zw.
+struct Particle {
+    float x, y;
+    float vx, vy;
+};
+
+// particles the pool steps, placed on the nodes of the threads stepping them
+// when given an allocator that says so
+typedef std::vector<Particle, NumaAllocator<Particle>> ParticleVector;
+
+// random positions in the [-1,1]^2 box, at rest; the same seed every run
+// unless another is given
+std::vector<Particle> randomParticles(size_t count, unsigned seed = 1);
+
+#endif
@@ -0,0 +1,502 @@
+#include "particlesystem.h"
+#include "packed.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <utility>
+
+// force() comes from the field between these two
+static const char* simulateHeader = R"(
+#version 150
+
+#ifdef COMPACT
+// packed as packPosition() and packVelocity() pack them
+in uint position;
+in uint velocity;
+
+flat out uint newPos;
+flat out uint newVel;
+#else
+in vec2 position; // current vertex position
+in vec2 velocity; // current vertex velocity
+
+out vec2 newPos; // updated vertex position
+out vec2 newVel; // updated vertex velocity
+#endif
+
+uniform float dt; // timestep
+
+)";
+
+// the sinks follow for SINKS programs, sized to maxSinks
+static std::string sinkDeclarations()
+{
+    return "uniform vec3 sinks[" + std::to_string(maxSinks) + "]; // centre and radius\n"
+        "uniform int numSinks;\n"
+        "\n"
+        "flat out int alive;\n"
+        "\n";
+}
+
+static const char* simulateMain = R"(
+const float reflectLoss = 0.5;
+
+void main() {
+#ifdef COMPACT
+    vec2 pos = unpackPosition(position);
+    vec2 vel = unpackVelocity(velocity);
+#else
+    vec2 pos = position;
+    vec2 vel = velocity;
+#endif
+    vec2 v = vel + dt*force(pos, vel);
+    vec2 p = pos + dt*v;
+
+    if (p.x < -1.0 || p.x > 1.0)
+        v = reflectLoss*reflect(v, vec2(1.0, 0.0));
+    if (p.y < -1.0 || p.y > 1.0)
+        v = reflectLoss*reflect(v, vec2(0.0, 1.0));
+
+#ifdef SINKS
+    alive = 1;
+    for (int i = 0; i < numSinks; i++) {
+        vec2 d = p - sinks[i].xy;
+        if (dot(d, d) < sinks[i].z*sinks[i].z)
+            alive = 0;
+    }
+#endif
+
+#ifdef COMPACT
+    newPos = packPosition(p);
+    newVel = packVelocity(v);
+#else
+    newPos = p;
+    newVel = v;
+#endif
+})";
+
+// Dead particles emit no vertex, and transform feedback writes what is
+// emitted in order, one after the other, so the live ones come out packed
+// together: the stream compaction a compute shader would do with a prefix
+// sum, which GL 3.2 leaves to the feedback hardware.
+static const char* cullSource = R"(
+#version 150
+
+layout(points) in;
+layout(points, max_vertices = 1) out;
+
+#ifdef COMPACT
+flat in uint newPos[];
+flat in uint newVel[];
+
+flat out uint keptPos;
+flat out uint keptVel;
+#else
+in vec2 newPos[];
+in vec2 newVel[];
+
+out vec2 keptPos;
+out vec2 keptVel;
+#endif
+
+flat in int alive[];
+
+void main() {
+    if (alive[0] != 0) {
+        keptPos = newPos[0];
+        keptVel = newVel[0];
+        EmitVertex();
+    }
+})";
+
+SimulateProgram::SimulateProgram(ProgramCache& cache, const std::string& forceSource,
+        const std::vector<std::string>& params, bool compact, bool sinks)
+    : cache(cache), params(params), compact(compact), sinks(sinks), numSinks(0),
+      resolved(false), program(0), uniDt(-1), uniSinks(-1), uniNumSinks(-1)
+{
+    variant.vertexSource = simulateHeader;
+    if (sinks)
+        variant.vertexSource += sinkDeclarations();
+    if (compact) {
+        variant.vertexSource += packedGlsl;
+        variant.flags.push_back("COMPACT");
+    }
+    variant.vertexSource += forceSource + simulateMain;
+    variant.attributes.push_back("position");
+    variant.attributes.push_back("velocity");
+    // notify OpenGL of the things we need out of the transform feedback
+    if (sinks) {
+        variant.flags.push_back("SINKS");
+        variant.geometrySource = cullSource;
+        variant.feedback.push_back("keptPos");
+        variant.feedback.push_back("keptVel");
+    } else {
+        variant.feedback.push_back("newPos");
+        variant.feedback.push_back("newVel");
+    }
+    cache.request(variant);
+}
+
+bool SimulateProgram::isReady()
+{
+    return resolved || cache.isReady(variant);
+}
+
+bool SimulateProgram::isValid()
+{
+    resolve();
+    return program != 0;
+}
+
+void SimulateProgram::resolve()
+{
+    if (resolved)
+        return;
+    program = cache.get(variant);
+    resolved = true;
+
+    uniDt = glGetUniformLocation(program, "dt");
+    uniSinks = glGetUniformLocation(program, "sinks");
+    uniNumSinks = glGetUniformLocation(program, "numSinks");
+    for (size_t i = 0; i < params.size(); i++)
+        uniParams.push_back(glGetUniformLocation(program, params[i].c_str()));
+}
+
+void SimulateProgram::use(float dt, const float* params, int count)
+{
+    resolve();
+    glUseProgram(program);
+    glUniform1f(uniDt, dt);
+    count = std::min(count, getNumParams());
+    for (int i = 0; i < count; i++)
+        glUniform1f(uniParams[i], params[i]);
+    if (sinks) {
+        glUniform3fv(uniSinks, numSinks, &sinkValues[0][0]);
+        glUniform1i(uniNumSinks, numSinks);
+    }
+}
+
+void SimulateProgram::setSinks(const Sink* sinks, int count)
+{
+    numSinks = std::min(count, maxSinks);
+    for (int i = 0; i < numSinks; i++) {
+        sinkValues[i][0] = sinks[i].x;
+        sinkValues[i][1] = sinks[i].y;
+        sinkValues[i][2] = sinks[i].radius;
+    }
+}
+
+ParticleSystem::ParticleSystem()
+    : size(0), capacity(0), query(0), current(0), birthVao(0), birthVbo(0),
+      pendingBirths(0), countPending(false)
+{
+    vao[0] = vao[1] = 0;
+    vbo[0] = vbo[1] = 0;
+    quadVao[0] = quadVao[1] = 0;
+    feedback[0] = feedback[1] = 0;
+}
+
+ParticleSystem::ParticleSystem(std::shared_ptr<SimulateProgram> program,
+        const Particle* particles, size_t count, size_t capacity)
+    : ParticleSystem()
+{
+    init(std::move(program), particles, count, capacity);
+}
+
+ParticleSystem::ParticleSystem(ParticleSystem&& other)
+    : ParticleSystem()
+{
+    *this = std::move(other);
+}
+
+ParticleSystem& ParticleSystem::operator=(ParticleSystem&& other)
+{
+    // the other side ends up with what this held and releases it
+    std::swap(program, other.program);
+    std::swap(size, other.size);
+    std::swap(capacity, other.capacity);
+    std::swap(query, other.query);
+    std::swap(vao, other.vao);
+    std::swap(vbo, other.vbo);
+    std::swap(quadVao, other.quadVao);
+    std::swap(current, other.current);
+    std::swap(feedback, other.feedback);
+    std::swap(birthVao, other.birthVao);
+    std::swap(birthVbo, other.birthVbo);
+    std::swap(pendingBirths, other.pendingBirths);
+    std::swap(countPending, other.countPending);
+    other.destroy();
+    return *this;
+}
+
+void ParticleSystem::init(std::shared_ptr<SimulateProgram> program,
+        const Particle* particles, size_t count, size_t capacity)
+{
+    destroy();
+    this->program = std::move(program);
+    size = count;
+    this->capacity = std::max(capacity, count);
+    current = 0;
+
+    glGenVertexArrays(2, vao);
+    glGenBuffers(2, vbo);
+
+    // vbo with initial vertex data, and one for transform feedback
+    bool compact = this->program->isCompact();
+    std::vector<PackedParticle> packed;
+    if (compact)
+        packed = packParticles(particles, count);
+
+    // emit() packs births here, at most the capacity of them, so a frame
+    // loop calling it allocates nothing; untouched, this is address space
+    if (compact)
+        births.reserve(this->capacity);
+    size_t stride = compact ? sizeof(PackedParticle) : sizeof(Particle);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo[0]);
+    glBufferData(GL_ARRAY_BUFFER, this->capacity * stride, nullptr, GL_DYNAMIC_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, count * stride,
+            compact ? (const void*) packed.data() : particles);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo[1]);
+    glBufferData(GL_ARRAY_BUFFER, this->capacity * stride, nullptr, GL_DYNAMIC_DRAW);
+
+    // how many of them a step with sinks keeps
+    if (this->program->hasSinks())
+        glGenQueries(1, &query);
+
+    // where feedback objects can draw what a step kept, each writes one
+    // buffer, and births wait in a third until the count is known
+    if (query && feedbackDrawSupported()) {
+        glGenTransformFeedbacks(2, feedback);
+        for (int i = 0; i < 2; i++) {
+            glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, feedback[i]);
+            glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, vbo[i]);
+        }
+        glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, 0);
+
+        glGenVertexArrays(1, &birthVao);
+        glGenBuffers(1, &birthVbo);
+        glBindBuffer(GL_ARRAY_BUFFER, birthVbo);
+        glBufferData(GL_ARRAY_BUFFER, this->capacity * stride, nullptr, GL_DYNAMIC_DRAW);
+        glBindVertexArray(birthVao);
+        setLayout(birthVbo, compact);
+    }
+
+    // specify layout of vertex data for each vao
+    for (int i = 0; i < 2; i++) {
+        glBindVertexArray(vao[i]);
+        setLayout(vbo[i], compact);
+    }
+
+    // and again stepping once per instance, for quads
+    if (quadsSupported()) {
+        glGenVertexArrays(2, quadVao);
+        for (int i = 0; i < 2; i++) {
+            glBindVertexArray(quadVao[i]);
+            setLayout(vbo[i], compact);
+            for (GLuint attribute = 0; attribute < 2; attribute++) {
+                if (GLEW_VERSION_3_3)
+                    glVertexAttribDivisor(attribute, 1);
+                else
+                    glVertexAttribDivisorARB(attribute, 1);
+            }
+        }
+    }
+}
+
+void ParticleSystem::setLayout(GLuint buffer, bool compact)
+{
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+
+    if (compact) {
+        // integers as they are, for the shaders to unpack
+        glEnableVertexAttribArray(0);
+        glVertexAttribIPointer(0, 1, GL_UNSIGNED_INT, sizeof(PackedParticle), 0);
+        glEnableVertexAttribArray(1);
+        glVertexAttribIPointer(1, 1, GL_UNSIGNED_INT, sizeof(PackedParticle),
+                (void*) sizeof(uint32_t));
+        return;
+    }
+
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE,
+            sizeof(Particle), 0);
+
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE,
+            sizeof(Particle), (void*) (2 * sizeof(float)));
+}
+
+bool ParticleSystem::feedbackDrawSupported()
+{
+    return GLEW_VERSION_4_0 || GLEW_ARB_transform_feedback2;
+}
+
+void ParticleSystem::step(float dt, const float* params, int count)
+{
+    // the last step's count, a frame late, by when the GPU has usually run it
+    settle();
+
+    program->use(dt, params, count);
+
+    // read the current buffer, feed back into the other one
+    int next = current ^ 1;
+    glBindVertexArray(vao[current]);
+    if (feedback[next])
+        glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, feedback[next]);
+    else
+        glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, vbo[next]);
+
+    glEnable(GL_RASTERIZER_DISCARD);
+    if (query)
+        glBeginQuery(GL_TRANSFORM_FEEDBACK_PRIMITIVES_WRITTEN, query);
+    glBeginTransformFeedback(GL_POINTS);
+    glDrawArrays(GL_POINTS, 0, GLsizei(size));
+    glEndTransformFeedback();
+    if (query)
+        glEndQuery(GL_TRANSFORM_FEEDBACK_PRIMITIVES_WRITTEN);
+    glDisable(GL_RASTERIZER_DISCARD);
+    if (feedback[next])
+        glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, 0);
+
+    current = next;
+
+    // the feedback object draws what the step kept, so the count can wait;
+    // without one, the next draw needs it on the CPU and this waits for the
+    // step
+    if (feedback[current]) {
+        countPending = true;
+    } else if (query) {
+        GLuint written;
+        glGetQueryObjectuiv(query, GL_QUERY_RESULT, &written);
+        size = written;
+    }
+}
+
+void ParticleSystem::settle()
+{
+    if (!countPending)
+        return;
+    GLuint written;
+    glGetQueryObjectuiv(query, GL_QUERY_RESULT, &written);
+    size = written;
+    countPending = false;
+
+    // the births into their place after the survivors
+    if (pendingBirths > 0) {
+        size_t stride = program->isCompact() ? sizeof(PackedParticle) : sizeof(Particle);
+        glBindBuffer(GL_COPY_READ_BUFFER, birthVbo);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, vbo[current]);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0,
+                size * stride, pendingBirths * stride);
+        size += pendingBirths;
+        pendingBirths = 0;
+    }
+}
+
+size_t ParticleSystem::emit(const Particle* particles, size_t count)
+{
+    // while the count is pending, at most what the step started from
+    // survived, so this never overflows
+    count = std::min(count, capacity - this->count());
+    if (count == 0)
+        return 0;
+
+    // after the live ones of the current buffer, which the next step reads,
+    // or after the births waiting for them to be known
+    GLuint buffer = countPending ? birthVbo : vbo[current];
+    size_t offset = countPending ? pendingBirths : size;
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    if (program->isCompact()) {
+        births.resize(count);
+        for (size_t i = 0; i < count; i++)
+            births[i] = packParticle(particles[i]);
+        glBufferSubData(GL_ARRAY_BUFFER, offset * sizeof(PackedParticle),
+                count * sizeof(PackedParticle), births.data());
+    } else {
+        glBufferSubData(GL_ARRAY_BUFFER, offset * sizeof(Particle),
+                count * sizeof(Particle), particles);
+    }
+    if (countPending)
+        pendingBirths += count;
+    else
+        size += count;
+    return count;
+}
+
+void ParticleSystem::render() const
+{
+    glBindVertexArray(vao[current]);
+    if (!countPending) {
+        glDrawArrays(GL_POINTS, 0, GLsizei(size));
+        return;
+    }
+    glDrawTransformFeedback(GL_POINTS, feedback[current]);
+    if (pendingBirths > 0) {
+        glBindVertexArray(birthVao);
+        glDrawArrays(GL_POINTS, 0, GLsizei(pendingBirths));
+    }
+}
+
+void ParticleSystem::renderQuads()
+{
+    if (!quadVao[current])
+        return;
+    settle();
+    glBindVertexArray(quadVao[current]);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, GLsizei(size));
+}
+
+bool ParticleSystem::quadsSupported()
+{
+    return GLEW_VERSION_3_3 || GLEW_ARB_instanced_arrays;
+}
+
+void ParticleSystem::readback(Particle* particles)
+{
+    settle();
+    glBindBuffer(GL_ARRAY_BUFFER, vbo[current]);
+    if (!program->isCompact()) {
+        glGetBufferSubData(GL_ARRAY_BUFFER, 0, size * sizeof(Particle), particles);
+        return;
+    }
+    // packed into the front of particles, then unpacked in place from the
+    // back, where each particle only covers packed ones already unpacked,
+    // so that a snapshot allocates nothing
+    glGetBufferSubData(GL_ARRAY_BUFFER, 0, size * sizeof(PackedParticle), particles);
+    const char* bytes = reinterpret_cast<const char*>(particles);
+    for (size_t i = size; i-- > 0;) {
+        PackedParticle packed;
+        std::memcpy(&packed, bytes + i * sizeof(PackedParticle), sizeof(packed));
+        particles[i] = unpackParticle(packed);
+    }
+}
+
+void ParticleSystem::destroy()
+{
+    if (vao[0]) {
+        glDeleteVertexArrays(2, vao);
+        glDeleteBuffers(2, vbo);
+    }
+    if (quadVao[0])
+        glDeleteVertexArrays(2, quadVao);
+    if (query)
+        glDeleteQueries(1, &query);
+    if (feedback[0])
+        glDeleteTransformFeedbacks(2, feedback);
+    if (birthVao) {
+        glDeleteVertexArrays(1, &birthVao);
+        glDeleteBuffers(1, &birthVbo);
+    }
+    query = 0;
+    feedback[0] = feedback[1] = 0;
+    birthVao = birthVbo = 0;
+    pendingBirths = 0;
+    countPending = false;
+    vao[0] = vao[1] = 0;
+    vbo[0] = vbo[1] = 0;
+    quadVao[0] = quadVao[1] = 0;
+    size = capacity = 0;
+    current = 0;
+    program.reset();
+}
@@ -0,0 +1,187 @@
+#ifndef GRAVITY_PARTICLESYSTEM_H
+#define GRAVITY_PARTICLESYSTEM_H
+
+#include <GL/glew.h>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "lifecycle.h"
+#include "packed.h"
+#include "particles.h"
+#include "programcache.h"
+
+// The transform feedback program that advances particles under a force
+// field. It belongs to a context and can be shared by every ParticleSystem
+// in it; the program itself comes from, and is owned by, a ProgramCache
+// that has to outlive it. It is requested from the cache on construction
+// and collected on first use, so it can build in the meantime.
+class SimulateProgram {
+public:
+    // forceSource defines the force() function with the uniforms named in
+    // params, as ForceField::glsl() generates; compact programs step
+    // particles stored as PackedParticle, and programs with sinks drop the
+    // particles that end a step in one
+    SimulateProgram(ProgramCache& cache, const std::string& forceSource,
+            const std::vector<std::string>& params, bool compact = false,
+            bool sinks = false);
+
+    SimulateProgram(const SimulateProgram&) = delete;
+    SimulateProgram& operator=(const SimulateProgram&) = delete;
+
+    template <typename Field>
+    static std::shared_ptr<SimulateProgram> create(ProgramCache& cache, bool compact = false,
+            bool sinks = false)
+    {
+        std::vector<std::string> params;
+        std::string source = Field::glsl(params);
+        return std::make_shared<SimulateProgram>(cache, source, params, compact, sinks);
+    }
+
+    // true once using the program does not wait for it to build
+    bool isReady();
+
+    // false if the program failed to build; waits for it
+    bool isValid();
+
+    int getNumParams() const { return int(params.size()); }
+    bool isCompact() const { return compact; }
+    bool hasSinks() const { return sinks; }
+
+    // the first maxSinks of these from the next use() on
+    void setSinks(const Sink* sinks, int count);
+
+    // make current and set the timestep and the first count parameters;
+    // uniforms keep their values between calls
+    void use(float dt, const float* params, int count);
+
+private:
+    void resolve();
+
+    ProgramCache& cache;
+    ProgramVariant variant;
+    std::vector<std::string> params;
+    bool compact, sinks;
+    float sinkValues[maxSinks][3];
+    int numSinks;
+    bool resolved;
+    GLuint program;
+    GLint uniDt, uniSinks, uniNumSinks;
+    std::vector<GLint> uniParams;
+};
+
+// Particles living in two GL buffers that transform feedback ping-pongs
+// between. Owns its buffers and vertex arrays, is move-only, and needs its
+// context current for every call after init(), including destruction.
+//
+// Positions are vertex attribute 0 and velocities attribute 1 in the
+// vertex arrays, so any program with position and velocity bound to those
+// locations can draw the system. With a compact program the buffers hold
+// PackedParticle, and the attributes are each one uint that the drawing
+// program unpacks with packedGlsl. render() draws a point per particle;
+// renderQuads() draws a 4 vertex triangle strip instance per particle from
+// the same buffer, with both attributes advancing per instance, so the
+// program builds the quad's corners from gl_VertexID.
+//
+// The buffers have room for a capacity of particles, of which the first
+// count() are live. A step with sinks keeps the survivors, in order, at the
+// front of the buffer it writes, and emit() adds new ones after them.
+//
+// How many survived is only known once the GPU has run the step. With
+// transform feedback objects (GL 4.0 or ARB_transform_feedback2), step()
+// does not wait for it: render() draws the survivors with
+// glDrawTransformFeedback, births wait in a buffer of their own, and the
+// count is read one frame late, when the next step or settle() needs it.
+// Until then count() is the count the step started from plus the births
+// since, which is at least the live count. Without them, step() waits.
+class ParticleSystem {
+public:
+    // owns nothing until init()
+    ParticleSystem();
+    ParticleSystem(std::shared_ptr<SimulateProgram> program,
+            const Particle* particles, size_t count, size_t capacity = 0);
+    ~ParticleSystem() { destroy(); }
+
+    ParticleSystem(ParticleSystem&& other);
+    ParticleSystem& operator=(ParticleSystem&& other);
+    ParticleSystem(const ParticleSystem&) = delete;
+    ParticleSystem& operator=(const ParticleSystem&) = delete;
+
+    // upload the particles into buffers with room for capacity of them, or
+    // just count if that is more, releasing whatever was held before
+    void init(std::shared_ptr<SimulateProgram> program,
+            const Particle* particles, size_t count, size_t capacity = 0);
+
+    // advance one timestep without drawing anything; params are the
+    // program's force parameters, normally all getNumParams() of them
+    void step(float dt, const float* params, int count);
+
+    // the same, with the parameters of the field the program was made from
+    template <typename Field>
+    void step(float dt, const Field& field)
+    {
+        float params[Field::numParams];
+        field.getParams(params);
+        step(dt, params, Field::numParams);
+    }
+
+    // add particles after the live ones, as many as there is room for;
+    // returns how many
+    size_t emit(const Particle* particles, size_t count);
+
+    // make count() exact and put the births since the last step after its
+    // survivors, waiting for the step if the GPU has not run it yet; the
+    // buffer holds count() live particles from here until the next step
+    void settle();
+
+    // draw the current particles as points with the bound program
+    void render() const;
+
+    // draw them as quads with the bound program; needs instanced arrays.
+    // Instances cannot come from a feedback count, so this settles
+    void renderQuads();
+
+    // GL 3.3 or ARB_instanced_arrays, without which renderQuads() draws
+    // nothing
+    static bool quadsSupported();
+
+    // copy the current particles back, count() of them once settled,
+    // unpacking compact ones; this waits for the GPU to finish the last step
+    void readback(Particle* particles);
+
+    void destroy();
+
+    size_t count() const { return size + pendingBirths; }
+    size_t getCapacity() const { return capacity; }
+
+    // the buffer holding the current particles, as Particle or, compact,
+    // PackedParticle, for compute shaders to read as a storage buffer; its
+    // first count() are the live ones only once settled
+    GLuint getBuffer() const { return vbo[current]; }
+    bool isCompact() const { return program && program->isCompact(); }
+
+private:
+    // positions and velocities from the buffer into the bound vertex array
+    static void setLayout(GLuint buffer, bool compact);
+
+    // transform feedback objects and glDrawTransformFeedback
+    static bool feedbackDrawSupported();
+
+    std::shared_ptr<SimulateProgram> program;
+    size_t size, capacity;
+    GLuint query; // primitives written by the last step, with sinks
+    GLuint vao[2], vbo[2];
+    GLuint quadVao[2]; // the same buffers with a divisor of 1, or 0
+    int current; // buffer holding the latest positions
+    std::vector<PackedParticle> births; // emit()'s, packed
+
+    // with sinks and feedback draws: the feedback objects writing each
+    // buffer, and births waiting for the survivors' count
+    GLuint feedback[2];
+    GLuint birthVao, birthVbo;
+    size_t pendingBirths;
+    bool countPending; // size is what the last step started from
+};
+
+#endif
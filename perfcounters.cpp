@@ -0,0 +1,202 @@
+#include "perfcounters.h"
+
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// what a cache miss costs in memory traffic
+static const double cacheLineBytes = 64.0;
+
+PerfCounters::Stage::Stage(const char* name)
+    : name(name), particles(0.0), steps(0)
+{
+    std::memset(&total, 0, sizeof(total));
+}
+
+void PerfCounters::Stage::add(const Stage& other)
+{
+    for (int e = 0; e < NUM_EVENTS; e++)
+        total.values[e] += other.total.values[e];
+    particles += other.particles;
+    steps += other.steps;
+}
+
+#ifdef __linux__
+static int openEvent(long tid, int groupFd, unsigned type, unsigned long long config)
+{
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    // user space only, which perf_event_paranoid 2 still allows
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    return int(syscall(SYS_perf_event_open, &attr, pid_t(tid), -1, groupFd, 0));
+}
+#endif
+
+PerfCounters::PerfCounters(const std::vector<long>& threadIds)
+{
+    for (int e = 0; e < NUM_EVENTS; e++)
+        supported[e] = true;
+    std::memset(&started, 0, sizeof(started));
+
+#ifdef __linux__
+    static const unsigned types[NUM_EVENTS] = {
+        PERF_TYPE_SOFTWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE
+    };
+    static const unsigned long long configs[NUM_EVENTS] = {
+        PERF_COUNT_SW_TASK_CLOCK, PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+    };
+
+    for (size_t t = 0; t < threadIds.size(); t++) {
+        // the task clock leads, so the group exists even without a PMU and
+        // all members are scheduled onto the PMU together
+        Group group;
+        group.fds[0] = openEvent(threadIds[t], -1, types[0], configs[0]);
+        if (group.fds[0] < 0) {
+            // counts from some of the threads would be divided by all the
+            // particles, so count on every thread or on none
+            closeGroups();
+            break;
+        }
+        for (int e = 1; e < NUM_EVENTS; e++) {
+            group.fds[e] = openEvent(threadIds[t], group.fds[0], types[e], configs[e]);
+            if (group.fds[e] < 0)
+                supported[e] = false;
+        }
+        groups.push_back(group);
+    }
+#else
+    (void) threadIds;
+#endif
+
+    if (groups.empty())
+        for (int e = 0; e < NUM_EVENTS; e++)
+            supported[e] = false;
+}
+
+PerfCounters::~PerfCounters()
+{
+    closeGroups();
+}
+
+void PerfCounters::closeGroups()
+{
+#ifdef __linux__
+    for (size_t t = 0; t < groups.size(); t++)
+        for (int e = NUM_EVENTS - 1; e >= 0; e--)
+            if (groups[t].fds[e] >= 0)
+                close(groups[t].fds[e]);
+#endif
+    groups.clear();
+}
+
+void PerfCounters::read(Counts& counts) const
+{
+    std::memset(&counts, 0, sizeof(counts));
+
+#ifdef __linux__
+    for (size_t t = 0; t < groups.size(); t++) {
+        for (int e = 0; e < NUM_EVENTS; e++) {
+            if (!supported[e] || groups[t].fds[e] < 0)
+                continue;
+
+            // value, time enabled, time running
+            unsigned long long data[3];
+            if (::read(groups[t].fds[e], data, sizeof(data)) != sizeof(data))
+                continue;
+            double scale = data[2] ? double(data[1]) / double(data[2]) : 0.0;
+            counts.values[e] += data[0] * scale;
+        }
+    }
+#endif
+}
+
+void PerfCounters::begin()
+{
+    read(started);
+}
+
+void PerfCounters::end(Stage& stage, size_t particles)
+{
+    Counts now;
+    read(now);
+    for (int e = 0; e < NUM_EVENTS; e++)
+        stage.total.values[e] += now.values[e] - started.values[e];
+    stage.particles += double(particles);
+    stage.steps++;
+}
+
+void PerfCounters::printHeader(FILE* file)
+{
+    std::fprintf(file, "%-16s %12s %8s %12s %12s %12s %12s\n", "stage",
+            "cpu ms/step", "IPC", "instr/part", "LLC/part", "bytes/part", "brmiss/part");
+}
+
+static void printField(FILE* file, bool valid, double value, const char* format)
+{
+    if (valid)
+        std::fprintf(file, format, value);
+    else
+        std::fprintf(file, " %12s", "n/a");
+}
+
+void PerfCounters::print(FILE* file, const Stage& stage) const
+{
+    const double* v = stage.total.values;
+    double particles = stage.particles > 0.0 ? stage.particles : 1.0;
+
+    std::fprintf(file, "%-16s", stage.name);
+    // summed over the threads, so CPU time rather than wall time
+    std::fprintf(file, " %12.3f", stage.steps ? v[TASK_CLOCK] * 1e-6 / stage.steps : 0.0);
+    if (supported[CYCLES] && supported[INSTRUCTIONS] && v[CYCLES] > 0.0)
+        std::fprintf(file, " %8.2f", v[INSTRUCTIONS] / v[CYCLES]);
+    else
+        std::fprintf(file, " %8s", "n/a");
+    printField(file, supported[INSTRUCTIONS], v[INSTRUCTIONS] / particles, " %12.2f");
+    printField(file, supported[LLC_MISSES], v[LLC_MISSES] / particles, " %12.4f");
+    printField(file, supported[LLC_MISSES], cacheLineBytes * v[LLC_MISSES] / particles, " %12.2f");
+    printField(file, supported[BRANCH_MISSES], v[BRANCH_MISSES] / particles, " %12.4f");
+    std::fprintf(file, "\n");
+}
+
+void PerfCounters::printCsvHeader(FILE* file)
+{
+    std::fprintf(file, "step,stage,particles,task_clock_ns,cycles,instructions,"
+            "llc_misses,branch_misses,instructions_per_particle,"
+            "llc_misses_per_particle,bytes_per_particle\n");
+}
+
+void PerfCounters::printCsv(FILE* file, int step, const Stage& stage) const
+{
+    const double* v = stage.total.values;
+    double particles = stage.particles > 0.0 ? stage.particles : 1.0;
+
+    // unsupported events are left empty
+    std::fprintf(file, "%d,%s,%.0f,%.0f", step, stage.name, stage.particles, v[TASK_CLOCK]);
+    for (int e = CYCLES; e < NUM_EVENTS; e++) {
+        if (supported[e])
+            std::fprintf(file, ",%.0f", v[e]);
+        else
+            std::fprintf(file, ",");
+    }
+    if (supported[INSTRUCTIONS])
+        std::fprintf(file, ",%.3f", v[INSTRUCTIONS] / particles);
+    else
+        std::fprintf(file, ",");
+    if (supported[LLC_MISSES])
+        std::fprintf(file, ",%.5f,%.3f\n", v[LLC_MISSES] / particles,
+                cacheLineBytes * v[LLC_MISSES] / particles);
+    else
+        std::fprintf(file, ",,\n");
+}
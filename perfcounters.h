@@ -0,0 +1,76 @@
+#ifndef GRAVITY_PERFCOUNTERS_H
+#define GRAVITY_PERFCOUNTERS_H
+
+#include <cstddef>
+#include <cstdio>
+#include <vector>
+
+// Hardware performance counters for a set of threads through Linux's
+// perf_event_open, with no external tools. Each thread gets its own counter
+// group, which is read from the calling thread around a stage, so work the
+// thread pool spreads over its workers is counted in full. Events the CPU
+// or kernel do not offer, as in most virtual machines, are reported as n/a,
+// and if any thread cannot be counted at all, none are.
+class PerfCounters {
+public:
+    enum Event {
+        TASK_CLOCK, // nanoseconds on CPU, a software event that always works
+        CYCLES,
+        INSTRUCTIONS,
+        LLC_MISSES,
+        BRANCH_MISSES,
+        NUM_EVENTS
+    };
+
+    // counts summed over the threads, scaled up if the kernel multiplexed
+    struct Counts {
+        double values[NUM_EVENTS];
+    };
+
+    // one stage of the engine, accumulated over steps
+    struct Stage {
+        explicit Stage(const char* name);
+
+        void add(const Stage& other);
+
+        const char* name;
+        Counts total;
+        double particles;
+        int steps;
+    };
+
+    explicit PerfCounters(const std::vector<long>& threadIds);
+    ~PerfCounters();
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    bool isAvailable() const { return !groups.empty(); }
+    bool hasEvent(Event event) const { return supported[event]; }
+
+    void read(Counts& counts) const;
+
+    // bracket one step of a stage over the given number of particles
+    void begin();
+    void end(Stage& stage, size_t particles);
+
+    // derived per particle metrics of a stage, averaged over its steps, as a
+    // table row, or as a CSV row with a header written by printCsvHeader
+    void print(FILE* file, const Stage& stage) const;
+    static void printHeader(FILE* file);
+    void printCsv(FILE* file, int step, const Stage& stage) const;
+    static void printCsvHeader(FILE* file);
+
+private:
+    void closeGroups();
+
+    struct Group {
+        int fds[NUM_EVENTS]; // -1 for events that could not be opened
+    };
+
+    std::vector<Group> groups;
+    bool supported[NUM_EVENTS];
+    Counts started;
+};
+
+#endif
@@ -0,0 +1,61 @@
+# Profile guided build of the CPU engines in one step: build instrumented
+# binaries, train them on a recorded replay, then rebuild with the profiles.
+#
+#   cmake -P pgo.cmake
+#
+# Variables, each passed as -DNAME=value before -P:
+#   BUILD_DIR   build tree (default build-pgo)
+#   REPLAY      training workload (default session.replay)
+#   PARTICLES   particles in the training run (default 1000000)
+#   OPTIONS     extra configure arguments, e.g. "-DGRAVITY_NATIVE=ON;-DGRAVITY_LTO=ON"
+#
+# gcc looks profiles up by object path, so both passes share one build tree.
+
+set(SOURCE_DIR ${CMAKE_CURRENT_LIST_DIR})
+if(NOT BUILD_DIR)
+    set(BUILD_DIR ${SOURCE_DIR}/build-pgo)
+endif()
+if(NOT REPLAY)
+    set(REPLAY ${SOURCE_DIR}/session.replay)
+endif()
+if(NOT PARTICLES)
+    set(PARTICLES 1000000)
+endif()
+get_filename_component(BUILD_DIR ${BUILD_DIR} ABSOLUTE)
+get_filename_component(REPLAY ${REPLAY} ABSOLUTE)
+set(PROFILE_DIR ${BUILD_DIR}/pgo)
+
+function(run)
+    execute_process(COMMAND ${ARGN} RESULT_VARIABLE result)
+    if(result)
+        message(FATAL_ERROR "failed: ${ARGN}")
+    endif()
+endfunction()
+
+function(build mode)
+    message(STATUS "pgo: ${mode} build in ${BUILD_DIR}")
+    run(${CMAKE_COMMAND} -S ${SOURCE_DIR} -B ${BUILD_DIR} -DCMAKE_BUILD_TYPE=Release
+        -DGRAVITY_PGO=${mode} -DGRAVITY_PGO_DIR=${PROFILE_DIR} ${OPTIONS})
+    run(${CMAKE_COMMAND} --build ${BUILD_DIR})
+endfunction()
+
+build(GENERATE)
+
+# stale counts from an earlier run would be added to this one
+file(REMOVE_RECURSE ${PROFILE_DIR})
+message(STATUS "pgo: training on ${REPLAY}")
+run(${BUILD_DIR}/gravity-headless --replay ${REPLAY} --particles ${PARTICLES}
+    --output ${BUILD_DIR}/pgo-training.ppm)
+
+# clang writes raw profiles that have to be merged first
+file(GLOB raw ${PROFILE_DIR}/*.profraw)
+if(raw)
+    find_program(LLVM_PROFDATA NAMES llvm-profdata)
+    if(NOT LLVM_PROFDATA)
+        message(FATAL_ERROR "llvm-profdata not found")
+    endif()
+    run(${LLVM_PROFDATA} merge -o ${PROFILE_DIR}/default.profdata ${raw})
+endif()
+
+build(USE)
+message(STATUS "pgo: optimised binaries in ${BUILD_DIR}")
@@ -0,0 +1,250 @@
+#include "primitives.h"
+
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "trace.h"
+
+// Scans four lanes at a time in a register, shifting and adding twice; the
+// segmented one stops each lane's sum at the flags, and carries the flags
+// along so a later step knows where a segment began. Both return what
+// follows the last lane. Without SSE2 they are the plain loops.
+namespace {
+
+uint32_t reduceBlock(const uint32_t* values, size_t count)
+{
+    size_t i = 0;
+    uint32_t sum = 0;
+#ifdef __SSE2__
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 4 <= count; i += 4)
+        acc = _mm_add_epi32(acc, _mm_loadu_si128((const __m128i*)(values + i)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    sum = uint32_t(_mm_cvtsi128_si32(acc));
+#endif
+    for (; i < count; i++)
+        sum += values[i];
+    return sum;
+}
+
+uint32_t scanBlock(const uint32_t* values, size_t count, uint32_t* sums, uint32_t carry)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i running = _mm_set1_epi32(int(carry));
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(values + i));
+        __m128i s = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+        s = _mm_add_epi32(s, _mm_slli_si128(s, 8));
+        s = _mm_add_epi32(s, running);
+        _mm_storeu_si128((__m128i*)(sums + i), _mm_sub_epi32(s, v));
+        running = _mm_shuffle_epi32(s, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+    carry = uint32_t(_mm_cvtsi128_si32(running));
+#endif
+    for (; i < count; i++) {
+        uint32_t v = values[i];
+        sums[i] = carry;
+        carry += v;
+    }
+    return carry;
+}
+
+uint32_t segmentedScanBlock(const uint32_t* values, const uint32_t* flags, size_t count,
+        uint32_t* sums, uint32_t carry)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    __m128i running = _mm_set1_epi32(int(carry));
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(values + i));
+        // all ones in lanes with a flag
+        __m128i f = _mm_andnot_si128(
+                _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(flags + i)), zero),
+                _mm_set1_epi32(-1));
+        __m128i s = _mm_add_epi32(v, _mm_andnot_si128(f, _mm_slli_si128(v, 4)));
+        f = _mm_or_si128(f, _mm_slli_si128(f, 4));
+        s = _mm_add_epi32(s, _mm_andnot_si128(f, _mm_slli_si128(s, 8)));
+        f = _mm_or_si128(f, _mm_slli_si128(f, 8));
+        // the carry reaches the lanes before the block's first flag
+        s = _mm_add_epi32(s, _mm_andnot_si128(f, running));
+        _mm_storeu_si128((__m128i*)(sums + i), _mm_sub_epi32(s, v));
+        running = _mm_shuffle_epi32(s, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+    carry = uint32_t(_mm_cvtsi128_si32(running));
+#endif
+    for (; i < count; i++) {
+        uint32_t v = values[i];
+        if (flags[i])
+            carry = 0;
+        sums[i] = carry;
+        carry += v;
+    }
+    return carry;
+}
+
+bool hasFlag(const uint32_t* flags, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        if (flags[i])
+            return true;
+    return false;
+}
+
+// what follows the last flag, or all of them without one
+uint32_t segmentTail(const uint32_t* values, const uint32_t* flags, size_t count)
+{
+    size_t last = count;
+    while (last > 0 && !flags[last - 1])
+        last--;
+    size_t begin = last > 0 ? last - 1 : 0;
+    return reduceBlock(values + begin, count - begin);
+}
+
+const int radixBits = 8;
+const int radixDigits = 1 << radixBits;
+
+} // namespace
+
+CpuPrimitives::CpuPrimitives(ThreadPool& pool)
+    : pool(pool)
+{
+}
+
+// a few blocks a thread, to even out the load, but none so small that
+// splitting them costs more than it saves
+int CpuPrimitives::getBlocks(size_t count) const
+{
+    const size_t minBlock = 16384;
+    return int(std::max<size_t>(std::min<size_t>(16 * pool.size(), count / minBlock), 1));
+}
+
+uint32_t CpuPrimitives::reduce(const uint32_t* values, size_t count)
+{
+    TRACE_SCOPE("reduce");
+    int blocks = getBlocks(count);
+    size_t blockSize = (count + blocks - 1) / blocks;
+    blockSums.resize(blocks);
+    pool.run(blocks, [&](int b) {
+        size_t begin = std::min(b * blockSize, count);
+        size_t end = std::min(begin + blockSize, count);
+        blockSums[b] = reduceBlock(values + begin, end - begin);
+    });
+    return reduceBlock(blockSums.data(), blocks);
+}
+
+// Sum each block, scan the block sums serially into each block's carry,
+// then scan the blocks from their carries in parallel.
+void CpuPrimitives::exclusiveScan(const uint32_t* values, size_t count, uint32_t* sums)
+{
+    TRACE_SCOPE("scan");
+    int blocks = getBlocks(count);
+    size_t blockSize = (count + blocks - 1) / blocks;
+    blockSums.resize(blocks);
+    if (blocks > 1)
+        pool.run(blocks, [&](int b) {
+            size_t begin = std::min(b * blockSize, count);
+            size_t end = std::min(begin + blockSize, count);
+            blockSums[b] = reduceBlock(values + begin, end - begin);
+        });
+    scanBlock(blockSums.data(), blocks, blockSums.data(), 0);
+
+    pool.run(blocks, [&](int b) {
+        size_t begin = std::min(b * blockSize, count);
+        size_t end = std::min(begin + blockSize, count);
+        scanBlock(values + begin, end - begin, sums + begin, blockSums[b]);
+    });
+}
+
+// The same, with what follows each block's last flag as its sum; a block
+// with a flag starts the carry into the next one afresh.
+void CpuPrimitives::segmentedScan(const uint32_t* values, const uint32_t* flags, size_t count,
+        uint32_t* sums)
+{
+    TRACE_SCOPE("segmented scan");
+    int blocks = getBlocks(count);
+    size_t blockSize = (count + blocks - 1) / blocks;
+    blockSums.resize(blocks);
+    blockFlags.resize(blocks);
+    if (blocks > 1)
+        pool.run(blocks, [&](int b) {
+            size_t begin = std::min(b * blockSize, count);
+            size_t end = std::min(begin + blockSize, count);
+            blockSums[b] = segmentTail(values + begin, flags + begin, end - begin);
+            blockFlags[b] = hasFlag(flags + begin, end - begin);
+        });
+    // a block's own flag does not stop the carry reaching what comes before it
+    uint32_t carry = 0;
+    for (int b = 0; b < blocks; b++) {
+        uint32_t sum = blockSums[b];
+        blockSums[b] = carry;
+        carry = blockFlags[b] ? sum : carry + sum;
+    }
+
+    pool.run(blocks, [&](int b) {
+        size_t begin = std::min(b * blockSize, count);
+        size_t end = std::min(begin + blockSize, count);
+        segmentedScanBlock(values + begin, flags + begin, end - begin, sums + begin,
+                blockSums[b]);
+    });
+}
+
+// Least significant digit first radix sort, a byte a pass: count each
+// block's digits, scan the counts digit by digit across the blocks into
+// where each block's run of each digit goes, then move the pairs there in
+// order. The passes alternate between the arrays and the spares.
+void CpuPrimitives::sortPairs(uint32_t* keys, uint32_t* values, size_t count, int bits)
+{
+    TRACE_SCOPE("sort pairs");
+    int blocks = getBlocks(count);
+    size_t blockSize = (count + blocks - 1) / blocks;
+    counts.resize(size_t(radixDigits) * blocks);
+    spareKeys.resize(count);
+    spareValues.resize(count);
+
+    uint32_t* fromKeys = keys;
+    uint32_t* fromValues = values;
+    uint32_t* toKeys = spareKeys.data();
+    uint32_t* toValues = spareValues.data();
+    for (int shift = 0; shift < bits; shift += radixBits) {
+        // the last digit may be narrower, so that higher bits are left in order
+        uint32_t digitMask = (1u << std::min(radixBits, bits - shift)) - 1;
+        pool.run(blocks, [&](int b) {
+            size_t begin = std::min(b * blockSize, count);
+            size_t end = std::min(begin + blockSize, count);
+            uint32_t local[radixDigits] = {};
+            for (size_t i = begin; i < end; i++)
+                local[(fromKeys[i] >> shift) & digitMask]++;
+            for (int d = 0; d < radixDigits; d++)
+                counts[size_t(d) * blocks + b] = local[d];
+        });
+
+        exclusiveScan(counts.data(), counts.size(), counts.data());
+
+        pool.run(blocks, [&](int b) {
+            size_t begin = std::min(b * blockSize, count);
+            size_t end = std::min(begin + blockSize, count);
+            uint32_t next[radixDigits];
+            for (int d = 0; d < radixDigits; d++)
+                next[d] = counts[size_t(d) * blocks + b];
+            for (size_t i = begin; i < end; i++) {
+                uint32_t to = next[(fromKeys[i] >> shift) & digitMask]++;
+                toKeys[to] = fromKeys[i];
+                toValues[to] = fromValues[i];
+            }
+        });
+
+        std::swap(fromKeys, toKeys);
+        std::swap(fromValues, toValues);
+    }
+
+    if (fromKeys != keys) {
+        std::memcpy(keys, fromKeys, count * sizeof(uint32_t));
+        std::memcpy(values, fromValues, count * sizeof(uint32_t));
+    }
+}
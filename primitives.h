@@ -0,0 +1,84 @@
+#ifndef GRAVITY_PRIMITIVES_H
+#define GRAVITY_PRIMITIVES_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "packed.h"
+#include "particles.h"
+#include "threadpool.h"
+
+// Data parallel building blocks on arrays of 32-bit unsigned integers, the
+// scans that compaction, sorting, binning and histograms come down to.
+// GpuPrimitives has the same functions on GL buffers, and gives the same
+// results bit for bit: sums wrap around, and sorts are stable, which makes
+// their order unique.
+//
+// Each call splits its array into blocks over the pool; scratch is kept
+// between calls, so once they have seen their largest array they do not
+// allocate.
+class CpuPrimitives {
+public:
+    explicit CpuPrimitives(ThreadPool& pool);
+
+    CpuPrimitives(const CpuPrimitives&) = delete;
+    CpuPrimitives& operator=(const CpuPrimitives&) = delete;
+
+    // the sum of values[0, count)
+    uint32_t reduce(const uint32_t* values, size_t count);
+
+    // sums[i] = values[0] + ... + values[i-1]; sums may be values
+    void exclusiveScan(const uint32_t* values, size_t count, uint32_t* sums);
+
+    // the same, starting again from 0 at every i with nonzero flags[i], so
+    // that each segment is summed on its own
+    void segmentedScan(const uint32_t* values, const uint32_t* flags, size_t count,
+            uint32_t* sums);
+
+    // sort keys ascending by their low bits, carrying values along, and
+    // keeping pairs with equal keys in order
+    void sortPairs(uint32_t* keys, uint32_t* values, size_t count, int bits = 32);
+
+    // the cell of a gridWidth x gridHeight grid over the [-1,1] box each
+    // particle is in, row by row from the bottom left, and its index: sorted
+    // by key, the pairs list the particles cell by cell
+    template <typename P>
+    void cellKeys(const P* particles, size_t count, int gridWidth, int gridHeight,
+            uint32_t* keys, uint32_t* indices);
+
+private:
+    int getBlocks(size_t count) const;
+
+    ThreadPool& pool;
+    std::vector<uint32_t> blockSums, blockFlags;
+    std::vector<uint32_t> counts; // sortPairs' digits by block
+    std::vector<uint32_t> spareKeys, spareValues;
+};
+
+// the cell along one axis, clamped to the grid; scale is half the cells,
+// as GpuPrimitives passes it, so both round the same
+inline uint32_t gridCell(float v, float scale, int cells)
+{
+    int32_t c = int32_t((v + 1.0f) * scale);
+    return uint32_t(std::min(std::max(c, 0), cells - 1));
+}
+
+template <typename P>
+void CpuPrimitives::cellKeys(const P* particles, size_t count, int gridWidth, int gridHeight,
+        uint32_t* keys, uint32_t* indices)
+{
+    float scaleX = 0.5f * float(gridWidth), scaleY = 0.5f * float(gridHeight);
+    parallelFor(pool, count, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            float x, y;
+            getPosition(particles[i], &x, &y);
+            keys[i] = gridCell(y, scaleY, gridHeight) * uint32_t(gridWidth)
+                + gridCell(x, scaleX, gridWidth);
+            indices[i] = uint32_t(i);
+        }
+    });
+}
+
+#endif
@@ -0,0 +1,153 @@
+// Checks CpuPrimitives against plain serial loops, at lengths around the
+// SSE lanes, the GPU's tiles and the pool's blocks, with segments starting
+// on and either side of their boundaries.
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "primitives.h"
+#include "threadpool.h"
+
+static int failures = 0;
+
+static void check(bool ok, const char* what, size_t count, const char* detail = "")
+{
+    if (!ok) {
+        std::fprintf(stderr, "FAILED %s, %zu elements %s\n", what, count, detail);
+        failures++;
+    }
+}
+
+static std::vector<uint32_t> randomValues(size_t count, uint32_t seed, uint32_t mask)
+{
+    std::default_random_engine generator(seed);
+    std::vector<uint32_t> values(count);
+    for (size_t i = 0; i < count; i++)
+        values[i] = uint32_t(generator()) & mask;
+    return values;
+}
+
+static std::vector<uint32_t> referenceScan(const std::vector<uint32_t>& values,
+        const std::vector<uint32_t>* flags)
+{
+    std::vector<uint32_t> sums(values.size());
+    uint32_t sum = 0;
+    for (size_t i = 0; i < values.size(); i++) {
+        if (flags && (*flags)[i])
+            sum = 0;
+        sums[i] = sum;
+        sum += values[i];
+    }
+    return sums;
+}
+
+// flags starting segments at every multiple of period and either side of it
+static std::vector<uint32_t> boundaryFlags(size_t count, size_t period)
+{
+    std::vector<uint32_t> flags(count, 0);
+    for (size_t i = period; i < count; i += period) {
+        flags[i - 1] = 1;
+        flags[i] = 7; // any nonzero flag starts a segment
+        if (i + 1 < count)
+            flags[i + 1] = 1;
+    }
+    return flags;
+}
+
+static void checkScans(CpuPrimitives& primitives, size_t count, size_t blockSize)
+{
+    std::vector<uint32_t> values = randomValues(count, uint32_t(count) + 1, ~0u);
+
+    uint32_t sum = 0;
+    for (size_t i = 0; i < count; i++)
+        sum += values[i];
+    check(primitives.reduce(values.data(), count) == sum, "reduce", count);
+
+    std::vector<uint32_t> sums(count);
+    primitives.exclusiveScan(values.data(), count, sums.data());
+    check(sums == referenceScan(values, nullptr), "exclusive scan", count);
+
+    // in place
+    sums = values;
+    primitives.exclusiveScan(sums.data(), count, sums.data());
+    check(sums == referenceScan(values, nullptr), "exclusive scan in place", count);
+
+    const size_t periods[] = { 1, 3, 4, 1024, blockSize };
+    for (size_t period : periods) {
+        std::vector<uint32_t> flags = boundaryFlags(count, period);
+        primitives.segmentedScan(values.data(), flags.data(), count, sums.data());
+        check(sums == referenceScan(values, &flags), "segmented scan", count,
+                period == blockSize ? "with flags at the block edges" : "");
+    }
+    std::vector<uint32_t> sparse = randomValues(count, uint32_t(count) + 2, 63);
+    for (uint32_t& flag : sparse)
+        flag = flag == 0;
+    primitives.segmentedScan(values.data(), sparse.data(), count, sums.data());
+    check(sums == referenceScan(values, &sparse), "segmented scan", count,
+            "with random flags");
+}
+
+static void checkSort(CpuPrimitives& primitives, size_t count, int bits)
+{
+    // only the low bits are sorted on; the rest ride along as part of the key
+    uint32_t mask = bits == 32 ? ~0u : (1u << bits) - 1;
+    std::vector<uint32_t> keys = randomValues(count, uint32_t(count) + 3, ~0u);
+    if (bits < 32) {
+        // and plenty of equal keys, to show the sort is stable
+        for (size_t i = 0; i < count; i++)
+            keys[i] = (keys[i] & ~mask) | (keys[i] & mask & 0xff0f);
+    }
+    std::vector<uint32_t> values(count);
+    for (size_t i = 0; i < count; i++)
+        values[i] = uint32_t(i);
+
+    std::vector<size_t> order(count);
+    for (size_t i = 0; i < count; i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return (keys[a] & mask) < (keys[b] & mask);
+    });
+    std::vector<uint32_t> expectedKeys(count), expectedValues(count);
+    for (size_t i = 0; i < count; i++) {
+        expectedKeys[i] = keys[order[i]];
+        expectedValues[i] = values[order[i]];
+    }
+
+    primitives.sortPairs(keys.data(), values.data(), count, bits);
+    char detail[32];
+    std::snprintf(detail, sizeof(detail), "on %d bits", bits);
+    check(keys == expectedKeys && values == expectedValues, "sort pairs", count, detail);
+}
+
+int main()
+{
+    ThreadPool pool(4);
+    CpuPrimitives primitives(pool);
+
+    // as CpuPrimitives splits arrays into blocks, so that segments can be
+    // made to start exactly at their edges
+    auto getBlockSize = [&](size_t count) {
+        size_t blocks = std::max<size_t>(std::min<size_t>(16 * pool.size(), count / 16384), 1);
+        return (count + blocks - 1) / blocks;
+    };
+
+    const size_t counts[] = {
+        0, 1, 2, 3, 5, 7, 255, 256, 257, 1023, 1024, 1025, 4097, 32767, 32768, 65537,
+        100003, (1 << 20) + 7
+    };
+    for (size_t count : counts) {
+        checkScans(primitives, count, std::max<size_t>(getBlockSize(count), 1));
+        checkSort(primitives, count, 12); // not a whole number of digits
+        checkSort(primitives, count, 16);
+        checkSort(primitives, count, 32);
+    }
+
+    if (failures > 0) {
+        std::fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    std::printf("primitives agree with the reference loops\n");
+    return 0;
+}
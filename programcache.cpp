@@ -0,0 +1,426 @@
+#include "programcache.h"
+#include "shader.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <sys/stat.h>
+
+static const char binaryMagic[4] = { 'G', 'P', 'B', '1' };
+
+// FNV-1a, good enough to name files by
+static uint64_t hashString(const std::string& text)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < text.size(); i++) {
+        hash ^= (unsigned char) text[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// the source with a #define for each flag after its #version line
+static std::string applyFlags(const std::string& source,
+        const std::vector<std::string>& flags)
+{
+    std::string defines;
+    for (size_t i = 0; i < flags.size(); i++)
+        defines += "#define " + flags[i] + " 1\n";
+
+    size_t version = source.find("#version");
+    if (version == std::string::npos)
+        return defines + source;
+    size_t end = source.find('\n', version);
+    if (end == std::string::npos)
+        return source + "\n" + defines;
+    return source.substr(0, end + 1) + defines + source.substr(end + 1);
+}
+
+// everything that goes into the linked program
+static std::string variantKey(const ProgramVariant& variant)
+{
+    std::string key;
+    for (size_t i = 0; i < variant.flags.size(); i++)
+        key += variant.flags[i] + '\n';
+    key += '\0' + variant.vertexSource + '\0' + variant.geometrySource
+        + '\0' + variant.fragmentSource + '\0' + variant.computeSource + '\0';
+    for (size_t i = 0; i < variant.attributes.size(); i++)
+        key += variant.attributes[i] + '\n';
+    key += '\0';
+    for (size_t i = 0; i < variant.feedback.size(); i++)
+        key += variant.feedback[i] + '\n';
+    return key;
+}
+
+static bool binariesSupported()
+{
+    if (!GLEW_VERSION_4_1 && !GLEW_ARB_get_program_binary)
+        return false;
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    return formats > 0;
+}
+
+static bool parallelSupported()
+{
+    return GLEW_KHR_parallel_shader_compile || GLEW_ARB_parallel_shader_compile;
+}
+
+ProgramCache::ProgramCache(const char* directory)
+    : mode(SERIAL), compiled(0), loaded(0), buildMs(0.0), stopping(false)
+{
+    if (!directory)
+        return;
+    if (!binariesSupported()) {
+        std::cerr << "program binaries unsupported, not caching shaders on disk"
+            << std::endl;
+        return;
+    }
+
+    // an existing directory is fine, anything else shows up when saving
+    mkdir(directory, 0755);
+    this->directory = directory;
+
+    const GLubyte* strings[] = {
+        glGetString(GL_VENDOR), glGetString(GL_RENDERER), glGetString(GL_VERSION)
+    };
+    for (int i = 0; i < 3; i++)
+        driver += std::string(strings[i] ? (const char*) strings[i] : "") + '\n';
+}
+
+ProgramCache::~ProgramCache()
+{
+    if (worker.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        worker.join();
+    }
+
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+        glDeleteShader(it->second->vertexShader);
+        glDeleteShader(it->second->geometryShader);
+        glDeleteShader(it->second->fragmentShader);
+        glDeleteShader(it->second->computeShader);
+        glDeleteProgram(it->second->program);
+    }
+}
+
+ProgramCache::Compile ProgramCache::setCompile(Compile mode,
+        const std::function<std::unique_ptr<SharedContext>()>& createContext)
+{
+    if ((mode == PARALLEL || mode == AUTO) && parallelSupported()) {
+        // as many driver threads as it likes
+        if (GLEW_KHR_parallel_shader_compile)
+            glMaxShaderCompilerThreadsKHR(0xffffffff);
+        else
+            glMaxShaderCompilerThreadsARB(0xffffffff);
+        return this->mode = PARALLEL;
+    }
+
+    if ((mode == THREAD || mode == AUTO) && !worker.joinable()) {
+        workerContext = createContext();
+        if (workerContext)
+            worker = std::thread(&ProgramCache::work, this);
+    }
+    if ((mode == THREAD || mode == AUTO) && worker.joinable())
+        return this->mode = THREAD;
+
+    return this->mode = SERIAL;
+}
+
+const char* ProgramCache::getName(Compile mode)
+{
+    static const char* names[] = { "serial", "parallel", "thread", "auto" };
+    return names[mode];
+}
+
+ProgramCache::Entry* ProgramCache::find(const ProgramVariant& variant)
+{
+    std::string key = variantKey(variant);
+    auto it = entries.find(key);
+    if (it != entries.end())
+        return it->second.get();
+
+    Entry* entry = new Entry();
+    entries[key].reset(entry);
+    entry->variant = variant;
+    if (!variant.vertexSource.empty())
+        entry->variant.vertexSource = applyFlags(variant.vertexSource, variant.flags);
+    if (!variant.geometrySource.empty())
+        entry->variant.geometrySource = applyFlags(variant.geometrySource, variant.flags);
+    if (!variant.fragmentSource.empty())
+        entry->variant.fragmentSource = applyFlags(variant.fragmentSource, variant.flags);
+    if (!variant.computeSource.empty())
+        entry->variant.computeSource = applyFlags(variant.computeSource, variant.flags);
+    entry->program = entry->vertexShader = entry->geometryShader = entry->fragmentShader = 0;
+    entry->computeShader = 0;
+    entry->pending = true;
+    entry->built = false;
+
+    if (!directory.empty()) {
+        char name[32];
+        std::snprintf(name, sizeof(name), "/%016llx.bin",
+                (unsigned long long) hashString(driver + key));
+        entry->path = directory + name;
+        if ((entry->program = load(entry->path))) {
+            loaded++;
+            entry->pending = false;
+            entry->variant = ProgramVariant();
+            return entry;
+        }
+    }
+
+    if (mode == THREAD) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(entry);
+        }
+        wake.notify_one();
+    } else {
+        start(*entry);
+        entry->built = true;
+        if (mode == SERIAL)
+            finish(*entry);
+    }
+    return entry;
+}
+
+void ProgramCache::request(const ProgramVariant& variant)
+{
+    TRACE_SCOPE("request program");
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    find(variant);
+    buildMs += std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - begin).count();
+}
+
+bool ProgramCache::isReady(const ProgramVariant& variant)
+{
+    Entry* entry = find(variant);
+    if (!entry->pending)
+        return true;
+    if (!entry->built.load(std::memory_order_acquire))
+        return false;
+
+    if (mode == PARALLEL) {
+        GLint complete = GL_FALSE;
+        glGetProgramiv(entry->program, GL_COMPLETION_STATUS_KHR, &complete);
+        if (!complete)
+            return false;
+    }
+    finish(*entry);
+    return true;
+}
+
+GLuint ProgramCache::get(const ProgramVariant& variant)
+{
+    TRACE_SCOPE("get program");
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+    Entry* entry = find(variant);
+    if (entry->pending) {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [entry] { return entry->built.load(std::memory_order_acquire); });
+        lock.unlock();
+        // the status queries in here wait for the driver
+        finish(*entry);
+    }
+
+    buildMs += std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - begin).count();
+    return entry->program;
+}
+
+// issue the compile and link without asking how they went, which is what
+// would wait for them
+void ProgramCache::start(Entry& entry)
+{
+    const ProgramVariant& variant = entry.variant;
+    if (!variant.computeSource.empty()) {
+        const GLchar* source = variant.computeSource.c_str();
+        entry.computeShader = glCreateShader(GL_COMPUTE_SHADER);
+        glShaderSource(entry.computeShader, 1, &source, nullptr);
+        glCompileShader(entry.computeShader);
+        entry.program = glCreateProgram();
+        glAttachShader(entry.program, entry.computeShader);
+        if (!entry.path.empty())
+            glProgramParameteri(entry.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        glLinkProgram(entry.program);
+        return;
+    }
+
+    const GLchar* source = variant.vertexSource.c_str();
+    entry.vertexShader = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(entry.vertexShader, 1, &source, nullptr);
+    glCompileShader(entry.vertexShader);
+    if (!variant.geometrySource.empty()) {
+        source = variant.geometrySource.c_str();
+        entry.geometryShader = glCreateShader(GL_GEOMETRY_SHADER);
+        glShaderSource(entry.geometryShader, 1, &source, nullptr);
+        glCompileShader(entry.geometryShader);
+    }
+    if (!variant.fragmentSource.empty()) {
+        source = variant.fragmentSource.c_str();
+        entry.fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+        glShaderSource(entry.fragmentShader, 1, &source, nullptr);
+        glCompileShader(entry.fragmentShader);
+    }
+
+    GLuint program = glCreateProgram();
+    glAttachShader(program, entry.vertexShader);
+    if (entry.geometryShader)
+        glAttachShader(program, entry.geometryShader);
+    if (entry.fragmentShader)
+        glAttachShader(program, entry.fragmentShader);
+    for (size_t i = 0; i < variant.attributes.size(); i++)
+        glBindAttribLocation(program, GLuint(i), variant.attributes[i].c_str());
+
+    std::vector<const GLchar*> varyings;
+    for (size_t i = 0; i < variant.feedback.size(); i++)
+        varyings.push_back(variant.feedback[i].c_str());
+    if (!varyings.empty())
+        glTransformFeedbackVaryings(program, GLsizei(varyings.size()), &varyings[0],
+                GL_INTERLEAVED_ATTRIBS);
+
+    if (!entry.path.empty())
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(program);
+    entry.program = program;
+}
+
+// check a started program, reporting failures, and save it
+void ProgramCache::finish(Entry& entry)
+{
+    // the worker could not make its context current
+    if (!entry.program)
+        start(entry);
+
+    const ProgramVariant& variant = entry.variant;
+    bool ok = entry.computeShader
+        ? checkShader(entry.computeShader, GL_COMPUTE_SHADER, variant.computeSource.c_str())
+        : checkShader(entry.vertexShader, GL_VERTEX_SHADER, variant.vertexSource.c_str());
+    if (entry.geometryShader)
+        ok = checkShader(entry.geometryShader, GL_GEOMETRY_SHADER,
+                variant.geometrySource.c_str()) && ok;
+    if (entry.fragmentShader)
+        ok = checkShader(entry.fragmentShader, GL_FRAGMENT_SHADER,
+                variant.fragmentSource.c_str()) && ok;
+    ok = ok && checkProgram(entry.program);
+
+    glDeleteShader(entry.vertexShader);
+    glDeleteShader(entry.geometryShader);
+    glDeleteShader(entry.fragmentShader);
+    glDeleteShader(entry.computeShader);
+    entry.vertexShader = entry.geometryShader = entry.fragmentShader = entry.computeShader = 0;
+
+    if (ok) {
+        compiled++;
+        if (!entry.path.empty())
+            save(entry.path, entry.program);
+    } else {
+        // kept as 0, so the failure is reported once
+        glDeleteProgram(entry.program);
+        entry.program = 0;
+    }
+    entry.pending = false;
+    entry.variant = ProgramVariant();
+}
+
+void ProgramCache::work()
+{
+    TRACE_THREAD_NAME("shader compiler");
+    bool current = workerContext->makeCurrent();
+    if (!current)
+        std::cerr << "shader worker context failed, compiling on the main thread"
+            << std::endl;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        wake.wait(lock, [this] { return stopping || !queue.empty(); });
+        if (stopping)
+            break;
+        Entry* entry = queue.front();
+        queue.pop_front();
+        lock.unlock();
+
+        if (current) {
+            TRACE_SCOPE("build program");
+            start(*entry);
+            // complete before another context uses the objects
+            glFinish();
+        }
+
+        lock.lock();
+        entry->built.store(true, std::memory_order_release);
+        done.notify_all();
+    }
+    lock.unlock();
+
+    if (current)
+        workerContext->doneCurrent();
+}
+
+GLuint ProgramCache::load(const std::string& path)
+{
+    FILE* file = std::fopen(path.c_str(), "rb");
+    if (!file)
+        return 0;
+
+    char magic[4];
+    uint32_t header[2]; // format, length
+    std::vector<char> binary;
+    bool ok = std::fread(magic, sizeof(magic), 1, file) == 1
+        && std::equal(magic, magic + 4, binaryMagic)
+        && std::fread(header, sizeof(header), 1, file) == 1;
+    if (ok) {
+        binary.resize(header[1]);
+        ok = !binary.empty() && std::fread(&binary[0], binary.size(), 1, file) == 1;
+    }
+    std::fclose(file);
+    if (!ok)
+        return 0;
+
+    // a driver update can reject old binaries; they are rebuilt then
+    GLuint program = glCreateProgram();
+    glProgramBinary(program, header[0], &binary[0], GLsizei(binary.size()));
+    GLint status;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE) {
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+void ProgramCache::save(const std::string& path, GLuint program)
+{
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return;
+
+    std::vector<char> binary(length);
+    GLenum format;
+    glGetProgramBinary(program, length, &length, &format, &binary[0]);
+    uint32_t header[2] = { format, uint32_t(length) };
+
+    // written aside and renamed, so other runs never see half a file
+    std::string temp = path + ".tmp";
+    FILE* file = std::fopen(temp.c_str(), "wb");
+    bool ok = file
+        && std::fwrite(binaryMagic, sizeof(binaryMagic), 1, file) == 1
+        && std::fwrite(header, sizeof(header), 1, file) == 1
+        && std::fwrite(&binary[0], length, 1, file) == 1;
+    if (file && std::fclose(file) != 0)
+        ok = false;
+    if (!ok || std::rename(temp.c_str(), path.c_str()) != 0) {
+        std::cerr << "failed to write " << path << std::endl;
+        std::remove(temp.c_str());
+    }
+}
@@ -0,0 +1,114 @@
+#ifndef GRAVITY_PROGRAMCACHE_H
+#define GRAVITY_PROGRAMCACHE_H
+
+#include <GL/glew.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// One variant of a program: its sources, the feature flags to compile them
+// with, and the link time state it needs.
+struct ProgramVariant {
+    std::string vertexSource;
+    std::string geometrySource; // empty for none
+    std::string fragmentSource; // empty for transform feedback only programs
+    std::string computeSource; // set alone, for a compute program
+    std::vector<std::string> flags; // each becomes #define FLAG 1 after #version
+    std::vector<std::string> attributes; // bound to locations 0, 1, ...
+    std::vector<std::string> feedback; // interleaved transform feedback varyings
+};
+
+// A context sharing objects with the one a ProgramCache lives in, made
+// current on the cache's worker thread to build programs there.
+class SharedContext {
+public:
+    virtual ~SharedContext() {}
+    virtual bool makeCurrent() = 0;
+    virtual void doneCurrent() = 0;
+};
+
+// Linked programs by variant, so each is built once per context. Given a
+// directory, programs are also saved there with glGetProgramBinary and
+// loaded on later runs instead of compiled, for as long as the driver stays
+// the same. Needs its context current for every call, destruction included.
+//
+// Programs can be requested ahead of use so that they build concurrently,
+// and collected with get() once needed or once isReady() says get() would
+// not wait.
+class ProgramCache {
+public:
+    // SERIAL builds when requested. PARALLEL leaves it to the driver's
+    // threads with KHR_parallel_shader_compile, THREAD to a worker thread
+    // with a shared context, AUTO picks the first of the two available.
+    enum Compile { SERIAL, PARALLEL, THREAD, AUTO };
+
+    // no directory, or one that binaries are not supported for, caches in
+    // memory only
+    explicit ProgramCache(const char* directory = nullptr);
+    ~ProgramCache();
+
+    ProgramCache(const ProgramCache&) = delete;
+    ProgramCache& operator=(const ProgramCache&) = delete;
+
+    // how later requests are built; createContext is only called for
+    // THREAD, and may return nullptr. Returns the mode in effect.
+    Compile setCompile(Compile mode,
+            const std::function<std::unique_ptr<SharedContext>()>& createContext);
+
+    // start building the variant if it is not built or building already
+    void request(const ProgramVariant& variant);
+
+    // true once get() returns without waiting; requests the variant
+    bool isReady(const ProgramVariant& variant);
+
+    // the linked program, owned by the cache, or 0 if it failed to build,
+    // in which case the logs have been printed; waits for it if need be
+    GLuint get(const ProgramVariant& variant);
+
+    // programs compiled from source and loaded from disk, and the time
+    // the calling thread spent building or waiting for them
+    int getCompiled() const { return compiled; }
+    int getLoaded() const { return loaded; }
+    double getBuildMs() const { return buildMs; }
+
+    static const char* getName(Compile mode);
+
+private:
+    struct Entry {
+        ProgramVariant variant; // released once finished
+        std::string path;
+        GLuint program, vertexShader, geometryShader, fragmentShader, computeShader;
+        bool pending; // compile started, not checked yet
+        std::atomic<bool> built; // THREAD: the worker is done with it
+    };
+
+    Entry* find(const ProgramVariant& variant);
+    void start(Entry& entry);
+    void finish(Entry& entry);
+    GLuint load(const std::string& path);
+    void save(const std::string& path, GLuint program);
+    void work();
+
+    std::string directory;
+    std::string driver; // identifies binaries as made by this driver
+    std::unordered_map<std::string, std::unique_ptr<Entry>> entries;
+    Compile mode;
+    int compiled, loaded;
+    double buildMs;
+
+    std::unique_ptr<SharedContext> workerContext;
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    std::deque<Entry*> queue;
+    bool stopping;
+};
+
+#endif
@@ -0,0 +1,184 @@
+#include "raster.h"
+#include "threadpool.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+const int SoftRasterizer::tileSize;
+
+SoftRasterizer::SoftRasterizer(ThreadPool& pool, int width, int height)
+    : pool(pool), width(width), height(height),
+      tilesX((width + tileSize - 1) / tileSize),
+      tilesY((height + tileSize - 1) / tileSize),
+      view(width, height), particleCount(0),
+      density(size_t(width) * height), chunkOffsets(nullptr), bins(nullptr),
+      tileStart(tilesX * tilesY + 1)
+{
+}
+
+// call fn(tile, offset within tile) for each particle of [begin, end) that
+// lands in the image
+template <typename P, typename Fn>
+void SoftRasterizer::forEachPixel(const P* particles,
+        size_t begin, size_t end, Fn fn) const
+{
+    // world to pixel, with y pointing down the image
+    const float ax = 0.5f * view.scaleX * width, bx = 0.5f * width;
+    const float ay = -0.5f * view.scaleY * height, by = 0.5f * height;
+
+    for (size_t i = begin; i < end; i++) {
+        float x, y;
+        getPosition(particles[i], &x, &y);
+        float u = ax * x + bx;
+        float v = ay * y + by;
+        // written so that NaNs fail too
+        if (!(u >= 0.0f && u < width && v >= 0.0f && v < height))
+            continue;
+
+        int px = int(u), py = int(v);
+        int tile = (py / tileSize) * tilesX + px / tileSize;
+        fn(tile, uint16_t((py % tileSize) * tileSize + px % tileSize));
+    }
+}
+
+void SoftRasterizer::render(const Particle* particles, size_t count, size_t capacity)
+{
+    renderParticles(particles, count, std::max(count, capacity));
+}
+
+void SoftRasterizer::render(const PackedParticle* particles, size_t count, size_t capacity)
+{
+    renderParticles(particles, count, std::max(count, capacity));
+}
+
+int SoftRasterizer::getChunks(size_t count) const
+{
+    return int(std::max<size_t>(std::min<size_t>(4 * pool.size(), count), 1));
+}
+
+template <typename P>
+void SoftRasterizer::renderParticles(const P* particles, size_t count, size_t capacity)
+{
+    particleCount = count;
+
+    const int tiles = tilesX * tilesY;
+    const int chunks = getChunks(capacity);
+    scratch.reset();
+    chunkOffsets = scratch.allocate<size_t>(size_t(chunks) * tiles);
+    std::fill(chunkOffsets, chunkOffsets + size_t(chunks) * tiles, 0);
+
+    // count the particles each chunk puts in each tile
+    pool.run(chunks, [&](int c) {
+        TRACE_SCOPE("bin count");
+        size_t* counts = &chunkOffsets[size_t(c) * tiles];
+        forEachPixel(particles, std::min(capacity * c / chunks, count),
+            std::min(capacity * (c + 1) / chunks, count),
+            [&](int tile, uint16_t) { counts[tile]++; });
+    });
+
+    // turn the counts into offsets, grouping bins by tile then chunk
+    size_t total = 0;
+    {
+        TRACE_SCOPE("bin offsets");
+        for (int t = 0; t < tiles; t++) {
+            tileStart[t] = total;
+            for (int c = 0; c < chunks; c++) {
+                size_t n = chunkOffsets[size_t(c) * tiles + t];
+                chunkOffsets[size_t(c) * tiles + t] = total;
+                total += n;
+            }
+        }
+        tileStart[tiles] = total;
+    }
+    bins = scratch.allocate<uint16_t>(total);
+
+    // scatter; every chunk owns its own ranges of the bins
+    pool.run(chunks, [&](int c) {
+        TRACE_SCOPE("bin scatter");
+        size_t* offsets = &chunkOffsets[size_t(c) * tiles];
+        forEachPixel(particles, std::min(capacity * c / chunks, count),
+            std::min(capacity * (c + 1) / chunks, count),
+            [&](int tile, uint16_t pixel) { bins[offsets[tile]++] = pixel; });
+    });
+
+    // accumulate each tile on its own, then copy it into the image
+    pool.run(tiles, [&](int t) {
+        TRACE_SCOPE("tile accumulate");
+        uint32_t acc[tileSize * tileSize] = {};
+        for (size_t i = tileStart[t]; i < tileStart[t + 1]; i++)
+            acc[bins[i]]++;
+
+        int x0 = (t % tilesX) * tileSize, y0 = (t / tilesX) * tileSize;
+        int w = std::min(tileSize, width - x0), h = std::min(tileSize, height - y0);
+        for (int y = 0; y < h; y++)
+            std::copy(&acc[y * tileSize], &acc[y * tileSize + w],
+                    &density[size_t(y0 + y) * width + x0]);
+    });
+}
+
+static float smoothstep(float edge0, float edge1, float x)
+{
+    float t = std::min(std::max((x - edge0) / (edge1 - edge0), 0.0f), 1.0f);
+    return t * t * (3.0f - 2.0f * t);
+}
+
+void SoftRasterizer::accumulate(const uint32_t* other, size_t count)
+{
+    parallelFor(pool, density.size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+            density[i] += other[i];
+    });
+    particleCount += count;
+}
+
+// constants of densityResolveSource in frametarget.cpp
+static const float whitePoint = 64.0f;
+
+static float getMeanDensity(const View& view, int width, int height, size_t particles)
+{
+    float boxPixels = view.scaleX * width * view.scaleY * height;
+    return std::max(particles / boxPixels, 1e-6f);
+}
+
+// counts are integers and everything past the white point is white, so
+// the whole curve fits in a small table
+size_t SoftRasterizer::getLevels(size_t particles) const
+{
+    return size_t(whitePoint * getMeanDensity(view, width, height, particles)) + 2;
+}
+
+void SoftRasterizer::reserve(size_t particles)
+{
+    // renderParticles' offsets and bins, each aligned to 64 bytes; the
+    // chunks split the capacity, which can be more than particles, so take
+    // the most there can be
+    size_t chunks = size_t(getChunks(std::numeric_limits<size_t>::max()));
+    size_t offsets = chunks * tilesX * tilesY * sizeof(size_t);
+    scratch.reserve(offsets + 64 + particles * sizeof(uint16_t) + 64);
+    lut.reserve(3 * getLevels(particles));
+}
+
+void SoftRasterizer::tonemap(unsigned char* rgb) const
+{
+    float meanDensity = getMeanDensity(view, width, height, particleCount);
+    size_t levels = getLevels(particleCount);
+    lut.resize(3 * levels);
+    for (size_t d = 0; d < levels; d++) {
+        float t = std::min(std::log(1.0f + d / meanDensity) / std::log(1.0f + whitePoint), 1.0f);
+        lut[3 * d + 0] = (unsigned char) (255.0f * smoothstep(0.0f, 0.5f, t) + 0.5f);
+        lut[3 * d + 1] = (unsigned char) (255.0f * smoothstep(0.25f, 0.75f, t) + 0.5f);
+        lut[3 * d + 2] = (unsigned char) (255.0f * smoothstep(0.5f, 1.0f, t) + 0.5f);
+    }
+
+    parallelFor(pool, size_t(width) * height, [&](size_t begin, size_t end) {
+        TRACE_SCOPE("tonemap rows");
+        for (size_t i = begin; i < end; i++) {
+            size_t d = std::min<size_t>(density[i], levels - 1);
+            rgb[3 * i + 0] = lut[3 * d + 0];
+            rgb[3 * i + 1] = lut[3 * d + 1];
+            rgb[3 * i + 2] = lut[3 * d + 2];
+        }
+    });
+}
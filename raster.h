@@ -0,0 +1,82 @@
+#ifndef GRAVITY_RASTER_H
+#define GRAVITY_RASTER_H
+
+#include <cstdint>
+#include <vector>
+
+#include "arena.h"
+#include "packed.h"
+#include "particles.h"
+#include "view.h"
+
+class ThreadPool;
+
+// Multithreaded CPU splatting of particles into a density image, framed like
+// the GL view. Particles are first binned into screen tiles and then every
+// tile is accumulated by exactly one task, so no pixel is written by two
+// threads and no atomics are needed. Splats are one pixel, which is what the
+// GL density renderer shrinks to at large particle counts.
+class SoftRasterizer {
+public:
+    SoftRasterizer(ThreadPool& pool, int width, int height);
+
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+
+    // particles per pixel, rows from top to bottom
+    const std::vector<uint32_t>& getDensity() const { return density; }
+
+    // replace the density image with the given particles, the first count
+    // of an array allocated for capacity of them, or just count if that is
+    // more; the binning splits the capacity, so each thread starts on the
+    // share whose pages it placed (see NumaAllocator)
+    void render(const Particle* particles, size_t count, size_t capacity = 0);
+    void render(const PackedParticle* particles, size_t count, size_t capacity = 0);
+
+    // add another density image of the same size, of count particles, as
+    // if they had been rendered too
+    void accumulate(const uint32_t* other, size_t count);
+
+    // tone map the density the same way the GL density resolve does, into
+    // 8-bit RGB with rows from top to bottom
+    void tonemap(unsigned char* rgb) const;
+
+    // make the binning scratch and the tone curve big enough for up to
+    // particles, so that render() and tonemap() allocate nothing as the
+    // live count grows
+    void reserve(size_t particles);
+
+private:
+    static const int tileSize = 64; // 16 KB of counts, stays in L1
+
+    // entries of the tone curve for particles in the image
+    size_t getLevels(size_t particles) const;
+
+    // the chunks render() splits count particles into
+    int getChunks(size_t count) const;
+
+    template <typename P>
+    void renderParticles(const P* particles, size_t count, size_t capacity);
+
+    template <typename P, typename Fn>
+    void forEachPixel(const P* particles, size_t begin, size_t end, Fn fn) const;
+
+    ThreadPool& pool;
+    int width, height;
+    int tilesX, tilesY;
+    View view;
+    size_t particleCount;
+
+    std::vector<uint32_t> density;
+
+    // binning scratch, from an arena emptied every frame
+    Arena scratch;
+    size_t* chunkOffsets; // per chunk and tile
+    uint16_t* bins; // offset of each particle within its tile
+    std::vector<size_t> tileStart;
+
+    // tone curve of the last tonemap, kept so the next one reuses its memory
+    mutable std::vector<unsigned char> lut;
+};
+
+#endif
@@ -0,0 +1,42 @@
+#include "replay.h"
+
+#include <cstdio>
+
+bool loadReplay(const char* path, std::vector<ReplayFrame>& frames)
+{
+    FILE* file = std::fopen(path, "r");
+    if (!file)
+        return false;
+
+    frames.clear();
+    char line[256];
+    bool ok = true;
+    while (std::fgets(line, sizeof(line), file)) {
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        ReplayFrame frame;
+        if (std::sscanf(line, "%f %f %f", &frame.dt, &frame.sourceX, &frame.sourceY) != 3) {
+            ok = false;
+            break;
+        }
+        frames.push_back(frame);
+    }
+
+    std::fclose(file);
+    return ok && !frames.empty();
+}
+
+bool saveReplay(const char* path, const std::vector<ReplayFrame>& frames)
+{
+    FILE* file = std::fopen(path, "w");
+    if (!file)
+        return false;
+
+    // enough digits that a float survives the round trip
+    std::fprintf(file, "# dt x y\n");
+    for (size_t i = 0; i < frames.size(); i++)
+        std::fprintf(file, "%.9g %.9g %.9g\n",
+                frames[i].dt, frames[i].sourceX, frames[i].sourceY);
+
+    return std::fclose(file) == 0;
+}
@@ -0,0 +1,19 @@
+#ifndef GRAVITY_REPLAY_H
+#define GRAVITY_REPLAY_H
+
+#include <vector>
+
+// The input to one simulation step: the timestep and where the gravity
+// source was, in world coordinates.
+struct ReplayFrame {
+    float dt;
+    float sourceX, sourceY;
+};
+
+// Replays are text, one "dt x y" line per frame; lines starting with '#'
+// are comments. Recorded by the interactive app, played back by either
+// runner so a session can be rerun exactly.
+bool loadReplay(const char* path, std::vector<ReplayFrame>& frames);
+bool saveReplay(const char* path, const std::vector<ReplayFrame>& frames);
+
+#endif
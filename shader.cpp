@@ -0,0 +1,91 @@
+#include "shader.h"
+
+#include <iostream>
+#include <vector>
+
+// print source with line numbers, which is what the logs refer to
+static void printSource(const GLchar* source)
+{
+    int line = 1;
+    std::cerr << "    1: ";
+    for (const GLchar* c = source; *c; c++) {
+        std::cerr << *c;
+        if (*c == '\n' && c[1])
+            std::cerr << "    " << ++line << ": ";
+    }
+    std::cerr << std::endl;
+}
+
+GLuint compileShader(GLenum type, const GLchar* source)
+{
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, nullptr);
+    glCompileShader(shader);
+
+    if (checkShader(shader, type, source))
+        return shader;
+    glDeleteShader(shader);
+    return 0;
+}
+
+bool checkShader(GLuint shader, GLenum type, const GLchar* source)
+{
+    GLint status, length;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (status == GL_TRUE)
+        return true;
+
+    glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+    std::vector<GLchar> log(length + 1);
+    glGetShaderInfoLog(shader, length + 1, nullptr, &log[0]);
+    std::cerr << (type == GL_VERTEX_SHADER ? "vertex"
+            : type == GL_GEOMETRY_SHADER ? "geometry"
+            : type == GL_COMPUTE_SHADER ? "compute" : "fragment")
+        << " shader failed to compile:\n" << &log[0] << std::endl;
+    printSource(source);
+    return false;
+}
+
+bool linkProgram(GLuint program)
+{
+    glLinkProgram(program);
+    return checkProgram(program);
+}
+
+bool checkProgram(GLuint program)
+{
+    GLint status, length;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status == GL_TRUE)
+        return true;
+
+    glGetProgramiv(program, GL_INFO_LOG_LENGTH, &length);
+    std::vector<GLchar> log(length + 1);
+    glGetProgramInfoLog(program, length + 1, nullptr, &log[0]);
+    std::cerr << "program failed to link:\n" << &log[0] << std::endl;
+    return false;
+}
+
+GLuint createProgram(const GLchar* vertexSource, const GLchar* fragmentSource,
+        const GLchar* const* attributes)
+{
+    GLuint vertexShader = compileShader(GL_VERTEX_SHADER, vertexSource);
+    GLuint fragmentShader = compileShader(GL_FRAGMENT_SHADER, fragmentSource);
+
+    GLuint program = 0;
+    if (vertexShader && fragmentShader) {
+        program = glCreateProgram();
+        glAttachShader(program, vertexShader);
+        glAttachShader(program, fragmentShader);
+        for (GLuint i = 0; attributes && attributes[i]; i++)
+            glBindAttribLocation(program, i, attributes[i]);
+        if (!linkProgram(program)) {
+            glDeleteProgram(program);
+            program = 0;
+        }
+    }
+
+    glDeleteShader(vertexShader);
+    glDeleteShader(fragmentShader);
+    return program;
+}
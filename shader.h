@@ -0,0 +1,23 @@
+#ifndef GRAVITY_SHADER_H
+#define GRAVITY_SHADER_H
+
+#include <GL/glew.h>
+
+// compile a shader, or print the info log to stderr and return 0
+GLuint compileShader(GLenum type, const GLchar* source);
+
+// link a program, or print the info log to stderr and return false
+bool linkProgram(GLuint program);
+
+// the checks of the two above, for shaders and programs that were started
+// without waiting for them; these wait
+bool checkShader(GLuint shader, GLenum type, const GLchar* source);
+bool checkProgram(GLuint program);
+
+// compile and link a program; the shaders are flagged for deletion with it.
+// attributes, if given, is a null terminated list of vertex attribute names
+// to bind to locations 0, 1, ... Returns 0, having printed why, on failure.
+GLuint createProgram(const GLchar* vertexSource, const GLchar* fragmentSource,
+        const GLchar* const* attributes = nullptr);
+
+#endif
@@ -0,0 +1,30 @@
+#include "simulate.h"
+
+#include <random>
+
+std::vector<Particle> randomParticles(size_t count, unsigned seed)
+{
+    std::vector<Particle> particles(count);
+    std::default_random_engine generator(seed); // random engine
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+    for (size_t i = 0; i < count; i++) {
+        particles[i].x = dist(generator);
+        particles[i].y = dist(generator);
+        particles[i].vx = 0.0f;
+        particles[i].vy = 0.0f;
+    }
+    return particles;
+}
+
+void stepParticles(Particle* particles, size_t count,
+        float dt, float sourceX, float sourceY)
+{
+    stepParticles(CursorField(Gravity(sourceX, sourceY)), particles, count, dt);
+}
+
+void stepParticles(ThreadPool& pool, Particle* particles, size_t count,
+        float dt, float sourceX, float sourceY)
+{
+    stepParticles(pool, CursorField(Gravity(sourceX, sourceY)), particles, count, dt);
+}
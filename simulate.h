@@ -0,0 +1,155 @@
+#ifndef GRAVITY_SIMULATE_H
+#define GRAVITY_SIMULATE_H
+
+#include <algorithm>
+
+#include "diagnostics.h"
+#include "forces.h"
+#include "packed.h"
+#include "particles.h"
+#include "threadpool.h"
+#include "trace.h"
+
+// Advance one particle by dt under a force field, exactly as the vertex
+// shader generated from the same field does: v += dt*a, x += dt*v, then
+// bounce off the walls of the box.
+template <typename Field>
+inline Particle stepParticle(const Field& field, Particle p, float dt)
+{
+    const float reflectLoss = 0.5f;
+
+    // -0 + a == a exactly, so the compiler can drop the first add
+    float ax = -0.0f, ay = -0.0f;
+    field.accelerate(p.x, p.y, p.vx, p.vy, ax, ay);
+
+    float vx = p.vx + dt*ax;
+    float vy = p.vy + dt*ay;
+    float x = p.x + dt*vx;
+    float y = p.y + dt*vy;
+
+    // reflect() flips one component, the loss scales both; selects
+    // rather than branches, since which particles bounce is random
+    bool outX = x < -1.0f || x > 1.0f;
+    vx = outX ? -reflectLoss*vx : vx;
+    vy = outX ? reflectLoss*vy : vy;
+    bool outY = y < -1.0f || y > 1.0f;
+    vx = outY ? reflectLoss*vx : vx;
+    vy = outY ? -reflectLoss*vy : vy;
+
+    Particle next = { x, y, vx, vy };
+    return next;
+}
+
+// Advance particles by dt. Safe to call on disjoint ranges from several
+// threads.
+template <typename Field>
+void stepParticles(const Field& field, Particle* particles, size_t count, float dt)
+{
+    // a local copy, which the stores to particles cannot alias, so the
+    // parameters stay in registers
+    const Field local = field;
+
+    for (size_t i = 0; i < count; i++)
+        particles[i] = stepParticle(local, particles[i], dt);
+}
+
+// the same on packed particles, unpacking and packing each as the COMPACT
+// shader does
+template <typename Field>
+void stepParticles(const Field& field, PackedParticle* particles, size_t count, float dt)
+{
+    const Field local = field;
+
+    for (size_t i = 0; i < count; i++)
+        particles[i] = packParticle(stepParticle(local, unpackParticle(particles[i]), dt));
+}
+
+// the same, split across the pool, with each thread starting on its share
+// of an array allocated for capacity particles, the share whose pages it
+// placed (see NumaAllocator), however many of them are live
+template <typename Field, typename P>
+void stepParticles(ThreadPool& pool, const Field& field, P* particles, size_t count,
+        size_t capacity, float dt)
+{
+    parallelFor(pool, count, capacity, [&field, particles, dt](size_t begin, size_t end) {
+        TRACE_SCOPE("step chunk");
+        stepParticles(field, particles + begin, end - begin, dt);
+    });
+}
+
+template <typename Field, typename P>
+void stepParticles(ThreadPool& pool, const Field& field, P* particles, size_t count, float dt)
+{
+    stepParticles(pool, field, particles, count, count, dt);
+}
+
+// Advance particles and add the stepped ones' diagnostics in, a chunk at a
+// time while the chunk is still in cache, so that they cost no further
+// pass over memory.
+
+template <typename Field>
+void stepParticles(const Field& field, Particle* particles, size_t count, float dt,
+        Diagnostics* diagnostics)
+{
+    for (size_t begin = 0; begin < count; begin += diagnosticsChunk) {
+        size_t n = std::min(diagnosticsChunk, count - begin);
+        stepParticles(field, particles + begin, n, dt);
+        addDiagnostics(particles + begin, n, diagnostics);
+    }
+}
+
+// packed ones are added up as stepped, before packing
+template <typename Field>
+void stepParticles(const Field& field, PackedParticle* particles, size_t count, float dt,
+        Diagnostics* diagnostics)
+{
+    const Field local = field;
+    Particle stepped[diagnosticsChunk];
+    for (size_t begin = 0; begin < count; begin += diagnosticsChunk) {
+        size_t n = std::min(diagnosticsChunk, count - begin);
+        for (size_t i = 0; i < n; i++) {
+            stepped[i] = stepParticle(local, unpackParticle(particles[begin + i]), dt);
+            particles[begin + i] = packParticle(stepped[i]);
+        }
+        addDiagnostics(stepped, n, diagnostics);
+    }
+}
+
+// the same, split across the pool in blocks of whole chunks, whose
+// diagnostics are added up in order; the blocks divide capacity, so each
+// thread starts on the same share as above
+template <typename Field, typename P>
+void stepParticles(ThreadPool& pool, const Field& field, P* particles, size_t count,
+        size_t capacity, float dt, Diagnostics* diagnostics)
+{
+    const int maxBlocks = 256;
+    Diagnostics blocks[maxBlocks];
+    size_t chunks = (std::max(count, capacity) + diagnosticsChunk - 1) / diagnosticsChunk;
+    int numBlocks = int(std::max<size_t>(std::min<size_t>(
+            std::min(16 * pool.size(), maxBlocks), chunks), 1));
+    size_t blockSize = (chunks + numBlocks - 1) / numBlocks * diagnosticsChunk;
+
+    pool.run(numBlocks, [&](int b) {
+        TRACE_SCOPE("step chunk");
+        size_t begin = std::min(b * blockSize, count);
+        size_t end = std::min(begin + blockSize, count);
+        stepParticles(field, particles + begin, end - begin, dt, &blocks[b]);
+    });
+    for (int b = 0; b < numBlocks; b++)
+        diagnostics->merge(blocks[b]);
+}
+
+template <typename Field, typename P>
+void stepParticles(ThreadPool& pool, const Field& field, P* particles, size_t count, float dt,
+        Diagnostics* diagnostics)
+{
+    stepParticles(pool, field, particles, count, count, dt, diagnostics);
+}
+
+// the cursor field, pulling towards the source
+void stepParticles(Particle* particles, size_t count,
+        float dt, float sourceX, float sourceY);
+void stepParticles(ThreadPool& pool, Particle* particles, size_t count,
+        float dt, float sourceX, float sourceY);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef GRAVITY_STATS_H
+#define GRAVITY_STATS_H
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+// Mean and percentiles over the most recent samples of a measurement.
+// All storage is allocated up front.
+class RollingStats {
+public:
+    explicit RollingStats(size_t window = 256)
+        : samples(window), scratch(window), next(0), filled(0) {}
+
+    void add(double value)
+    {
+        samples[next] = value;
+        next = (next + 1) % samples.size();
+        filled = std::min(filled + 1, samples.size());
+    }
+
+    size_t count() const { return filled; }
+
+    double mean() const
+    {
+        double sum = 0.0;
+        for (size_t i = 0; i < filled; i++)
+            sum += samples[i];
+        return filled ? sum / filled : 0.0;
+    }
+
+    // p in [0,1], nearest rank
+    double percentile(double p) const
+    {
+        if (!filled)
+            return 0.0;
+        std::copy(samples.begin(), samples.begin() + filled, scratch.begin());
+        size_t rank = std::min(size_t(p * filled), filled - 1);
+        std::nth_element(scratch.begin(), scratch.begin() + rank, scratch.begin() + filled);
+        return scratch[rank];
+    }
+
+private:
+    std::vector<double> samples;
+    mutable std::vector<double> scratch;
+    size_t next, filled;
+};
+
+#endif
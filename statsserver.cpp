@@ -0,0 +1,317 @@
+#include "statsserver.h"
+#include "trace.h"
+
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+const int maxClients = 8;
+
+// how late a line may go out; publishing never wakes the thread, so that
+// it costs the frame loop no system call
+const int pollMs = 10;
+
+const size_t reportBytes = 512; // a formatted report, at most
+const size_t numberBytes = 16; // a %.5g and its comma, at most
+
+void setNonBlocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+// JSON has no infinities or NaNs
+int printNumber(char* out, size_t size, const char* format, double value)
+{
+    if (!std::isfinite(value))
+        return std::snprintf(out, size, "null");
+    return std::snprintf(out, size, format, value);
+}
+
+size_t formatReport(const FrameReport& report, char* line, size_t size)
+{
+    int n = std::snprintf(line, size, "{\"frame\":%llu,\"particles\":%llu,\"frameMs\":",
+            (unsigned long long) report.frame, (unsigned long long) report.particles);
+    n += printNumber(line + n, size - n, "%.3f", report.frameMs);
+    if (report.stepMs >= 0.0) {
+        n += std::snprintf(line + n, size - n, ",\"stepMs\":");
+        n += printNumber(line + n, size - n, "%.3f", report.stepMs);
+    }
+    const Diagnostics& d = report.diagnostics;
+    if (d.count > 0) {
+        n += std::snprintf(line + n, size - n,
+                ",\"diagnostics\":{\"frame\":%llu,\"particles\":%llu,\"energy\":",
+                (unsigned long long) report.diagnosticsFrame, (unsigned long long) d.count);
+        n += printNumber(line + n, size - n, "%.9g", d.energy);
+        n += std::snprintf(line + n, size - n, ",\"momentum\":[");
+        n += printNumber(line + n, size - n, "%.9g", d.momentumX);
+        n += std::snprintf(line + n, size - n, ",");
+        n += printNumber(line + n, size - n, "%.9g", d.momentumY);
+        n += std::snprintf(line + n, size - n, "],\"box\":[");
+        const float box[4] = { d.minX, d.minY, d.maxX, d.maxY };
+        for (int k = 0; k < 4; k++) {
+            n += printNumber(line + n, size - n, "%.6g", box[k]);
+            n += std::snprintf(line + n, size - n, k < 3 ? "," : "]}");
+        }
+    }
+    n += std::snprintf(line + n, size - n, "}\n");
+    return size_t(n);
+}
+
+} // namespace
+
+StatsServer::StatsServer(int listener, const std::string& unixPath, int snapshotInterval,
+        size_t snapshotPoints)
+    : listener(listener), unixPath(unixPath), snapshotInterval(snapshotInterval),
+      snapshotPoints(snapshotPoints), head(0), tail(0), droppedReports(0), back(0),
+      front(1), middle(2), connected(0), clients(0), dropped(0), stopping(false)
+{
+    // a connection has room for a snapshot and a backlog of reports
+    size_t snapshotBytes = snapshotInterval > 0
+        ? reportBytes + 2 * snapshotPoints * numberBytes : 0;
+    lineBuffer.resize(std::max(reportBytes, snapshotBytes));
+    for (int i = 0; i < 3; i++) {
+        snapshots[i].frame = snapshots[i].count = 0;
+        snapshots[i].points = 0;
+        if (snapshotInterval > 0)
+            snapshots[i].positions.resize(2 * snapshotPoints);
+    }
+    clientSlots.resize(maxClients);
+    for (size_t i = 0; i < clientSlots.size(); i++) {
+        clientSlots[i].fd = -1;
+        clientSlots[i].buffer.resize(snapshotBytes + ringSize * reportBytes);
+        clientSlots[i].begin = clientSlots[i].end = 0;
+    }
+    thread = std::thread(&StatsServer::run, this);
+}
+
+StatsServer::~StatsServer()
+{
+    stopping.store(true);
+    thread.join();
+    for (size_t i = 0; i < clientSlots.size(); i++)
+        if (clientSlots[i].fd >= 0)
+            disconnect(clientSlots[i]);
+    ::close(listener);
+    if (!unixPath.empty())
+        unlink(unixPath.c_str());
+}
+
+std::unique_ptr<StatsServer> StatsServer::create(const std::string& address,
+        int snapshotInterval, size_t snapshotPoints)
+{
+    int listener = -1;
+    std::string unixPath;
+    if (address.compare(0, 5, "unix:") == 0) {
+        unixPath = address.substr(5);
+        sockaddr_un local;
+        std::memset(&local, 0, sizeof(local));
+        local.sun_family = AF_UNIX;
+        if (unixPath.empty() || unixPath.size() >= sizeof(local.sun_path)) {
+            std::cerr << "bad socket path " << unixPath << std::endl;
+            return nullptr;
+        }
+        std::strcpy(local.sun_path, unixPath.c_str());
+        // a socket left behind by a run that did not exit cleanly
+        struct stat info;
+        if (stat(unixPath.c_str(), &info) == 0 && S_ISSOCK(info.st_mode))
+            unlink(unixPath.c_str());
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener < 0 || bind(listener, (sockaddr*) &local, sizeof(local)) != 0
+                || listen(listener, maxClients) != 0) {
+            std::cerr << "failed to listen on " << unixPath << ": " << std::strerror(errno)
+                << std::endl;
+            if (listener >= 0)
+                ::close(listener);
+            return nullptr;
+        }
+    } else {
+        char* end;
+        long port = std::strtol(address.c_str(), &end, 10);
+        if (address.empty() || *end || port < 1 || port > 65535) {
+            std::cerr << "bad stats server address " << address
+                << ", expected unix:PATH or a port" << std::endl;
+            return nullptr;
+        }
+        sockaddr_in loopback;
+        std::memset(&loopback, 0, sizeof(loopback));
+        loopback.sin_family = AF_INET;
+        loopback.sin_port = htons(uint16_t(port));
+        loopback.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        int yes = 1;
+        if (listener < 0
+                || setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) != 0
+                || bind(listener, (sockaddr*) &loopback, sizeof(loopback)) != 0
+                || listen(listener, maxClients) != 0) {
+            std::cerr << "failed to listen on port " << port << ": " << std::strerror(errno)
+                << std::endl;
+            if (listener >= 0)
+                ::close(listener);
+            return nullptr;
+        }
+    }
+    setNonBlocking(listener);
+    return std::unique_ptr<StatsServer>(new StatsServer(listener, unixPath,
+                std::max(snapshotInterval, 0), std::max<size_t>(snapshotPoints, 1)));
+}
+
+void StatsServer::publish(const FrameReport& report)
+{
+    uint64_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) == ringSize) {
+        droppedReports++;
+        return;
+    }
+    reports[h & (ringSize - 1)] = report;
+    head.store(h + 1, std::memory_order_release);
+}
+
+void StatsServer::run()
+{
+    TRACE_THREAD_NAME("stats server");
+    pollfd fds[1 + maxClients];
+    int slots[1 + maxClients];
+    char discard[256];
+    for (;;) {
+        bool last = stopping.load();
+
+        int n = 0;
+        fds[n++] = { listener, POLLIN, 0 };
+        for (int i = 0; i < maxClients; i++) {
+            const Client& client = clientSlots[i];
+            if (client.fd < 0)
+                continue;
+            short events = POLLIN | (client.end > client.begin ? POLLOUT : 0);
+            slots[n] = i;
+            fds[n++] = { client.fd, events, 0 };
+        }
+        if (!last && poll(fds, n, pollMs) < 0 && errno != EINTR) {
+            std::cerr << "stats server poll failed: " << std::strerror(errno) << std::endl;
+            return;
+        }
+
+        // what clients send is ignored; they only go away
+        for (int k = 1; k < n; k++) {
+            Client& client = clientSlots[slots[k]];
+            if (fds[k].revents & (POLLERR | POLLNVAL)) {
+                disconnect(client);
+            } else if (fds[k].revents & (POLLIN | POLLHUP)) {
+                ssize_t received = recv(client.fd, discard, sizeof(discard), 0);
+                if (received == 0 || (received < 0 && errno != EAGAIN && errno != EINTR))
+                    disconnect(client);
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            int fd;
+            while ((fd = accept(listener, nullptr, nullptr)) >= 0) {
+                Client* slot = nullptr;
+                for (int i = 0; i < maxClients && !slot; i++)
+                    if (clientSlots[i].fd < 0)
+                        slot = &clientSlots[i];
+                if (!slot) {
+                    ::close(fd);
+                    continue;
+                }
+                setNonBlocking(fd);
+                slot->fd = fd;
+                slot->begin = slot->end = 0;
+                connected.fetch_add(1, std::memory_order_relaxed);
+                clients.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        collect();
+        for (int i = 0; i < maxClients; i++)
+            if (clientSlots[i].fd >= 0)
+                flush(clientSlots[i]);
+        if (last)
+            return;
+    }
+}
+
+void StatsServer::collect()
+{
+    char* line = lineBuffer.data();
+
+    uint64_t t = tail.load(std::memory_order_relaxed);
+    uint64_t h = head.load(std::memory_order_acquire);
+    for (; t < h; t++)
+        broadcast(line, formatReport(reports[t & (ringSize - 1)], line, reportBytes));
+    tail.store(t, std::memory_order_release);
+
+    if (!(middle.load(std::memory_order_relaxed) & freshBit))
+        return;
+    front = middle.exchange(front, std::memory_order_acq_rel) & ~freshBit;
+    const Snapshot& snapshot = snapshots[front];
+    size_t size = lineBuffer.size();
+    int n = std::snprintf(line, size, "{\"snapshot\":%llu,\"particles\":%llu,\"positions\":[",
+            (unsigned long long) snapshot.frame, (unsigned long long) snapshot.count);
+    for (size_t i = 0; i < 2 * snapshot.points; i++) {
+        n += printNumber(line + n, size - n, "%.5g", snapshot.positions[i]);
+        if (i + 1 < 2 * snapshot.points)
+            line[n++] = ',';
+    }
+    n += std::snprintf(line + n, size - n, "]}\n");
+    broadcast(line, size_t(n));
+}
+
+void StatsServer::broadcast(const char* line, size_t length)
+{
+    for (int i = 0; i < maxClients; i++) {
+        Client& client = clientSlots[i];
+        if (client.fd < 0)
+            continue;
+        if (client.buffer.size() - (client.end - client.begin) < length) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        if (client.buffer.size() - client.end < length) {
+            std::memmove(&client.buffer[0], &client.buffer[client.begin],
+                    client.end - client.begin);
+            client.end -= client.begin;
+            client.begin = 0;
+        }
+        std::memcpy(&client.buffer[client.end], line, length);
+        client.end += length;
+    }
+}
+
+void StatsServer::flush(Client& client)
+{
+    while (client.end > client.begin) {
+        ssize_t sent = send(client.fd, &client.buffer[client.begin], client.end - client.begin,
+                MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (sent <= 0) {
+            disconnect(client);
+            return;
+        }
+        client.begin += sent;
+    }
+    client.begin = client.end = 0;
+}
+
+void StatsServer::disconnect(Client& client)
+{
+    ::close(client.fd);
+    client.fd = -1;
+    client.begin = client.end = 0;
+    connected.fetch_sub(1, std::memory_order_relaxed);
+}
@@ -0,0 +1,145 @@
+#ifndef GRAVITY_STATSSERVER_H
+#define GRAVITY_STATSSERVER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "diagnostics.h"
+#include "packed.h"
+
+// What a run reports of each frame to a StatsServer's clients. The
+// diagnostics need not be of the particles counted at the end of the frame:
+// gravity-headless works them out as it steps, before births and deaths,
+// and gravity gets them from the GPU two frames late. They go out with their
+// own frame and particle count.
+struct FrameReport {
+    uint64_t frame;
+    double frameMs;
+    double stepMs; // negative if not measured
+    uint64_t particles; // live at the end of the frame
+    Diagnostics diagnostics; // left out if its count is 0
+    uint64_t diagnosticsFrame; // the step they were worked out in
+};
+
+// Streams a run's FrameReports, and every snapshotInterval frames the
+// positions of up to snapshotPoints evenly spread particles, to the clients
+// of a Unix domain socket or of a TCP port on the loopback interface, one
+// line of JSON each. The frame loop only copies into buffers made up front
+// and publishes them with an atomic store: a single-producer ring for the
+// reports and a triple buffer for the snapshots. The server's own thread
+// polls for them, formats them and sends them without blocking. A client
+// that falls behind loses whole lines and a server thread that falls
+// behind loses whole reports, so nobody holds up a frame. Nothing is
+// allocated after create(), so the frame loop of --no-alloc can publish.
+class StatsServer {
+public:
+    // address is unix:PATH or a port number; nullptr, having printed why,
+    // if it cannot listen. A snapshotInterval of 0 sends no snapshots.
+    static std::unique_ptr<StatsServer> create(const std::string& address,
+            int snapshotInterval = 0, size_t snapshotPoints = 4096);
+
+    // sends what has been published and closes the connections
+    ~StatsServer();
+
+    StatsServer(const StatsServer&) = delete;
+    StatsServer& operator=(const StatsServer&) = delete;
+
+    // from one thread, the frame loop's
+    void publish(const FrameReport& report);
+
+    // whether a snapshot is due this frame and anybody is connected to get it
+    bool wantsSnapshot(uint64_t frame) const
+    {
+        return snapshotInterval > 0 && frame % snapshotInterval == 0
+            && connected.load(std::memory_order_relaxed) > 0;
+    }
+
+    // every stride'th of particles[0, count), from the same thread as publish()
+    template <typename P>
+    void publishSnapshot(uint64_t frame, const P* particles, size_t count);
+
+    // clients that ever connected, and lines any of them lost
+    uint64_t getClients() const { return clients.load(std::memory_order_relaxed); }
+    uint64_t getDropped() const
+    {
+        return dropped.load(std::memory_order_relaxed) + droppedReports;
+    }
+
+private:
+    static const size_t ringSize = 64; // reports, a power of two
+    static const int freshBit = 4;
+
+    struct Snapshot {
+        uint64_t frame;
+        uint64_t count;
+        size_t points;
+        std::vector<float> positions; // x, y of each point
+    };
+
+    // what is still to go out to a connection, buffer[begin, end)
+    struct Client {
+        int fd; // -1 for a free slot
+        std::vector<char> buffer;
+        size_t begin, end;
+    };
+
+    StatsServer(int listener, const std::string& unixPath, int snapshotInterval,
+            size_t snapshotPoints);
+
+    void run();
+    void collect();
+    void broadcast(const char* line, size_t length);
+    void flush(Client& client);
+    void disconnect(Client& client);
+
+    int listener;
+    std::string unixPath; // to unlink, if a Unix socket
+    int snapshotInterval;
+    size_t snapshotPoints;
+
+    // written by publish(), read by the server thread. The counters are a
+    // cache line apart, each written by one side; alignas would need the
+    // aligned new of C++17.
+    FrameReport reports[ringSize];
+    std::atomic<uint64_t> head; // reports published
+    char headPadding[64];
+    std::atomic<uint64_t> tail; // reports sent on
+    char tailPadding[64];
+    uint64_t droppedReports;
+
+    // publishSnapshot() fills back, then swaps it with the middle, marking
+    // that fresh; the thread swaps a fresh middle with front
+    Snapshot snapshots[3];
+    int back, front;
+    std::atomic<int> middle;
+
+    std::vector<Client> clientSlots;
+    std::vector<char> lineBuffer;
+    std::atomic<int> connected;
+    std::atomic<uint64_t> clients, dropped;
+    std::atomic<bool> stopping;
+    std::thread thread;
+};
+
+template <typename P>
+void StatsServer::publishSnapshot(uint64_t frame, const P* particles, size_t count)
+{
+    Snapshot& snapshot = snapshots[back];
+    size_t stride = std::max<size_t>(1, (count + snapshotPoints - 1) / snapshotPoints);
+    size_t points = 0;
+    for (size_t i = 0; i < count; i += stride, points++)
+        getPosition(particles[i], &snapshot.positions[2 * points],
+                &snapshot.positions[2 * points + 1]);
+    snapshot.frame = frame;
+    snapshot.count = count;
+    snapshot.points = points;
+    back = middle.exchange(back | freshBit, std::memory_order_acq_rel) & ~freshBit;
+}
+
+#endif
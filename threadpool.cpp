@@ -0,0 +1,334 @@
+#include "threadpool.h"
+#include "numa.h"
+#include "trace.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static long currentThreadId()
+{
+#ifdef __linux__
+    return syscall(SYS_gettid);
+#else
+    return 0;
+#endif
+}
+
+struct ThreadPool::Range {
+    size_t begin, end;
+};
+
+// Chase-Lev work-stealing deque of fixed size, with the memory orders of
+// Le et al., "Correct and Efficient Work-Stealing for Weak Memory Models".
+// Only its thread pushes and pops, at the bottom; anyone steals from the
+// top. Ranges are only ever split in half, so a thread never has more
+// pending than the bits of a size_t.
+class ThreadPool::RangeDeque {
+public:
+    RangeDeque() : top(0), bottom(0) {}
+
+    // false when full
+    bool push(const Range& range)
+    {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        if (b - t >= capacity)
+            return false;
+        Item& item = items[b & (capacity - 1)];
+        item.begin.store(range.begin, std::memory_order_relaxed);
+        item.end.store(range.end, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // the newest range
+    bool pop(Range& range)
+    {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+        if (t > b) {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+        read(b, range);
+        if (t < b)
+            return true;
+
+        // the last one, which a thief may be taking too
+        bool won = top.compare_exchange_strong(t, t + 1,
+                std::memory_order_seq_cst, std::memory_order_relaxed);
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return won;
+    }
+
+    // the oldest range, from any thread
+    bool steal(Range& range)
+    {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b)
+            return false;
+        read(t, range);
+        return top.compare_exchange_strong(t, t + 1,
+                std::memory_order_seq_cst, std::memory_order_relaxed);
+    }
+
+private:
+    static const int64_t capacity = 64;
+
+    struct Item {
+        std::atomic<size_t> begin, end;
+    };
+
+    void read(int64_t index, Range& range)
+    {
+        const Item& item = items[index & (capacity - 1)];
+        range.begin = item.begin.load(std::memory_order_relaxed);
+        range.end = item.end.load(std::memory_order_relaxed);
+    }
+
+    // each end written by different threads, on its own cache line
+    std::atomic<int64_t> top;
+    char pad0[64 - sizeof(std::atomic<int64_t>)];
+    std::atomic<int64_t> bottom;
+    char pad1[64 - sizeof(std::atomic<int64_t>)];
+    Item items[capacity];
+};
+
+struct ThreadPool::Slot {
+    RangeDeque deque;
+    int node;
+    std::vector<int> victims; // threads to steal from, nearest first
+};
+
+ThreadPool::ThreadPool(int threads, bool pin)
+    : started(1), rangeCall(nullptr), eachCall(nullptr), task(nullptr), grain(1),
+      generation(0), busy(0), stopping(false), remaining(0)
+{
+    if (threads <= 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+
+    std::vector<int> cpus;
+    if (pin && (cpus = numaCpus()).empty())
+        std::cerr << "no CPUs to pin the pool to" << std::endl;
+    if (!cpus.empty() && !pinThread(std::vector<int>(1, cpus[0])))
+        std::cerr << "failed to pin to CPU " << cpus[0] << std::endl;
+
+    threadIds.resize(threads);
+    threadIds[0] = currentThreadId();
+    for (int i = 0; i < threads; i++)
+        slots.push_back(std::unique_ptr<Slot>(new Slot()));
+    slots[0]->node = currentNumaNode();
+
+    for (int i = 1; i < threads; i++) {
+        int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+        workers.push_back(std::thread(&ThreadPool::work, this, i, cpu));
+    }
+
+    // once every worker knows its node, steal from the same node first,
+    // each thread starting from its neighbour so thieves spread out
+    std::unique_lock<std::mutex> lock(mutex);
+    ready.wait(lock, [this] { return started == int(threadIds.size()); });
+    for (int i = 0; i < threads; i++) {
+        for (int pass = 0; pass < 2; pass++) {
+            for (int k = 1; k < threads; k++) {
+                int victim = (i + k) % threads;
+                bool local = slots[victim]->node == slots[i]->node;
+                if (local == (pass == 0))
+                    slots[i]->victims.push_back(victim);
+            }
+        }
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+}
+
+void ThreadPool::runIndices(int count, IndexCall call, const void* task)
+{
+    if (workers.empty() || count <= 1) {
+        for (int i = 0; i < count; i++)
+            call(task, i);
+        return;
+    }
+    run(size_t(count), 1, [call, task](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+            call(task, int(i));
+    });
+}
+
+void ThreadPool::runRanges(size_t count, size_t capacity, size_t grain, RangeCall call,
+        const void* task)
+{
+    grain = std::max<size_t>(grain, 1);
+    if (workers.empty() || count <= grain) {
+        for (size_t begin = 0; begin < count; begin += grain)
+            call(task, begin, std::min(begin + grain, count));
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        rangeCall = call;
+        this->task = task;
+        this->grain = grain;
+        remaining.store(count, std::memory_order_relaxed);
+        busy = int(workers.size());
+
+        // the workers are all waiting, so their deques are ours to fill
+        for (int i = 0; i < size(); i++) {
+            Range share = { std::min(shareBegin(capacity, i), count),
+                    std::min(shareBegin(capacity, i + 1), count) };
+            if (share.begin < share.end)
+                slots[i]->deque.push(share);
+        }
+        generation++;
+    }
+    wake.notify_all();
+
+    drain(0);
+
+    // the batch's task lives on our caller's stack, so wait for every
+    // worker to let go
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return busy == 0; });
+    rangeCall = nullptr;
+    this->task = nullptr;
+}
+
+void ThreadPool::runEach(IndexCall call, const void* task)
+{
+    if (workers.empty()) {
+        call(task, 0);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        eachCall = call;
+        this->task = task;
+        busy = int(workers.size());
+        generation++;
+    }
+    wake.notify_all();
+
+    call(task, 0);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return busy == 0; });
+    eachCall = nullptr;
+    this->task = nullptr;
+}
+
+int ThreadPool::getNode(int index) const
+{
+    return slots[index]->node;
+}
+
+std::vector<long> ThreadPool::getThreadIds()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    ready.wait(lock, [this] { return started == int(threadIds.size()); });
+#ifdef __linux__
+    return threadIds;
+#else
+    return std::vector<long>();
+#endif
+}
+
+// run and steal until every index of the batch has run
+void ThreadPool::drain(int index)
+{
+    Range range;
+    while (remaining.load(std::memory_order_acquire) > 0) {
+        if (slots[index]->deque.pop(range) || steal(index, range))
+            execute(index, range);
+        else
+            std::this_thread::yield();
+    }
+}
+
+bool ThreadPool::steal(int index, Range& range)
+{
+    const std::vector<int>& victims = slots[index]->victims;
+    for (size_t i = 0; i < victims.size(); i++)
+        if (slots[victims[i]]->deque.steal(range))
+            return true;
+    return false;
+}
+
+void ThreadPool::execute(int index, Range range)
+{
+    // leave the upper halves for later, or for thieves, down to one piece
+    while (range.end - range.begin > grain) {
+        Range upper = { range.begin + (range.end - range.begin) / 2, range.end };
+        if (!slots[index]->deque.push(upper))
+            break;
+        range.end = upper.begin;
+    }
+
+    // more than one piece only if the deque was full
+    for (size_t begin = range.begin; begin < range.end; begin += grain)
+        rangeCall(task, begin, std::min(begin + grain, range.end));
+    remaining.fetch_sub(range.end - range.begin, std::memory_order_acq_rel);
+}
+
+void ThreadPool::work(int index, int cpu)
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "worker %d", index);
+    TRACE_THREAD_NAME(name);
+
+    if (cpu >= 0 && !pinThread(std::vector<int>(1, cpu)))
+        std::cerr << "failed to pin worker " << index << " to CPU " << cpu << std::endl;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        threadIds[index] = currentThreadId();
+        slots[index]->node = currentNumaNode();
+        if (++started == int(threadIds.size()))
+            ready.notify_all();
+    }
+
+    unsigned seen = 0;
+    for (;;) {
+        IndexCall each;
+        const void* eachTask;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping)
+                return;
+            seen = generation;
+            each = eachCall;
+            eachTask = task;
+        }
+
+        if (each)
+            each(eachTask, index);
+        else
+            drain(index);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--busy == 0)
+            done.notify_one();
+    }
+}
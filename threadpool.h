@@ -0,0 +1,153 @@
+#ifndef GRAVITY_THREADPOOL_H
+#define GRAVITY_THREADPOOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads running one batch of tasks at a time. The
+// calling thread works on the batch too, so a pool of size 1 has no workers.
+//
+// A batch is a range of indices, split in halves on demand. Each thread
+// keeps the halves it has not got to yet in its own Chase-Lev deque and
+// works from the newest; a thread that runs out steals the oldest, and so
+// largest, half from another one. Uneven batches, like the tiles of a
+// clustered frame, even out without a shared queue. Thieves try the threads
+// on their own NUMA node before the others.
+//
+// Each thread starts a batch on its own share of the range, the same share
+// every batch of that length, so data it first touched is stepped on its
+// node (see NumaAllocator) unless it is stolen. Batches over the live part
+// of a larger array can take their shares from the array's capacity, so
+// they stay put as the live count changes.
+class ThreadPool {
+public:
+    // 0 uses one thread per hardware thread; pinned, thread i (0 is the
+    // caller) stays on the i-th CPU the process may use, counting node by
+    // node, so that shares and their memory stay on one node and
+    // neighbouring shares share it
+    explicit ThreadPool(int threads = 0, bool pin = false);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const { return int(workers.size()) + 1; }
+
+    // call task(i) for every i in [0, count), returning once all are done
+    template <typename Task>
+    void run(int count, const Task& task) { runIndices(count, &callIndex<Task>, &task); }
+
+    // call task(begin, end) on ranges covering [0, count), none longer
+    // than grain, returning once all are done
+    template <typename Task>
+    void run(size_t count, size_t grain, const Task& task)
+    {
+        runRanges(count, count, grain, &callRange<Task>, &task);
+    }
+
+    // the same, with each thread starting on its share of a batch of
+    // capacity rather than of count, for arrays placed for capacity
+    // elements of which only the first count are in use; threads whose
+    // share lies past count start by stealing
+    template <typename Task>
+    void run(size_t count, size_t capacity, size_t grain, const Task& task)
+    {
+        runRanges(count, std::max(count, capacity), grain, &callRange<Task>, &task);
+    }
+
+    // call task(i) once on thread i, for every thread, returning once all
+    // are done; for work that has to happen on a particular thread
+    template <typename Task>
+    void runOnEach(const Task& task) { runEach(&callIndex<Task>, &task); }
+
+    // start of thread index's share of a batch of count, up to
+    // shareBegin(count, index + 1)
+    size_t shareBegin(size_t count, int index) const { return count * index / size(); }
+
+    // NUMA node thread index was on when it started
+    int getNode(int index) const;
+
+    // operating system ids of the calling thread and the workers, for
+    // per-thread profiling; empty where there is no such thing
+    std::vector<long> getThreadIds();
+
+private:
+    struct Range;
+    class RangeDeque;
+    struct Slot;
+
+    // a task is a function and the caller's lambda to call it on, not a
+    // std::function, which allocates for lambdas of more than two pointers
+    typedef void (*IndexCall)(const void* task, int i);
+    typedef void (*RangeCall)(const void* task, size_t begin, size_t end);
+
+    template <typename Task>
+    static void callIndex(const void* task, int i) { (*static_cast<const Task*>(task))(i); }
+
+    template <typename Task>
+    static void callRange(const void* task, size_t begin, size_t end)
+    {
+        (*static_cast<const Task*>(task))(begin, end);
+    }
+
+    void runIndices(int count, IndexCall call, const void* task);
+    void runRanges(size_t count, size_t capacity, size_t grain, RangeCall call,
+            const void* task);
+    void runEach(IndexCall call, const void* task);
+
+    void work(int index, int cpu);
+    void drain(int index);
+    bool steal(int index, Range& range);
+    void execute(int index, Range range);
+
+    std::vector<std::thread> workers;
+    std::vector<long> threadIds;
+    std::vector<std::unique_ptr<Slot>> slots; // by thread, 0 is the caller
+    int started;
+
+    std::mutex mutex;
+    std::condition_variable wake, done, ready;
+    RangeCall rangeCall;
+    IndexCall eachCall;
+    const void* task;
+    size_t grain;
+    unsigned generation;
+    int busy;
+    bool stopping;
+
+    std::atomic<size_t> remaining; // indices of the batch not run yet
+};
+
+// call fn(begin, end) on contiguous ranges covering [0, count), in pieces
+// small enough for stealing to even out uneven work
+template <typename Fn>
+void parallelFor(ThreadPool& pool, size_t count, Fn fn)
+{
+    size_t grain = std::max<size_t>(count / (16 * pool.size()), 1);
+    if (pool.size() == 1 || count <= grain) {
+        fn(size_t(0), count);
+        return;
+    }
+    pool.run(count, grain, fn);
+}
+
+// the same over the first count of capacity elements, each thread starting
+// on its share of capacity (see ThreadPool::run)
+template <typename Fn>
+void parallelFor(ThreadPool& pool, size_t count, size_t capacity, Fn fn)
+{
+    size_t grain = std::max<size_t>(count / (16 * pool.size()), 1);
+    if (pool.size() == 1 || count <= grain) {
+        fn(size_t(0), count);
+        return;
+    }
+    pool.run(count, capacity, grain, fn);
+}
+
+#endif
@@ -0,0 +1,163 @@
+#include "trace.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace trace {
+
+namespace {
+
+struct Event {
+    const char* name;
+    uint64_t start, end;
+};
+
+// written by its own thread only
+struct ThreadBuffer {
+    ThreadBuffer(unsigned capacity, int tid)
+        : events(capacity), head(0), tid(tid) {}
+
+    std::vector<Event> events;
+    std::atomic<uint64_t> head; // events ever recorded
+    int tid;
+    std::string name;
+};
+
+std::mutex registryMutex;
+std::vector<std::unique_ptr<ThreadBuffer> > registry;
+unsigned bufferCapacity = 1 << 16;
+
+thread_local ThreadBuffer* localBuffer = nullptr;
+
+// the thread's name until its first event makes the buffer, so that
+// threads of a run that is never traced allocate nothing
+thread_local char localName[64];
+
+ThreadBuffer* getBuffer()
+{
+    if (!localBuffer) {
+        // first event on this thread, the only time recording locks
+        std::lock_guard<std::mutex> lock(registryMutex);
+        registry.push_back(std::unique_ptr<ThreadBuffer>(
+                new ThreadBuffer(bufferCapacity, int(registry.size()) + 1)));
+        localBuffer = registry.back().get();
+        localBuffer->name = localName;
+    }
+    return localBuffer;
+}
+
+void writeEscaped(FILE* file, const char* text)
+{
+    for (; *text; text++) {
+        if (*text == '"' || *text == '\\')
+            std::fputc('\\', file);
+        std::fputc(*text, file);
+    }
+}
+
+} // namespace
+
+std::atomic<bool> enabled(false);
+
+uint64_t now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void start(unsigned capacity)
+{
+    // keep the ring a power of two
+    unsigned rounded = 1;
+    while (rounded < capacity)
+        rounded <<= 1;
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        bufferCapacity = rounded;
+    }
+    enabled.store(true);
+}
+
+void stop()
+{
+    enabled.store(false);
+}
+
+void record(const char* name, uint64_t start, uint64_t end)
+{
+    ThreadBuffer* buffer = getBuffer();
+    uint64_t head = buffer->head.load(std::memory_order_relaxed);
+    Event& event = buffer->events[head & (buffer->events.size() - 1)];
+    event.name = name;
+    event.start = start;
+    event.end = end;
+    buffer->head.store(head + 1, std::memory_order_release);
+}
+
+void setThreadName(const char* name)
+{
+    if (localBuffer) {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        localBuffer->name = name;
+        return;
+    }
+    std::strncpy(localName, name, sizeof(localName) - 1);
+    localName[sizeof(localName) - 1] = '\0';
+}
+
+bool writeChromeTrace(const char* path, uint64_t since)
+{
+    FILE* file = std::fopen(path, "w");
+    if (!file)
+        return false;
+
+    std::vector<Event> events;
+    std::lock_guard<std::mutex> lock(registryMutex);
+
+    std::fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool first = true;
+    for (size_t i = 0; i < registry.size(); i++) {
+        const ThreadBuffer& buffer = *registry[i];
+        uint64_t capacity = buffer.events.size();
+
+        // copy out what the ring holds, then drop anything the owning
+        // thread may have overwritten in the meantime, including the slot
+        // of event after, which it may be writing before publishing it
+        uint64_t head = buffer.head.load(std::memory_order_acquire);
+        uint64_t tail = head > capacity ? head - capacity : 0;
+        events.clear();
+        for (uint64_t j = tail; j < head; j++)
+            events.push_back(buffer.events[j & (capacity - 1)]);
+        uint64_t after = buffer.head.load(std::memory_order_acquire);
+        size_t skip = after + 1 > capacity + tail ? size_t(after + 1 - capacity - tail) : 0;
+
+        if (!buffer.name.empty()) {
+            std::fprintf(file, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,"
+                    "\"tid\":%d,\"args\":{\"name\":\"", first ? "" : ",\n", buffer.tid);
+            writeEscaped(file, buffer.name.c_str());
+            std::fprintf(file, "\"}}");
+            first = false;
+        }
+
+        for (size_t j = skip; j < events.size(); j++) {
+            const Event& event = events[j];
+            if (event.end < since)
+                continue;
+            std::fprintf(file, "%s{\"ph\":\"X\",\"name\":\"", first ? "" : ",\n");
+            writeEscaped(file, event.name);
+            std::fprintf(file, "\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    buffer.tid, event.start * 1e-3, (event.end - event.start) * 1e-3);
+            first = false;
+        }
+    }
+    std::fprintf(file, "\n]}\n");
+
+    return std::fclose(file) == 0;
+}
+
+} // namespace trace
@@ -0,0 +1,79 @@
+#ifndef GRAVITY_TRACE_H
+#define GRAVITY_TRACE_H
+
+// Low overhead event tracing, dumped in the Chrome trace JSON format that
+// chrome://tracing and Perfetto load.
+//
+// Every thread records into its own fixed size ring buffer, so recording
+// takes no locks and, once a thread's buffer exists, allocates nothing; a
+// full ring keeps the most recent events. Tracing is off until
+// trace::start(), which leaves each scope with an atomic load and a branch.
+// Building with -DGRAVITY_TRACE=0 removes the macros entirely.
+
+#ifndef GRAVITY_TRACE
+#define GRAVITY_TRACE 1
+#endif
+
+#include <atomic>
+#include <cstdint>
+
+namespace trace {
+
+// nanoseconds on a monotonic clock
+uint64_t now();
+
+extern std::atomic<bool> enabled;
+
+inline bool isEnabled() { return enabled.load(std::memory_order_relaxed); }
+
+// events per thread kept before the oldest are overwritten; takes effect for
+// threads that have not recorded yet
+void start(unsigned capacity = 1 << 16);
+void stop();
+
+// name must outlive the trace, which string literals do
+void record(const char* name, uint64_t start, uint64_t end);
+
+// label the calling thread in the dump, cut to 63 characters; allocates
+// nothing until the thread records its first event
+void setThreadName(const char* name);
+
+// write the events that ended at or after since; events being overwritten
+// while the dump runs are left out
+bool writeChromeTrace(const char* path, uint64_t since = 0);
+
+class Scope {
+public:
+    explicit Scope(const char* name)
+        : name(name), active(isEnabled()), start(active ? now() : 0) {}
+
+    ~Scope()
+    {
+        if (active)
+            record(name, start, now());
+    }
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+private:
+    const char* name;
+    bool active;
+    uint64_t start;
+};
+
+} // namespace trace
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+#if GRAVITY_TRACE
+// time the rest of the enclosing block
+#define TRACE_SCOPE(name) trace::Scope TRACE_CONCAT(traceScope, __LINE__)(name)
+#define TRACE_THREAD_NAME(name) trace::setThreadName(name)
+#else
+#define TRACE_SCOPE(name) ((void) 0)
+#define TRACE_THREAD_NAME(name) ((void) 0)
+#endif
+
+#endif
@@ -0,0 +1,393 @@
+#include "transport.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+void Transport::reserve(size_t bytes)
+{
+    for (int r = 0; r < size; r++)
+        outgoing[r].reserve(bytes);
+}
+
+bool Transport::allGather(const Buffer& data, std::vector<Buffer>& in)
+{
+    // assigned rather than copied, so the buffers keep their memory
+    outgoing.resize(size);
+    for (int r = 0; r < size; r++)
+        outgoing[r].assign(data.begin(), data.end());
+    return exchange(outgoing, in);
+}
+
+bool Transport::gather(const Buffer& data, std::vector<Buffer>& in)
+{
+    // rank 0 keeps its own as in[0]
+    outgoing.resize(size);
+    for (int r = 0; r < size; r++)
+        outgoing[r].clear();
+    outgoing[0].assign(data.begin(), data.end());
+    bool ok = exchange(outgoing, in);
+    if (rank != 0)
+        for (int r = 0; r < size; r++)
+            in[r].clear();
+    return ok;
+}
+
+// the two counters are on their own cache lines, each written by one side;
+// capacity bytes of data follow
+struct ShmTransport::Ring {
+    alignas(64) std::atomic<uint64_t> head; // bytes written by the sender
+    alignas(64) std::atomic<uint64_t> tail; // bytes read by the receiver
+
+    Ring() : head(0), tail(0) {}
+
+    char* data() { return (char*) this + sizeof(Ring); }
+
+    size_t push(const char* source, size_t bytes, size_t capacity)
+    {
+        uint64_t h = head.load(std::memory_order_relaxed);
+        uint64_t t = tail.load(std::memory_order_acquire);
+        bytes = std::min<size_t>(bytes, capacity - (h - t));
+        if (bytes == 0)
+            return 0;
+        size_t at = h & (capacity - 1);
+        size_t first = std::min(bytes, capacity - at);
+        std::memcpy(data() + at, source, first);
+        std::memcpy(data(), source + first, bytes - first);
+        head.store(h + bytes, std::memory_order_release);
+        return bytes;
+    }
+
+    size_t pop(char* target, size_t bytes, size_t capacity)
+    {
+        uint64_t t = tail.load(std::memory_order_relaxed);
+        uint64_t h = head.load(std::memory_order_acquire);
+        bytes = std::min<size_t>(bytes, h - t);
+        if (bytes == 0)
+            return 0;
+        size_t at = t & (capacity - 1);
+        size_t first = std::min(bytes, capacity - at);
+        std::memcpy(target, data() + at, first);
+        std::memcpy(target + first, data(), bytes - first);
+        tail.store(t + bytes, std::memory_order_release);
+        return bytes;
+    }
+};
+
+// the processes share the counters, which is only sound if they never
+// fall back to a lock
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "shared memory rings need lock free atomics");
+
+std::unique_ptr<ShmTransport> ShmTransport::create(int size, size_t ringBytes)
+{
+    size_t capacity = 64;
+    while (capacity < ringBytes)
+        capacity *= 2;
+    size_t length = size_t(size) * size * (sizeof(Ring) + capacity);
+
+    void* memory = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        std::cerr << "failed to map " << length << " bytes of shared memory: "
+            << std::strerror(errno) << std::endl;
+        return nullptr;
+    }
+    return std::unique_ptr<ShmTransport>(
+            new ShmTransport(size, capacity, (char*) memory, length));
+}
+
+ShmTransport::ShmTransport(int size, size_t capacity, char* memory, size_t length)
+    : Transport(0, size), capacity(capacity), memory(memory), length(length)
+{
+    for (int from = 0; from < size; from++)
+        for (int to = 0; to < size; to++)
+            new (&ring(from, to)) Ring();
+}
+
+ShmTransport::~ShmTransport()
+{
+    munmap(memory, length);
+}
+
+ShmTransport::Ring& ShmTransport::ring(int from, int to)
+{
+    return *(Ring*) (memory + size_t(from * size + to) * (sizeof(Ring) + capacity));
+}
+
+bool ShmTransport::exchange(const std::vector<Buffer>& out, std::vector<Buffer>& in)
+{
+    TRACE_SCOPE("shm exchange");
+    in.resize(size);
+    in[rank] = out[rank];
+
+    sends.resize(size);
+    receives.resize(size);
+    int pending = 0;
+    for (int peer = 0; peer < size; peer++) {
+        if (peer == rank)
+            continue;
+        sends[peer] = Outgoing(out[peer]);
+        receives[peer] = Incoming(in[peer]);
+        pending += 2;
+    }
+
+    int idle = 0;
+    while (pending > 0) {
+        bool progress = false;
+        for (int peer = 0; peer < size; peer++) {
+            if (peer == rank)
+                continue;
+            size_t bytes;
+            Outgoing& send = sends[peer];
+            if (!send.complete()) {
+                const char* source = send.next(&bytes);
+                size_t moved = ring(rank, peer).push(source, bytes, capacity);
+                send.done += moved;
+                progress |= moved > 0;
+                pending -= send.complete();
+            }
+            Incoming& receive = receives[peer];
+            if (!receive.complete()) {
+                char* target = receive.next(&bytes);
+                size_t moved = ring(peer, rank).pop(target, bytes, capacity);
+                receive.advance(moved);
+                progress |= moved > 0;
+                pending -= receive.complete();
+            }
+        }
+
+        // the peers may share our cores; let them run, and stop burning
+        // one when they are busy with something else
+        if (progress) {
+            idle = 0;
+        } else if (++idle < 1000) {
+            sched_yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    }
+    return true;
+}
+
+static bool writeAll(int socket, const void* data, size_t bytes)
+{
+    const char* p = (const char*) data;
+    while (bytes > 0) {
+        ssize_t n = send(socket, p, bytes, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        bytes -= n;
+    }
+    return true;
+}
+
+static bool readAll(int socket, void* data, size_t bytes)
+{
+    char* p = (char*) data;
+    while (bytes > 0) {
+        ssize_t n = recv(socket, p, bytes, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        bytes -= n;
+    }
+    return true;
+}
+
+static sockaddr_in loopbackAddress(int port)
+{
+    sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(uint16_t(port));
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return address;
+}
+
+TcpTransport::TcpTransport(int rank, int size)
+    : Transport(rank, size), sockets(size, -1)
+{
+    fds.reserve(size);
+    peers.reserve(size);
+}
+
+TcpTransport::~TcpTransport()
+{
+    for (size_t i = 0; i < sockets.size(); i++)
+        if (sockets[i] >= 0)
+            close(sockets[i]);
+}
+
+std::unique_ptr<TcpTransport> TcpTransport::connect(int rank, int size, int basePort,
+        double timeout)
+{
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point deadline = Clock::now()
+        + std::chrono::microseconds(int64_t(timeout * 1e6));
+    std::unique_ptr<TcpTransport> transport(new TcpTransport(rank, size));
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int yes = 1;
+    sockaddr_in address = loopbackAddress(basePort + rank);
+    if (listener < 0
+            || setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) != 0
+            || bind(listener, (sockaddr*) &address, sizeof(address)) != 0
+            || listen(listener, size) != 0) {
+        std::cerr << "rank " << rank << " failed to listen on port " << basePort + rank
+            << ": " << std::strerror(errno) << std::endl;
+        if (listener >= 0)
+            close(listener);
+        return nullptr;
+    }
+
+    // connect to the lower ranks, which may not be listening yet, and
+    // accept the higher ones; connections complete without an accept, so
+    // this never waits in a cycle
+    bool ok = true;
+    for (int peer = 0; peer < rank && ok; peer++) {
+        address = loopbackAddress(basePort + peer);
+        for (;;) {
+            int s = socket(AF_INET, SOCK_STREAM, 0);
+            if (s >= 0 && ::connect(s, (sockaddr*) &address, sizeof(address)) == 0) {
+                transport->sockets[peer] = s;
+                break;
+            }
+            int error = errno;
+            if (s >= 0)
+                close(s);
+            if (error != ECONNREFUSED || Clock::now() > deadline) {
+                std::cerr << "rank " << rank << " failed to connect to rank " << peer
+                    << ": " << std::strerror(error) << std::endl;
+                ok = false;
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        int32_t id = rank;
+        ok = ok && writeAll(transport->sockets[peer], &id, sizeof(id));
+    }
+
+    for (int accepted = rank + 1; accepted < size && ok; accepted++) {
+        int remaining = int(std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - Clock::now()).count());
+        pollfd fd = { listener, POLLIN, 0 };
+        int s = -1;
+        int32_t id = -1;
+        if (remaining > 0 && poll(&fd, 1, remaining) == 1)
+            s = accept(listener, nullptr, nullptr);
+        if (s < 0 || !readAll(s, &id, sizeof(id))
+                || id <= rank || id >= size || transport->sockets[id] >= 0) {
+            std::cerr << "rank " << rank << " failed to accept the higher ranks" << std::endl;
+            if (s >= 0)
+                close(s);
+            ok = false;
+            break;
+        }
+        transport->sockets[id] = s;
+    }
+    close(listener);
+    if (!ok)
+        return nullptr;
+
+    // exchanges are a few small messages per step, send them right away
+    for (int peer = 0; peer < size; peer++) {
+        int s = transport->sockets[peer];
+        if (s < 0)
+            continue;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+    }
+    return transport;
+}
+
+bool TcpTransport::exchange(const std::vector<Buffer>& out, std::vector<Buffer>& in)
+{
+    TRACE_SCOPE("tcp exchange");
+    in.resize(size);
+    in[rank] = out[rank];
+
+    sends.resize(size);
+    receives.resize(size);
+    for (int peer = 0; peer < size; peer++) {
+        if (peer == rank)
+            continue;
+        sends[peer] = Outgoing(out[peer]);
+        receives[peer] = Incoming(in[peer]);
+    }
+
+    for (;;) {
+        fds.clear();
+        peers.clear();
+        for (int peer = 0; peer < size; peer++) {
+            if (peer == rank)
+                continue;
+            short events = (sends[peer].complete() ? 0 : POLLOUT)
+                | (receives[peer].complete() ? 0 : POLLIN);
+            if (events) {
+                pollfd fd = { sockets[peer], events, 0 };
+                fds.push_back(fd);
+                peers.push_back(peer);
+            }
+        }
+        if (fds.empty())
+            return true;
+
+        if (poll(&fds[0], fds.size(), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "poll failed: " << std::strerror(errno) << std::endl;
+            return false;
+        }
+
+        for (size_t i = 0; i < fds.size(); i++) {
+            int peer = peers[i];
+            size_t bytes;
+            ssize_t n = 0;
+            if (!sends[peer].complete() && (fds[i].revents & (POLLOUT | POLLERR | POLLHUP))) {
+                const char* source = sends[peer].next(&bytes);
+                n = send(fds[i].fd, source, bytes, MSG_NOSIGNAL);
+                if (n > 0)
+                    sends[peer].done += n;
+            }
+            if (n >= 0 && !receives[peer].complete()
+                    && (fds[i].revents & (POLLIN | POLLERR | POLLHUP))) {
+                char* target = receives[peer].next(&bytes);
+                n = recv(fds[i].fd, target, bytes, 0);
+                if (n > 0)
+                    receives[peer].advance(n);
+                if (n == 0) {
+                    // closed before the whole message arrived
+                    n = -1;
+                    errno = ECONNRESET;
+                }
+            }
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                std::cerr << "rank " << rank << " lost rank " << peer << ": "
+                    << std::strerror(errno) << std::endl;
+                return false;
+            }
+        }
+    }
+}
@@ -0,0 +1,161 @@
+#ifndef GRAVITY_TRANSPORT_H
+#define GRAVITY_TRANSPORT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <poll.h>
+
+// Message passing between the processes of a distributed run, ranks 0 to
+// getSize() - 1. Every call is collective: all ranks make it, in the same
+// order. A peer that goes away makes the calls return false where that can
+// be detected.
+class Transport {
+public:
+    typedef std::vector<char> Buffer;
+
+    virtual ~Transport() {}
+
+    int getRank() const { return rank; }
+    int getSize() const { return size; }
+
+    // send out[r] to every other rank r while receiving in[r] from it, so
+    // neither side waits for the other to read first; in[getRank()] is a
+    // copy of out[getRank()]
+    virtual bool exchange(const std::vector<Buffer>& out, std::vector<Buffer>& in) = 0;
+
+    // the same data to every rank, in[r] from rank r
+    bool allGather(const Buffer& data, std::vector<Buffer>& in);
+
+    // data from every rank on rank 0, which gets in[r] from rank r; the
+    // others get empty buffers
+    bool gather(const Buffer& data, std::vector<Buffer>& in);
+
+    // make room for allGather and gather to send up to bytes each, so that
+    // they allocate nothing for messages that size or smaller
+    void reserve(size_t bytes);
+
+protected:
+    // A message on the wire is its length followed by its bytes. These track
+    // how much of one has gone out or come in, a contiguous piece at a time.
+    struct Outgoing {
+        uint64_t length;
+        const char* data;
+        size_t done;
+
+        Outgoing() : length(0), data(nullptr), done(0) {}
+        explicit Outgoing(const Buffer& buffer)
+            : length(buffer.size()), data(buffer.data()), done(0) {}
+
+        bool complete() const { return done == sizeof(length) + length; }
+
+        const char* next(size_t* bytes) const
+        {
+            if (done < sizeof(length)) {
+                *bytes = sizeof(length) - done;
+                return (const char*) &length + done;
+            }
+            *bytes = sizeof(length) + length - done;
+            return data + (done - sizeof(length));
+        }
+    };
+
+    // the buffer keeps its memory from one message to the next, and only
+    // grows for a longer one
+    struct Incoming {
+        uint64_t length;
+        Buffer* data;
+        size_t done;
+
+        Incoming() : length(0), data(nullptr), done(0) {}
+        explicit Incoming(Buffer& buffer) : length(0), data(&buffer), done(0) {}
+
+        bool complete() const
+        {
+            return done >= sizeof(length) && done == sizeof(length) + length;
+        }
+
+        char* next(size_t* bytes)
+        {
+            if (done < sizeof(length)) {
+                *bytes = sizeof(length) - done;
+                return (char*) &length + done;
+            }
+            *bytes = sizeof(length) + length - done;
+            return data->data() + (done - sizeof(length));
+        }
+
+        void advance(size_t bytes)
+        {
+            done += bytes;
+            if (done == sizeof(length))
+                data->resize(length);
+        }
+    };
+
+    Transport(int rank, int size)
+        : rank(rank), size(size), sends(size), receives(size), outgoing(size) {}
+
+    int rank, size;
+
+    // kept between calls, so that exchanging allocates nothing once the
+    // buffers have grown to the largest messages
+    std::vector<Outgoing> sends;
+    std::vector<Incoming> receives;
+    std::vector<Buffer> outgoing;
+};
+
+// A single-producer, single-consumer ring buffer in shared memory for every
+// ordered pair of ranks. The mapping is made before forking the ranks, which
+// inherit it; each process then picks its rank. A peer that dies is not
+// noticed, so the launcher has to take the others down with it.
+class ShmTransport : public Transport {
+public:
+    // ringBytes is rounded up to a power of two; nullptr if mapping fails
+    static std::unique_ptr<ShmTransport> create(int size, size_t ringBytes = 1 << 20);
+    ~ShmTransport();
+
+    ShmTransport(const ShmTransport&) = delete;
+    ShmTransport& operator=(const ShmTransport&) = delete;
+
+    void setRank(int rank) { this->rank = rank; }
+
+    bool exchange(const std::vector<Buffer>& out, std::vector<Buffer>& in);
+
+private:
+    struct Ring;
+
+    ShmTransport(int size, size_t capacity, char* memory, size_t length);
+    Ring& ring(int from, int to);
+
+    size_t capacity;
+    char* memory;
+    size_t length;
+};
+
+// Sockets between every pair of ranks over the loopback interface, rank r
+// listening on basePort + r.
+class TcpTransport : public Transport {
+public:
+    // connect to all the other ranks, waiting up to timeout seconds for
+    // them to start listening; nullptr, having printed why, on failure
+    static std::unique_ptr<TcpTransport> connect(int rank, int size, int basePort,
+            double timeout = 10.0);
+    ~TcpTransport();
+
+    TcpTransport(const TcpTransport&) = delete;
+    TcpTransport& operator=(const TcpTransport&) = delete;
+
+    bool exchange(const std::vector<Buffer>& out, std::vector<Buffer>& in);
+
+private:
+    TcpTransport(int rank, int size);
+
+    std::vector<int> sockets; // by rank, -1 for this one
+    std::vector<pollfd> fds;
+    std::vector<int> peers; // of each of fds
+};
+
+#endif
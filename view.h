@@ -0,0 +1,24 @@
+#ifndef GRAVITY_VIEW_H
+#define GRAVITY_VIEW_H
+
+// Fits the [-1,1]^2 simulation box into a width x height framebuffer,
+// keeping it square and centred whatever the aspect ratio.
+struct View {
+    float scaleX, scaleY; // world to normalised device coordinates
+
+    View(int width, int height)
+    {
+        float aspect = float(width) / float(height);
+        scaleX = aspect > 1.0f ? 1.0f / aspect : 1.0f;
+        scaleY = aspect > 1.0f ? 1.0f : aspect;
+    }
+
+    // u, v in [0,1] across the window from its top left corner
+    void toWorld(double u, double v, float* x, float* y) const
+    {
+        *x = float((2.0*u - 1.0) / scaleX);
+        *y = float((1.0 - 2.0*v) / scaleY);
+    }
+};
+
+#endif